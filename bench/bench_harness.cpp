@@ -0,0 +1,215 @@
+#include "bench_harness.h"
+
+#include "alloc_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    double MeasureNs(const BenchRunner::Body& body, size_t iterations) {
+        const auto start = Clock::now();
+        body(iterations);
+        const auto finish = Clock::now();
+        return std::chrono::duration<double, std::nano>(finish - start).count();
+    }
+
+    // Перцентиль по методу ближайшего ранга; values упорядочены
+    double Percentile(const std::vector<double>& values, double percent) {
+        const auto rank = static_cast<size_t>(std::ceil(percent / 100.0 * static_cast<double>(values.size())));
+        return values[std::clamp<size_t>(rank, 1, values.size()) - 1];
+    }
+
+    size_t ParseCount(std::string_view arg, std::string_view value) {
+        size_t result = 0;
+        for (char c : value) {
+            if (c < '0' || c > '9') {
+                throw std::invalid_argument("Invalid number in " + std::string(arg));
+            }
+            result = result * 10 + static_cast<size_t>(c - '0');
+        }
+        if (value.empty() || result == 0) {
+            throw std::invalid_argument("Invalid number in " + std::string(arg));
+        }
+        return result;
+    }
+
+    void WriteJsonString(std::ostream& output, std::string_view text) {
+        output << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                output << '\\';
+            }
+            output << c;
+        }
+        output << '"';
+    }
+
+}  // namespace
+
+BenchOptions ParseBenchOptions(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        auto value_of = [arg](std::string_view prefix) {
+            return arg.substr(0, prefix.size()) == prefix ? arg.substr(prefix.size()) : std::string_view{};
+        };
+        if (auto value = value_of("--samples="); !value.empty()) {
+            options.samples = ParseCount(arg, value);
+        } else if (auto value = value_of("--warmup-ms="); !value.empty()) {
+            options.warmup = std::chrono::milliseconds(ParseCount(arg, value));
+        } else if (auto value = value_of("--sample-us="); !value.empty()) {
+            options.sample_time = std::chrono::microseconds(ParseCount(arg, value));
+        } else if (auto value = value_of("--filter="); !value.empty()) {
+            options.filter = value;
+        } else if (auto value = value_of("--json="); !value.empty()) {
+            options.json_path = value;
+        } else if (arg == "--perf") {
+            options.perf_counters = true;
+        } else {
+            throw std::invalid_argument("Unknown argument: " + std::string(arg));
+        }
+    }
+    return options;
+}
+
+BenchRunner::BenchRunner(BenchOptions options)
+    : options_(std::move(options)) {
+}
+
+void BenchRunner::Add(std::string name, Body body) {
+    benchmarks_.emplace_back(std::move(name), std::move(body));
+}
+
+std::vector<BenchResult> BenchRunner::Run(std::ostream& log) const {
+    std::vector<BenchResult> results;
+    // Счётчики открываются один раз для всех бенчмарков этого потока
+    std::optional<PerfCounters> counters;
+    if (options_.perf_counters) {
+        counters.emplace();
+        if (!counters->IsAvailable()) {
+            log << "perf counters are unavailable (" << counters->GetError() << ")\n";
+            counters.reset();
+        } else if (!counters->GetError().empty()) {
+            log << "some perf counters are unavailable (" << counters->GetError() << ")\n";
+        }
+    }
+    log << std::left << std::setw(32) << "benchmark" << std::right << std::setw(12) << "median ns"
+        << std::setw(12) << "p90 ns" << std::setw(12) << "p99 ns" << std::setw(12) << "iterations";
+    if (IsAllocStatsEnabled()) {
+        log << std::setw(12) << "allocs/op" << std::setw(12) << "bytes/op";
+    }
+    if (counters) {
+        log << std::setw(12) << "cycles/op" << std::setw(12) << "instr/op" << std::setw(12) << "cache-miss"
+            << std::setw(12) << "br-miss" << std::setw(12) << "dtlb-miss";
+    }
+    log << '\n';
+    for (const auto& [name, body] : benchmarks_) {
+        if (name.find(options_.filter) == std::string::npos) {
+            continue;
+        }
+        const BenchResult& result = results.emplace_back(RunOne(name, body, counters ? &*counters : nullptr));
+        log << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(12) << result.median << std::setw(12) << result.p90 << std::setw(12) << result.p99
+            << std::setw(12) << result.iterations;
+        if (IsAllocStatsEnabled()) {
+            log << std::setw(12) << result.allocations_per_op << std::setw(12) << result.bytes_per_op;
+        }
+        if (counters) {
+            for (const auto& value : result.counters_per_op) {
+                if (value) {
+                    log << std::setw(12) << *value;
+                } else {
+                    log << std::setw(12) << '-';
+                }
+            }
+        }
+        log << std::endl;
+    }
+    return results;
+}
+
+BenchResult BenchRunner::RunOne(const std::string& name, const Body& body, PerfCounters* counters) const {
+    // Подбираем число итераций, при котором замер длится не меньше sample_time
+    const double sample_ns = std::chrono::duration<double, std::nano>(options_.sample_time).count();
+    size_t iterations = 1;
+    while (MeasureNs(body, iterations) < sample_ns && iterations < (size_t{ 1 } << 40)) {
+        iterations *= 2;
+    }
+
+    const auto warmup_end = Clock::now() + options_.warmup;
+    while (Clock::now() < warmup_end) {
+        MeasureNs(body, iterations);
+    }
+
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    for (size_t i = 0; i < options_.samples; ++i) {
+        result.ns_per_op.push_back(MeasureNs(body, iterations) / static_cast<double>(iterations));
+    }
+    // Выделения считаются отдельным прогоном, чтобы учёт не влиял на замеры
+    if (IsAllocStatsEnabled()) {
+        const AllocCounters before = GetThreadAllocCounters();
+        body(iterations);
+        const AllocCounters after = GetThreadAllocCounters();
+        result.allocations_per_op = static_cast<double>(after.allocations - before.allocations) / static_cast<double>(iterations);
+        result.bytes_per_op = static_cast<double>(after.bytes - before.bytes) / static_cast<double>(iterations);
+    }
+    // Счётчики тоже снимаются отдельным прогоном: чтение счётчиков - системные вызовы
+    if (counters != nullptr) {
+        counters->Start();
+        body(iterations);
+        const PerfCounterValues values = counters->Stop();
+        for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            if (values[i]) {
+                result.counters_per_op[i] = *values[i] / static_cast<double>(iterations);
+            }
+        }
+    }
+    std::sort(result.ns_per_op.begin(), result.ns_per_op.end());
+    result.median = Percentile(result.ns_per_op, 50);
+    result.p90 = Percentile(result.ns_per_op, 90);
+    result.p99 = Percentile(result.ns_per_op, 99);
+    result.min = result.ns_per_op.front();
+    result.max = result.ns_per_op.back();
+    return result;
+}
+
+void BenchRunner::WriteJson(std::ostream& output, const std::vector<BenchResult>& results) {
+    output << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        output << (i == 0 ? "\n" : ",\n") << "    {\"name\": ";
+        WriteJsonString(output, result.name);
+        output << std::setprecision(3) << std::fixed
+               << ", \"iterations\": " << result.iterations
+               << ", \"samples\": " << result.ns_per_op.size()
+               << ", \"median_ns\": " << result.median
+               << ", \"p90_ns\": " << result.p90
+               << ", \"p99_ns\": " << result.p99
+               << ", \"min_ns\": " << result.min
+               << ", \"max_ns\": " << result.max
+               << ", \"allocs_per_op\": " << result.allocations_per_op
+               << ", \"bytes_per_op\": " << result.bytes_per_op;
+        // Недоступные счётчики в JSON не пишутся
+        output << ", \"counters_per_op\": {";
+        bool first = true;
+        for (size_t j = 0; j < PERF_COUNTER_COUNT; ++j) {
+            if (const auto& value = result.counters_per_op[j]) {
+                output << (first ? "" : ", ") << '"' << GetPerfCounterName(static_cast<PerfCounter>(j)) << "\": " << *value;
+                first = false;
+            }
+        }
+        output << "}}";
+    }
+    output << "\n  ]\n}\n";
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "perf_counters.h"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Не даёт компилятору выбросить вычисление value как неиспользуемое
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+// Настройки запуска бенчмарков (задаются аргументами командной строки)
+struct BenchOptions {
+    // Число замеров, по которым считаются медиана и перцентили
+    size_t samples = 30;
+    // Время прогрева перед замерами; прогревочные замеры отбрасываются
+    std::chrono::milliseconds warmup{ 200 };
+    // Желаемая длительность одного замера: число итераций в замере
+    // подбирается так, чтобы на него уходило не меньше этого времени
+    std::chrono::microseconds sample_time{ 5000 };
+    // Запускаются только бенчмарки, имя которых содержит filter
+    std::string filter;
+    // Файл для результатов в JSON ("-" - стандартный вывод, пусто - не писать)
+    std::string json_path;
+    // Считать аппаратные счётчики процессора (см. perf_counters.h)
+    bool perf_counters = false;
+};
+
+// Разбирает аргументы --samples=N, --warmup-ms=N, --sample-us=N,
+// --filter=S, --json=PATH и --perf. Бросает std::invalid_argument при ошибке
+BenchOptions ParseBenchOptions(int argc, char** argv);
+
+// Результат бенчмарка: время одной операции в наносекундах по замерам
+struct BenchResult {
+    std::string name;
+    size_t iterations = 0;  // итераций в одном замере
+    std::vector<double> ns_per_op;  // по замеру, по возрастанию
+    double median = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double min = 0;
+    double max = 0;
+    // Выделения памяти на операцию в вызывающем потоке (только в сборке с
+    // SPREADSHEET_ALLOC_STATS, иначе нули)
+    double allocations_per_op = 0;
+    double bytes_per_op = 0;
+    // Аппаратные счётчики на операцию (с --perf и если счётчик доступен)
+    PerfCounterValues counters_per_op;
+};
+
+// Набор бенчмарков. Тело бенчмарка выполняет измеряемую операцию iterations
+// раз; подготовка данных выполняется до регистрации и в замер не входит.
+class BenchRunner {
+public:
+    using Body = std::function<void(size_t iterations)>;
+
+    explicit BenchRunner(BenchOptions options);
+
+    void Add(std::string name, Body body);
+
+    // Запускает бенчмарки, подходящие под фильтр, печатая таблицу в log
+    std::vector<BenchResult> Run(std::ostream& log) const;
+
+    // Пишет результаты в JSON для сравнения между версиями
+    static void WriteJson(std::ostream& output, const std::vector<BenchResult>& results);
+
+private:
+    // counters - открытые счётчики процессора или nullptr
+    BenchResult RunOne(const std::string& name, const Body& body, PerfCounters* counters) const;
+
+private:
+    BenchOptions options_;
+    std::vector<std::pair<std::string, Body>> benchmarks_;
+};
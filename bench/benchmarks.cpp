@@ -0,0 +1,263 @@
+#include "bench_harness.h"
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+#include "workload.h"
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Микробенчмарки горячих путей: разбор и вычисление формул, запись и чтение
+// ячеек, печать таблицы, преобразование позиций. Запуск:
+//   spreadsheet_bench [--filter=S] [--samples=N] [--json=PATH|-]
+
+namespace {
+
+    const std::vector<std::string> kFormulas = {
+        "1+2*3",
+        "(1.5+2.25)/(3-4.75)*-2",
+        "((((1+2)*3)-4)/5)+((6*7)-(8/9))*10",
+        "1+2+3+4+5+6+7+8+9+10+11+12+13+14+15+16",
+    };
+
+    // Таблица rows x cols: числа и формулы, четверть столбцов - текст
+    std::unique_ptr<SheetInterface> MakeSheet(int rows, int cols) {
+        WorkloadOptions options = DenseNumericWorkload({ rows, cols });
+        options.text_column_ratio = 0.25;
+        auto sheet = CreateSheet();
+        FillSheet(*sheet, options);
+        return sheet;
+    }
+
+    void AddFormulaBenchmarks(BenchRunner& runner) {
+        for (size_t i = 0; i < kFormulas.size(); ++i) {
+            const std::string suffix = "/" + std::to_string(i);
+            const std::string& expression = kFormulas[i];
+
+            runner.Add("ParseFormula" + suffix, [expression](size_t iterations) {
+                for (size_t n = 0; n < iterations; ++n) {
+                    auto formula = ParseFormula(expression);
+                    DoNotOptimize(formula);
+                }
+            });
+            runner.Add("ParseFormulaAST" + suffix, [expression](size_t iterations) {
+                for (size_t n = 0; n < iterations; ++n) {
+                    FormulaAST ast = ParseFormulaAST(expression);
+                    DoNotOptimize(ast);
+                }
+            });
+
+            // Перемещение FormulaAST требует полного типа ASTImpl::Expr, поэтому
+            // дерево создаётся сразу в куче
+            std::shared_ptr<const FormulaAST> ast(new FormulaAST(ParseFormulaAST(expression)));
+            runner.Add("FormulaAST::Execute" + suffix, [ast](size_t iterations) {
+                for (size_t n = 0; n < iterations; ++n) {
+                    double value = ast->Execute();
+                    DoNotOptimize(value);
+                }
+            });
+
+            std::shared_ptr<FormulaInterface> formula = ParseFormula(expression);
+            runner.Add("Formula::Evaluate" + suffix, [formula](size_t iterations) {
+                for (size_t n = 0; n < iterations; ++n) {
+                    auto value = formula->Evaluate();
+                    DoNotOptimize(value);
+                }
+            });
+        }
+    }
+
+    void AddSheetBenchmarks(BenchRunner& runner) {
+        // Запись обходит квадрат 256 x 256, чтобы затрагивать несколько плиток
+        runner.Add("Sheet::SetCell/text", [sheet = std::shared_ptr(CreateSheet())](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                sheet->SetCell({ static_cast<int>(n / 256 % 256), static_cast<int>(n % 256) }, "value");
+            }
+        });
+        runner.Add("Sheet::SetCell/formula", [sheet = std::shared_ptr(CreateSheet())](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                sheet->SetCell({ static_cast<int>(n / 256 % 256), static_cast<int>(n % 256) }, "=1+2*3");
+            }
+        });
+
+        std::shared_ptr<const SheetInterface> filled = MakeSheet(256, 64);
+        runner.Add("Sheet::GetCell/hit", [filled](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                const CellInterface* cell = filled->GetCell({ static_cast<int>(n % 256), static_cast<int>(n / 256 % 64) });
+                DoNotOptimize(cell);
+            }
+        });
+        runner.Add("Sheet::GetCell/miss", [filled](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                const CellInterface* cell = filled->GetCell({ static_cast<int>(n % 256) + 1000, static_cast<int>(n / 256 % 64) });
+                DoNotOptimize(cell);
+            }
+        });
+        // Чтение в параллельном режиме, пока 16 потоков дописывают строки в
+        // свои блоки по 128 столбцов, а читатели читают уже записанные строки
+        // этих блоков. Время операции - время одного чтения всеми читателями
+        // вместе, поэтому при масштабировании чтения оно падает обратно
+        // пропорционально числу читателей (до числа ядер)
+        constexpr int kWriters = 16;
+        constexpr int kIngestRows = 1024;
+        auto ingested = std::make_shared<Sheet>();
+        ingested->SetConcurrentMode(true);
+        for (int row = 0; row < kIngestRows; ++row) {
+            for (int writer = 0; writer < kWriters; ++writer) {
+                ingested->SetCell({ row, writer * CellGrid::TILE_SIZE }, std::to_string(row));
+            }
+        }
+        for (const int readers : { 1, 2, 4, 8 }) {
+            runner.Add("Sheet::GetCell/concurrent/" + std::to_string(readers) + "r16w",
+                       [ingested, readers](size_t iterations) {
+                std::atomic<bool> stop = false;
+                std::vector<std::thread> writers;
+                for (int writer = 0; writer < kWriters; ++writer) {
+                    writers.emplace_back([&, writer] {
+                        for (int n = 0; !stop.load(std::memory_order_relaxed); ++n) {
+                            ingested->SetCell({ kIngestRows + n % kIngestRows, writer * CellGrid::TILE_SIZE + n / kIngestRows % 64 }, "x");
+                        }
+                    });
+                }
+                std::vector<std::thread> threads;
+                for (int reader = 0; reader < readers; ++reader) {
+                    threads.emplace_back([&, reader] {
+                        const size_t begin = iterations * reader / readers;
+                        const size_t end = iterations * (reader + 1) / readers;
+                        for (size_t n = begin; n < end; ++n) {
+                            const auto row = static_cast<int>(n * 7 % kIngestRows);
+                            const auto col = static_cast<int>(n % kWriters) * CellGrid::TILE_SIZE;
+                            const CellInterface* cell = std::as_const(*ingested).GetCell({ row, col });
+                            DoNotOptimize(cell);
+                        }
+                    });
+                }
+                for (std::thread& thread : threads) {
+                    thread.join();
+                }
+                stop = true;
+                for (std::thread& thread : writers) {
+                    thread.join();
+                }
+            });
+        }
+
+        runner.Add("Sheet::GetPrintableSize", [filled](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                Size size = filled->GetPrintableSize();
+                DoNotOptimize(size);
+            }
+        });
+        // Повторный запрос без изменений обходит только плитки
+        auto measured = std::make_shared<Sheet>();
+        FillSheet(*measured, DenseNumericWorkload({ 256, 64 }));
+        runner.Add("Sheet::GetMemoryStats", [measured](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                SheetMemoryStats stats = measured->GetMemoryStats();
+                DoNotOptimize(stats);
+            }
+        });
+
+        // Импорт разных форм таблиц из текста в формате PrintTexts
+        const std::pair<std::string, WorkloadOptions> imports[] = {
+            { "dense", DenseNumericWorkload({ 200, 50 }) },
+            { "sparse", SparseScatterWorkload({ 2000, 500 }, 0.01) },
+            { "text", TextColumnsWorkload({ 200, 50 }, 64) },
+            { "deep", DeepFormulaWorkload({ 100, 20 }, 16) },
+        };
+        for (const auto& [shape, options] : imports) {
+            std::ostringstream tsv;
+            WriteWorkloadTsv(tsv, options);
+            runner.Add("Sheet::ImportTexts/" + shape, [data = tsv.str()](size_t iterations) {
+                for (size_t n = 0; n < iterations; ++n) {
+                    Sheet sheet;
+                    ImportResult result = sheet.ImportTexts(data);
+                    DoNotOptimize(result);
+                }
+            });
+        }
+
+        std::shared_ptr<const SheetInterface> printed = MakeSheet(64, 16);
+        runner.Add("Sheet::PrintValues/64x16", [printed](size_t iterations) {
+            std::ostringstream output;
+            for (size_t n = 0; n < iterations; ++n) {
+                output.str({});
+                printed->PrintValues(output);
+            }
+            DoNotOptimize(output);
+        });
+        runner.Add("Sheet::PrintTexts/64x16", [printed](size_t iterations) {
+            std::ostringstream output;
+            for (size_t n = 0; n < iterations; ++n) {
+                output.str({});
+                printed->PrintTexts(output);
+            }
+            DoNotOptimize(output);
+        });
+    }
+
+    void AddPositionBenchmarks(BenchRunner& runner) {
+        std::vector<Position> positions;
+        for (int i = 0; i < 1024; ++i) {
+            positions.push_back({ i * 15 % Position::MAX_ROWS, i * 7 % Position::MAX_COLS });
+        }
+        std::vector<std::string> names;
+        for (const Position& pos : positions) {
+            names.push_back(pos.ToString());
+        }
+
+        runner.Add("Position::ToString", [positions](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                std::string name = positions[n % positions.size()].ToString();
+                DoNotOptimize(name);
+            }
+        });
+        runner.Add("Position::FromString", [names](size_t iterations) {
+            for (size_t n = 0; n < iterations; ++n) {
+                Position pos = Position::FromString(names[n % names.size()]);
+                DoNotOptimize(pos);
+            }
+        });
+    }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    try {
+        options = ParseBenchOptions(argc, argv);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << '\n'
+                  << "Usage: " << argv[0]
+                  << " [--filter=S] [--samples=N] [--warmup-ms=N] [--sample-us=N] [--json=PATH|-] [--perf]\n";
+        return 2;
+    }
+    const std::string json_path = options.json_path;
+
+    BenchRunner runner(std::move(options));
+    AddFormulaBenchmarks(runner);
+    AddSheetBenchmarks(runner);
+    AddPositionBenchmarks(runner);
+
+    // При выводе JSON в stdout таблица уходит в stderr, чтобы не смешиваться
+    const auto results = runner.Run(json_path == "-" ? std::cerr : std::cout);
+    if (json_path == "-") {
+        BenchRunner::WriteJson(std::cout, results);
+    } else if (!json_path.empty()) {
+        std::ofstream output(json_path);
+        if (!output) {
+            std::cerr << "Cannot open " << json_path << '\n';
+            return 1;
+        }
+        BenchRunner::WriteJson(output, results);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "perf_counters.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#endif
+
+namespace {
+
+#if defined(__linux__)
+
+    struct EventConfig {
+        uint32_t type;
+        uint64_t config;
+    };
+
+    EventConfig GetEventConfig(PerfCounter counter) {
+        switch (counter) {
+        case PerfCounter::Cycles: return { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES };
+        case PerfCounter::Instructions: return { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS };
+        case PerfCounter::CacheMisses: return { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES };
+        case PerfCounter::BranchMisses: return { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES };
+        case PerfCounter::DtlbMisses:
+            return { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+        case PerfCounter::Count: break;
+        }
+        return { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES };
+    }
+
+    int OpenCounter(PerfCounter counter) {
+        const EventConfig event = GetEventConfig(counter);
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = event.type;
+        attr.config = event.config;
+        attr.disabled = 1;
+        // События ядра обычно недоступны без прав; замеряется только свой код
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Учитываются и потоки, созданные после открытия счётчика (пул ParallelFor)
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+#endif
+
+}  // namespace
+
+const char* GetPerfCounterName(PerfCounter counter) {
+    switch (counter) {
+    case PerfCounter::Cycles: return "cycles";
+    case PerfCounter::Instructions: return "instructions";
+    case PerfCounter::CacheMisses: return "cache_misses";
+    case PerfCounter::BranchMisses: return "branch_misses";
+    case PerfCounter::DtlbMisses: return "dtlb_misses";
+    case PerfCounter::Count: break;
+    }
+    return "unknown";
+}
+
+PerfCounters::PerfCounters() {
+    fds_.fill(-1);
+#if defined(__linux__)
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        const auto counter = static_cast<PerfCounter>(i);
+        fds_[i] = OpenCounter(counter);
+        if (fds_[i] < 0 && error_.empty()) {
+            error_ = std::string(GetPerfCounterName(counter)) + ": " + std::strerror(errno);
+        }
+    }
+#else
+    error_ = "perf_event_open is not supported on this platform";
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+#endif
+}
+
+bool PerfCounters::IsAvailable() const {
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PerfCounters::Start() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+PerfCounterValues PerfCounters::Stop() {
+    PerfCounterValues values;
+#if defined(__linux__)
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        // Значение, время включения и время работы счётчика
+        uint64_t data[3] = {};
+        if (fds_[i] < 0 || read(fds_[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[2] == 0) {
+            continue;
+        }
+        values[i] = static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]);
+    }
+#endif
+    return values;
+}
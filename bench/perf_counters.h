@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <string>
+
+// Аппаратные счётчики производительности процессора (Linux perf_event_open).
+// Считаются только события пользовательского режима вызывающего потока и
+// потоков, которые он создал после открытия счётчиков: в значения входит работа
+// рабочих потоков ParallelFor, если пул запущен после создания PerfCounters.
+// Потоки, существовавшие до открытия счётчиков, не учитываются.
+// Если ядро не разрешает счётчики (perf_event_paranoid, контейнер, виртуальная
+// машина без PMU) или система не Linux, счётчики просто недоступны.
+
+enum class PerfCounter {
+    Cycles,
+    Instructions,
+    CacheMisses,   // промахи последнего уровня кеша
+    BranchMisses,
+    DtlbMisses,    // промахи TLB данных при чтении
+    Count,
+};
+
+constexpr size_t PERF_COUNTER_COUNT = static_cast<size_t>(PerfCounter::Count);
+
+const char* GetPerfCounterName(PerfCounter counter);
+
+// Значения по счётчикам; отсутствует значение недоступного счётчика
+using PerfCounterValues = std::array<std::optional<double>, PERF_COUNTER_COUNT>;
+
+class PerfCounters {
+public:
+    // Открывает все доступные счётчики текущего потока и его будущих потоков
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Открыт ли хотя бы один счётчик
+    bool IsAvailable() const;
+    // Причина, по которой не открылся первый недоступный счётчик
+    const std::string& GetError() const {
+        return error_;
+    }
+
+    // Обнуляет и запускает счётчики
+    void Start();
+    // Останавливает счётчики и возвращает их значения. Если ядро делило
+    // счётчик с другими событиями, значение пересчитывается на всё время замера
+    PerfCounterValues Stop();
+
+private:
+    std::array<int, PERF_COUNTER_COUNT> fds_;
+    std::string error_;
+};
@@ -5,7 +5,9 @@
 
 #include <forward_list>
 #include <functional>
+#include <optional>
 #include <stdexcept>
+#include <string_view>
 
 //     AST (Abstract Syntax Tree)
 namespace ASTImpl {
@@ -38,6 +40,10 @@ public:
     //       
     void PrintFormula(std::ostream& out) const;
 
+    //          
+    size_t GetNodeCount() const;
+    size_t GetMemoryUsage() const;
+
 private:
     //     AST
     std::unique_ptr<ASTImpl::Expr> root_expr_;
@@ -47,4 +53,8 @@ private:
 FormulaAST ParseFormulaAST(std::istream& in);
 
 //    AST   
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+//        AST   .
+//       std::nullopt,   
+std::optional<size_t> CheckFormulaSyntax(std::string_view expression);
\ No newline at end of file
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+// Учёт выделений памяти. Сборка с SPREADSHEET_ALLOC_STATS=1 (опция CMake
+// SPREADSHEET_ALLOC_STATS) подменяет глобальные operator new и operator
+// delete и учитывает выделения ресурса pmr CountingMemoryResource: выделения
+// считаются по потокам и приписываются вызову публичного метода
+// (SPREADSHEET_ALLOC_SCOPE), внутри которого они произошли. Вложенные
+// вызовы учитываются во внешнем. Без опции макрос не порождает кода, а
+// счётчики всегда нулевые.
+
+#ifndef SPREADSHEET_ALLOC_STATS
+#define SPREADSHEET_ALLOC_STATS 0
+#endif
+
+struct AllocCounters {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+};
+
+// Выделения, приписанные одной операции
+struct AllocOpStats {
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+};
+
+inline constexpr bool IsAllocStatsEnabled() {
+    return SPREADSHEET_ALLOC_STATS != 0;
+}
+
+// Выделения текущего потока с его начала (разность двух показаний - выделения
+// между ними), включая выделения задач, поручённых им рабочим потокам
+// (см. AllocDelegation)
+AllocCounters GetThreadAllocCounters();
+
+// Статистика по операциям всех потоков, по убыванию числа байт
+std::vector<AllocOpStats> GetAllocStats();
+void ResetAllocStats();
+// Печатает таблицу: операция, вызовы, выделения и байты на вызов
+void DumpAllocStats(std::ostream& output);
+
+// Ресурс pmr, считающий выделения и передающий их вышестоящему ресурсу. В
+// сборке с SPREADSHEET_ALLOC_STATS=1 выделения ресурса учитываются в счётчиках
+// потока и приписываются текущей операции, как выделения operator new; вызовы
+// operator new вышестоящим ресурсом при этом второй раз не считаются.
+// Собственные счётчики ресурса работают в любой сборке
+class CountingMemoryResource : public std::pmr::memory_resource {
+public:
+    explicit CountingMemoryResource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+        : upstream_(upstream) {
+    }
+
+    AllocCounters GetCounters() const {
+        return { allocations_.load(std::memory_order_relaxed), bytes_.load(std::memory_order_relaxed) };
+    }
+    // Байты, выделенные и ещё не освобождённые
+    uint64_t GetBytesInUse() const {
+        return in_use_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+private:
+    std::pmr::memory_resource* upstream_;
+    std::atomic<uint64_t> allocations_{ 0 };
+    std::atomic<uint64_t> bytes_{ 0 };
+    std::atomic<uint64_t> in_use_{ 0 };
+};
+
+// Выделения, сделанные другими потоками по поручению текущего (задачи
+// ParallelFor). Объект создаётся в поручающем потоке до раздачи задач, рабочие
+// потоки выполняют задачи через RunTask(). Пока задача выполняется, операции
+// рабочего потока считаются вложенными в текущую операцию поручившего потока.
+// При разрушении объекта выделения задач добавляются к счётчикам поручившего
+// потока, а значит и к его текущей операции. Разрушается после завершения всех
+// задач в том же потоке, где создан
+class AllocDelegation {
+public:
+    AllocDelegation();
+    ~AllocDelegation();
+
+    AllocDelegation(const AllocDelegation&) = delete;
+    AllocDelegation& operator=(const AllocDelegation&) = delete;
+
+    template <typename Func>
+    void RunTask(Func&& func) {
+        const AllocCounters start = BeginTask();
+        func();
+        EndTask(start);
+    }
+
+private:
+    AllocCounters BeginTask();
+    void EndTask(AllocCounters start);
+
+private:
+    // У поручившего потока есть открытая операция
+    const bool in_scope_;
+    std::atomic<uint64_t> allocations_{ 0 };
+    std::atomic<uint64_t> bytes_{ 0 };
+};
+
+#if SPREADSHEET_ALLOC_STATS
+
+namespace alloc_stats_detail {
+
+    void BeginScope();
+    void EndScope(const char* name);
+
+    // Приписывает выделения от создания до разрушения операции name
+    class AllocScope {
+    public:
+        explicit AllocScope(const char* name)
+            : name_(name) {
+            BeginScope();
+        }
+        ~AllocScope() {
+            EndScope(name_);
+        }
+
+        AllocScope(const AllocScope&) = delete;
+        AllocScope& operator=(const AllocScope&) = delete;
+
+    private:
+        const char* name_;
+    };
+
+}  // namespace alloc_stats_detail
+
+#define SPREADSHEET_ALLOC_CONCAT2(a, b) a##b
+#define SPREADSHEET_ALLOC_CONCAT(a, b) SPREADSHEET_ALLOC_CONCAT2(a, b)
+// Приписывает выделения до конца области видимости операции name (строковый литерал)
+#define SPREADSHEET_ALLOC_SCOPE(name) \
+    const alloc_stats_detail::AllocScope SPREADSHEET_ALLOC_CONCAT(alloc_scope_, __LINE__)(name)
+
+#else
+
+#define SPREADSHEET_ALLOC_SCOPE(name) static_cast<void>(0)
+
+#endif
@@ -3,15 +3,109 @@
 #include "common.h"
 #include "formula.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
+//    
+enum class FormulaParsing {
+    Eager,  //   
+    Lazy,   //      
+};
+
+//       
+enum class CellValueType : uint8_t {
+    Empty = 0,
+    Number = 1,
+    Text = 2,
+    Error = 3,
+};
+
+//  ,  . ,   
+// (, ),    
+struct CellMemoryStats {
+    //    
+    size_t empty_cells = 0;
+    size_t text_cells = 0;
+    size_t formula_cells = 0;
+    //        shared_ptr
+    size_t empty_bytes = 0;
+    size_t text_cell_bytes = 0;
+    size_t formula_cell_bytes = 0;
+    //    :    ,  
+    size_t text_bytes = 0;
+    //    
+    size_t ast_nodes = 0;
+    size_t ast_bytes = 0;
+    // ,      
+    size_t unparsed_formulas = 0;
+
+    CellMemoryStats& operator+=(const CellMemoryStats& other);
+    //   
+    size_t GetTotalBytes() const;
+};
+
+//   ,      (.
+// Cell::AttachMemoryTotals()).    , 
+//        , 
+//  
+class CellMemoryTotals : public std::enable_shared_from_this<CellMemoryTotals> {
+public:
+    void Add(const CellMemoryStats& stats);
+    void Subtract(const CellMemoryStats& stats);
+    CellMemoryStats Load() const;
+
+private:
+    //     CellMemoryStats
+    std::array<std::atomic<size_t>, sizeof(CellMemoryStats) / sizeof(size_t)> values_{};
+};
+
+//   ,   
+struct FormulaCellProfile {
+    //   (,     )
+    uint64_t parse_ns = 0;
+    //      
+    uint64_t evaluations = 0;
+    uint64_t evaluation_ns = 0;
+    //    
+    size_t ast_nodes = 0;
+
+    uint64_t GetTotalNs() const {
+        return parse_ns + evaluation_ns;
+    }
+};
+
 //  
 class Cell : public CellInterface {
 public:
     
     Cell();
+    // ,     (   )
+    //  profile       (. GetProfile())
+    explicit Cell(std::string text, FormulaParsing parsing = FormulaParsing::Eager, bool profile = false);
+    //  -      
+    //  (,   ):     
+    Cell(std::string formula_text, FormulaInterface::Value value);
     ~Cell();
 
+    //         
+    //     .   ,  
+    //  ,  
+    Cell(const Cell&);
+    Cell& operator=(const Cell&);
+    Cell(Cell&&) noexcept;
+    Cell& operator=(Cell&&) noexcept;
+
     //     
     void Set(std::string text);
+    void Set(std::string text, FormulaParsing parsing, bool profile = false);
 
     //     
     void Clear();
@@ -22,17 +116,101 @@ public:
     //      (  )
     std::string GetText() const override;
 
+    // ,   ,    
+    bool IsEmpty() const;
+
+    //          : 
+    //   -  ,    
+    size_t GetTextSize() const;
+
+    //      :   
+    // number,  -  text (     ,
+    //   ).      
+    CellValueType ReadValue(double& number, std::string_view& text) const;
+
+    //   .  FormulaException   
+    void Prepare() const;
+
+    //   stats ,   (   Cell)
+    void AddMemoryUsage(CellMemoryStats& stats) const;
+
+    //        totals.  
+    //       ,   
+    //   ,       
+    void AttachMemoryTotals(CellMemoryTotals* totals);
+    void DetachMemoryTotals();
+    //       ,    
+    //  (,      )
+    void TakeOverMemoryTotals(const Cell& original);
+
+    //     std::nullopt,   -  
+    //    
+    std::optional<FormulaCellProfile> GetProfile() const;
+
 private:
     //        
     class Impl {
     public:
+        virtual ~Impl() = default;
+
         //       
         virtual Value GetValue() const = 0;
 
         //       
         virtual std::string GetText() const = 0;
 
+        //        (. Cell::GetTextSize)
+        virtual size_t GetTextSize() const {
+            return text_.size();
+        }
+
+        //   ,   
+        virtual bool IsEmpty() const {
+            return false;
+        }
+
+        //       (  )
+        virtual void Prepare() const {
+        }
+
+        //       (. Cell::ReadValue)
+        virtual CellValueType ReadValue(double& number, std::string_view& text) const = 0;
+
+        //      (. Cell::AddMemoryUsage)
+        virtual void AddMemoryUsage(CellMemoryStats& stats) const = 0;
+
+        //          totals 
+        //   .   ,   
+        //  . Ÿ     
+        virtual CellMemoryStats Attach(CellMemoryTotals&) const {
+            return GetMemoryUsage();
+        }
+        virtual CellMemoryStats Detach(CellMemoryTotals&) const {
+            return GetMemoryUsage();
+        }
+
+        //      (. Cell::GetProfile)
+        virtual std::optional<FormulaCellProfile> GetProfile() const {
+            return std::nullopt;
+        }
+
     protected:
+        CellMemoryStats GetMemoryUsage() const {
+            CellMemoryStats stats;
+            AddMemoryUsage(stats);
+            return stats;
+        }
+
+        //      (0     )
+        static size_t GetHeapBytes(const std::string& str);
+        static size_t GetHeapBytes(const Value& value);
+        //    T,  make_shared
+        template <typename T>
+        static constexpr size_t GetSharedSize() {
+            //  :        
+            return sizeof(T) + sizeof(void*) + 2 * sizeof(int);
+        }
+
         //  
         Value value_;
 
@@ -48,6 +226,19 @@ private:
             value_ = text_ = "";
         }
 
+        bool IsEmpty() const override {
+            return true;
+        }
+
+        CellValueType ReadValue(double&, std::string_view&) const override {
+            return CellValueType::Empty;
+        }
+
+        void AddMemoryUsage(CellMemoryStats& stats) const override {
+            ++stats.empty_cells;
+            stats.empty_bytes += GetSharedSize<EmptyImpl>();
+        }
+
         //     
         Value GetValue() const override {
             return value_;
@@ -72,6 +263,17 @@ private:
             value_ = std::string(text);
         }
 
+        CellValueType ReadValue(double&, std::string_view& text) const override {
+            text = std::get<std::string>(value_);
+            return CellValueType::Text;
+        }
+
+        void AddMemoryUsage(CellMemoryStats& stats) const override {
+            ++stats.text_cells;
+            stats.text_cell_bytes += GetSharedSize<TextImpl>();
+            stats.text_bytes += GetHeapBytes(text_) + GetHeapBytes(value_);
+        }
+
         //     
         Value GetValue() const override {
             return value_;
@@ -86,20 +288,42 @@ private:
     //     
     class FormulaImpl : public Impl {
     public:
-        // ,   
-        FormulaImpl(std::string_view expression) {
+        // ,   .   
+        //   ,      
+        FormulaImpl(std::string_view expression, FormulaParsing parsing, bool profile) {
+            if (profile) {
+                profile_ = std::make_unique<ProfileCounters>();
+            }
+            if (parsing == FormulaParsing::Lazy) {
+                account_ = std::make_unique<LazyAccount>();
+            }
             //   '='   
-            expression = expression.substr(1);
-            value_ = std::string(expression);
-            //        
-            formula_ptr_ = ParseFormula(std::move(std::string(expression)));
-            text_ = "=" + formula_ptr_->GetExpression();
+            formula_text_ = std::string(expression.substr(1));
+            unparsed_text_size_ = formula_text_.size();
+            unparsed_text_bytes_ = GetHeapBytes(formula_text_);
+            if (parsing == FormulaParsing::Eager) {
+                Parse();
+            }
+        }
+
+        //       ,  
+        FormulaImpl(std::string text, FormulaInterface::Value value) {
+            formula_text_ = std::move(text);
+            value_ = std::visit([](auto&& arg) -> Value { return arg; }, std::move(value));
+            //     
+            std::call_once(parse_flag_, [] {});
+            parsed_.store(true, std::memory_order_release);
         }
 
         //     
         Value GetValue() const override {
+            Parse();
+            //       
+            if (!formula_ptr_) {
+                return value_;
+            }
             //   
-            auto value = formula_ptr_->Evaluate();
+            auto value = Evaluate();
             //    ,  
             if (std::holds_alternative<double>(value)) {
                 return std::get<double>(value);
@@ -108,16 +332,200 @@ private:
             return std::get<FormulaError>(value);
         }
 
-        //     
+        //      (   )
         std::string GetText() const override {
-            return text_;
+            Parse();
+            return formula_text_;
+        }
+
+        size_t GetTextSize() const override {
+            //         
+            if (!parsed_.load(std::memory_order_acquire)) {
+                return unparsed_text_size_ + 1;
+            }
+            //          '='
+            return formula_text_.size() + (parse_error_ ? 1 : 0);
+        }
+
+        void Prepare() const override {
+            Parse();
+        }
+
+        CellValueType ReadValue(double& number, std::string_view&) const override {
+            Parse();
+            if (!formula_ptr_) {
+                if (const double* value = std::get_if<double>(&value_)) {
+                    number = *value;
+                    return CellValueType::Number;
+                }
+                return CellValueType::Error;
+            }
+            const auto value = Evaluate();
+            if (const double* result = std::get_if<double>(&value)) {
+                number = *result;
+                return CellValueType::Number;
+            }
+            return CellValueType::Error;
+        }
+
+        void AddMemoryUsage(CellMemoryStats& stats) const override {
+            ++stats.formula_cells;
+            stats.formula_cell_bytes += GetSharedSize<FormulaImpl>() + (account_ ? sizeof(LazyAccount) : 0);
+            //    ,      
+            //  ,   ,   
+            if (!parsed_.load(std::memory_order_acquire)) {
+                ++stats.unparsed_formulas;
+                stats.text_bytes += unparsed_text_bytes_;
+                return;
+            }
+            stats.text_bytes += GetHeapBytes(formula_text_);
+            if (formula_ptr_) {
+                stats.ast_nodes += formula_ptr_->GetAstNodeCount();
+                stats.ast_bytes += formula_ptr_->GetAstMemoryUsage();
+            }
+        }
+
+        CellMemoryStats Attach(CellMemoryTotals& totals) const override {
+            if (!account_) {
+                return GetMemoryUsage();
+            }
+            //         
+            //   ,         
+            std::lock_guard lock(account_->mutex);
+            if (account_->totals.get() != &totals) {
+                account_->totals = totals.shared_from_this();
+                account_->cells = 0;
+            }
+            ++account_->cells;
+            return GetMemoryUsage();
+        }
+
+        CellMemoryStats Detach(CellMemoryTotals& totals) const override {
+            if (!account_) {
+                return GetMemoryUsage();
+            }
+            std::lock_guard lock(account_->mutex);
+            if (account_->totals.get() == &totals && account_->cells > 0) {
+                --account_->cells;
+            }
+            return GetMemoryUsage();
+        }
+
+        std::optional<FormulaCellProfile> GetProfile() const override {
+            if (!profile_) {
+                return std::nullopt;
+            }
+            FormulaCellProfile profile;
+            profile.parse_ns = profile_->parse_ns.load(std::memory_order_relaxed);
+            profile.evaluations = profile_->evaluations.load(std::memory_order_relaxed);
+            profile.evaluation_ns = profile_->evaluation_ns.load(std::memory_order_relaxed);
+            if (parsed_.load(std::memory_order_acquire) && formula_ptr_) {
+                profile.ast_nodes = formula_ptr_->GetAstNodeCount();
+            }
+            return profile;
+        }
+
+        //  ,     .    
+        //  ;      
+        void Parse() const {
+            std::call_once(parse_flag_, [this] {
+                const auto start = std::chrono::steady_clock::now();
+                try {
+                    formula_ptr_ = ParseFormula(formula_text_);
+                    formula_text_ = "=" + formula_ptr_->GetExpression();
+                } catch (...) {
+                    parse_error_ = std::current_exception();
+                }
+                if (profile_) {
+                    profile_->parse_ns.store(GetElapsedNs(start), std::memory_order_relaxed);
+                }
+                FinishParse();
+            });
+            if (parse_error_) {
+                std::rethrow_exception(parse_error_);
+            }
         }
 
     private:
+        //    '='  ,    
+        mutable std::string formula_text_;
+
         //    
-        std::unique_ptr<FormulaInterface> formula_ptr_;
+        mutable std::unique_ptr<FormulaInterface> formula_ptr_;
+
+        mutable std::once_flag parse_flag_;
+        mutable std::exception_ptr parse_error_;
+        //  :       
+        mutable std::atomic<bool> parsed_ = false;
+        //       
+        size_t unparsed_text_size_ = 0;
+        size_t unparsed_text_bytes_ = 0;
+
+        //   : ,      , 
+        //   .      
+        struct LazyAccount {
+            std::mutex mutex;
+            std::shared_ptr<CellMemoryTotals> totals;
+            size_t cells = 0;
+        };
+        std::unique_ptr<LazyAccount> account_;
+
+        //       
+        void FinishParse() const {
+            if (!account_) {
+                parsed_.store(true, std::memory_order_release);
+                return;
+            }
+            std::lock_guard lock(account_->mutex);
+            const CellMemoryStats unparsed = GetMemoryUsage();
+            parsed_.store(true, std::memory_order_release);
+            if (account_->cells == 0) {
+                return;
+            }
+            const CellMemoryStats parsed = GetMemoryUsage();
+            for (size_t i = 0; i < account_->cells; ++i) {
+                account_->totals->Subtract(unparsed);
+                account_->totals->Add(parsed);
+            }
+        }
+
+        //  ;      
+        struct ProfileCounters {
+            std::atomic<uint64_t> parse_ns{ 0 };
+            std::atomic<uint64_t> evaluations{ 0 };
+            std::atomic<uint64_t> evaluation_ns{ 0 };
+        };
+        std::unique_ptr<ProfileCounters> profile_;
+
+        static uint64_t GetElapsedNs(std::chrono::steady_clock::time_point start) {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+
+        //   ,    
+        FormulaInterface::Value Evaluate() const {
+            if (!profile_) {
+                return formula_ptr_->Evaluate();
+            }
+            const auto start = std::chrono::steady_clock::now();
+            auto value = formula_ptr_->Evaluate();
+            profile_->evaluations.fetch_add(1, std::memory_order_relaxed);
+            profile_->evaluation_ns.fetch_add(GetElapsedNs(start), std::memory_order_relaxed);
+            return value;
+        }
     };
 
-    //     
-    std::unique_ptr<Impl> impl_;
+    //  ,   
+    static std::shared_ptr<const Impl> MakeImpl(std::string text, FormulaParsing parsing, bool profile = false);
+
+    //  ,      
+    void SetImpl(std::shared_ptr<const Impl> impl);
+
+    //     .    
+    //  (   ),   
+    //       
+    std::shared_ptr<const Impl> impl_;
+
+    // ,    ,  nullptr
+    CellMemoryTotals* totals_ = nullptr;
 };
\ No newline at end of file
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Класс CellHasher используется для вычисления хеша позиции ячейки
+class CellHasher {
+public:
+    // Перегрузка оператора вызова функции для вычисления хеша позиции
+    size_t operator()(const Position p) const {
+        return std::hash<std::string>()(p.ToString());  // Преобразуем позицию в строку и вычисляем хеш
+    }
+};
+
+// Класс CellComparator используется для сравнения двух позиций ячеек
+class CellComparator {
+public:
+    // Перегрузка оператора вызова функции для сравнения двух позиций
+    bool operator()(const Position& lhs, const Position& rhs) const {
+        return lhs == rhs;  // Сравниваем две позиции на равенство
+    }
+};
+
+// Оценка памяти хранилища ячеек
+struct CellGridMemoryStats {
+    // Число плиток и корзин их хеш-таблиц
+    size_t tiles = 0;
+    size_t buckets = 0;
+    // Индекс: корень, полосы, плитки, массивы корзин и узлы хеш-таблиц
+    // (вместе с объектами Cell)
+    size_t index_bytes = 0;
+    // Содержимое ячеек
+    CellMemoryStats cells;
+
+    CellGridMemoryStats& operator+=(const CellGridMemoryStats& other);
+    size_t GetTotalBytes() const;
+};
+
+// Хранилище ячеек по позициям, разбитое на плитки TILE_SIZE x TILE_SIZE.
+// Плитки лежат в двухуровневом дереве (корень -> полосы строк -> плитки) и
+// разделяются между копиями хранилища: копирование копирует только указатель
+// на корень, а изменение копирует путь к изменяемой плитке и саму плитку, если
+// они используются другой копией (копирование при записи).
+//
+// Методы, изменяющие хранилище, нельзя вызывать одновременно с копированием
+// этого же объекта; копии можно читать из любых потоков.
+//
+// Хранилище ведёт счётчики памяти при изменениях, поэтому GetMemoryStats() не
+// обходит ни плитки, ни ячейки. Копия счётчиков не ведёт: она служит для
+// чтения (см. SheetSnapshot) и считает память обходом
+class CellGrid {
+public:
+    using Table = std::unordered_map<Position, Cell, CellHasher, CellComparator>;
+
+    CellGrid();
+    CellGrid(const CellGrid& other);
+    CellGrid& operator=(const CellGrid& other);
+    CellGrid(CellGrid&&) noexcept = default;
+    CellGrid& operator=(CellGrid&&) noexcept = default;
+
+    static constexpr int TILE_SIZE = 128;
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+
+    // Возвращает ячейку или nullptr, если её нет
+    const Cell* Find(Position pos) const;
+
+    // Возвращает ячейку для изменения или nullptr, если её нет. Плитка ячейки
+    // предварительно отделяется от других копий хранилища
+    Cell* FindForWrite(Position pos);
+
+    // Добавляет ячейку или заменяет существующую. Возвращает ячейку в хранилище
+    // и признак того, что ячейки раньше не было
+    std::pair<Cell*, bool> InsertOrAssign(Position pos, Cell cell);
+
+    // Удаляет ячейку и возвращает её, если она была
+    std::optional<Cell> Extract(Position pos);
+
+    // Удаляет ячейки, для которых pred(pos, cell) истинно, и возвращает их
+    // позиции. Плитки без таких ячеек не копируются
+    template <typename Pred>
+    std::vector<Position> EraseIf(Pred pred);
+
+    // Вызывает func(pos, cell) для каждой ячейки
+    template <typename Func>
+    void ForEach(Func func) const;
+
+    // Вызывает func(pos, cell) для ячеек тех плиток, для которых
+    // use_tile(band_index, tile_index) истинно; остальные плитки не просматриваются
+    template <typename TilePred, typename Func>
+    void ForEachInTiles(TilePred use_tile, Func func) const;
+
+    void Clear();
+
+    // Номер плитки позиции (плитки нумеруются по строкам)
+    static int GetTileIndex(Position pos) {
+        return pos.row / TILE_SIZE * TILE_COLS + pos.col / TILE_SIZE;
+    }
+
+    // Проверяет, что плитка позиции существует и вместе с путём к ней
+    // принадлежит только этой копии. Тогда изменение ячеек плитки не меняет
+    // ни корень, ни полосу, и записи в разные плитки можно выполнять параллельно
+    bool IsWritable(Position pos) const;
+
+    // Создаёт плитку позиции и отделяет её и путь к ней от других копий
+    void PrepareForWrite(Position pos);
+
+    // Возвращает оценку занимаемой памяти по счётчикам. В них учтены и
+    // изменения ячеек через указатели из FindForWrite(), и разбор отложенных
+    // формул, в том числе через копии хранилища
+    CellGridMemoryStats GetMemoryStats() const;
+
+private:
+    struct Tile {
+        Table cells;
+    };
+    // Счётчики памяти индекса; ячейки учитываются в cells
+    struct MemoryTotals {
+        std::atomic<size_t> tiles{ 0 };
+        std::atomic<size_t> buckets{ 0 };
+        std::atomic<size_t> index_bytes{ 0 };
+        std::shared_ptr<CellMemoryTotals> cells = std::make_shared<CellMemoryTotals>();
+    };
+    struct Band {
+        std::array<std::shared_ptr<Tile>, TILE_COLS> tiles;
+    };
+    struct Root {
+        std::array<std::shared_ptr<Band>, TILE_ROWS> bands;
+    };
+
+    const Tile* FindTile(Position pos) const;
+    // Возвращает плитку позиции, отделённую от других копий; при create
+    // недостающая плитка создаётся, иначе для неё возвращается nullptr
+    Tile* GetTileForWrite(Position pos, bool create);
+
+    // Учитывает в счётчиках новую ячейку плитки или её удаление (до удаления)
+    void AttachCell(Cell& cell);
+    void DetachCell(Cell& cell);
+    // Учитывает изменение числа корзин таблицы плитки
+    void UpdateBuckets(const Tile& tile, size_t old_buckets);
+    // Оценка памяти обходом всех ячеек (для копий без счётчиков)
+    CellGridMemoryStats ComputeMemoryStats() const;
+
+    // Делает объект, на который указывает ptr, принадлежащим только этой копии
+    template <typename T>
+    static T& Unshare(std::shared_ptr<T>& ptr);
+
+private:
+    std::shared_ptr<Root> root_;
+    // Счётчики памяти; nullptr у копии
+    std::unique_ptr<MemoryTotals> totals_;
+};
+
+template <typename T>
+T& CellGrid::Unshare(std::shared_ptr<T>& ptr) {
+    if (!ptr) {
+        ptr = std::make_shared<T>();
+    } else if (ptr.use_count() > 1) {
+        ptr = std::make_shared<T>(*ptr);
+    }
+    return *ptr;
+}
+
+template <typename Pred>
+std::vector<Position> CellGrid::EraseIf(Pred pred) {
+    std::vector<Position> erased;
+    if (!root_) {
+        return erased;
+    }
+    for (int band_index = 0; band_index < TILE_ROWS; ++band_index) {
+        if (!root_->bands[band_index]) {
+            continue;
+        }
+        for (int tile_index = 0; tile_index < TILE_COLS; ++tile_index) {
+            const auto& tile = root_->bands[band_index]->tiles[tile_index];
+            if (!tile) {
+                continue;
+            }
+            const size_t first_erased = erased.size();
+            for (const auto& [pos, cell] : tile->cells) {
+                if (pred(pos, cell)) {
+                    erased.push_back(pos);
+                }
+            }
+            if (erased.size() == first_erased) {
+                continue;
+            }
+            Table& cells = GetTileForWrite({ band_index * TILE_SIZE, tile_index * TILE_SIZE }, false)->cells;
+            for (size_t i = first_erased; i < erased.size(); ++i) {
+                auto it = cells.find(erased[i]);
+                DetachCell(it->second);
+                cells.erase(it);
+            }
+        }
+    }
+    return erased;
+}
+
+template <typename Func>
+void CellGrid::ForEach(Func func) const {
+    ForEachInTiles([](int, int) { return true; }, func);
+}
+
+template <typename TilePred, typename Func>
+void CellGrid::ForEachInTiles(TilePred use_tile, Func func) const {
+    if (!root_) {
+        return;
+    }
+    for (int band_index = 0; band_index < TILE_ROWS; ++band_index) {
+        const auto& band = root_->bands[band_index];
+        if (!band) {
+            continue;
+        }
+        for (int tile_index = 0; tile_index < TILE_COLS; ++tile_index) {
+            const auto& tile = band->tiles[tile_index];
+            if (!tile || !use_tile(band_index, tile_index)) {
+                continue;
+            }
+            for (const auto& [pos, cell] : tile->cells) {
+                func(pos, cell);
+            }
+        }
+    }
+}
@@ -22,8 +22,8 @@ struct Position {
     // Преобразование строки в позицию
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    static constexpr int MAX_ROWS = 16384;
+    static constexpr int MAX_COLS = 16384;
     static const Position NONE;
 };
 
@@ -62,6 +62,24 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Код результата операций, сообщающих об ошибках без исключений
+enum class CellStatus {
+    Ok,
+    InvalidPosition,     // вместо InvalidPositionException
+    FormulaSyntaxError,  // вместо FormulaException
+};
+
+// Результат TrySetCell: код ошибки и смещение первого некорректного символа в
+// тексте ячейки (для FormulaSyntaxError)
+struct SetCellResult {
+    CellStatus status = CellStatus::Ok;
+    size_t error_offset = 0;
+
+    bool IsOk() const {
+        return status == CellStatus::Ok;
+    }
+};
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -103,6 +121,11 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Задаёт содержимое ячейки так же, как SetCell(), но никогда не бросает
+    // исключений из-за некорректных данных: вместо InvalidPositionException и
+    // FormulaException возвращается код ошибки. При ошибке ячейка не меняется.
+    virtual SetCellResult TrySetCell(Position pos, std::string text) = 0;
+
     // Возвращает значение ячейки.
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
@@ -113,6 +136,19 @@ public:
     // объект с пустым текстом.
     virtual void ClearCell(Position pos) = 0;
 
+    // Вставляет count пустых строк (столбцов) перед строкой (столбцом) before,
+    // сдвигая последующие строки вниз (столбцы вправо).
+    // Бросает InvalidPositionException, если before или count некорректны, и
+    // TableTooBigException, если непустые ячейки выйдут за пределы таблицы.
+    virtual void InsertRows(int before, int count = 1) = 0;
+    virtual void InsertCols(int before, int count = 1) = 0;
+
+    // Удаляет count строк (столбцов), начиная с first, вместе с их ячейками,
+    // сдвигая последующие строки вверх (столбцы влево).
+    // Бросает InvalidPositionException, если first или count некорректны.
+    virtual void DeleteRows(int first, int count = 1) = 0;
+    virtual void DeleteCols(int first, int count = 1) = 0;
+
     // Вычисляет размер области, которая участвует в печати.
     // Определяется как ограничивающий прямоугольник всех ячеек с непустым
     // текстом.
@@ -23,6 +23,14 @@ public:
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
+
+    // Число узлов дерева формулы и оценка занимаемой ими памяти в байтах
+    virtual size_t GetAstNodeCount() const {
+        return 0;
+    }
+    virtual size_t GetAstMemoryUsage() const {
+        return 0;
+    }
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
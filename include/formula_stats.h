@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+
+// Счётчики и таймеры этапов разбора и вычисления формул. Включаются сборкой с
+// SPREADSHEET_FORMULA_STATS=1 (опция CMake SPREADSHEET_FORMULA_STATS); без неё
+// SPREADSHEET_FORMULA_PHASE не порождает кода, а статистика всегда нулевая.
+// Время измеряется счётчиком тактов процессора (rdtsc), на других
+// архитектурах - в наносекундах steady_clock.
+
+#ifndef SPREADSHEET_FORMULA_STATS
+#define SPREADSHEET_FORMULA_STATS 0
+#endif
+
+enum class FormulaPhase : uint8_t {
+    Lex,           // FormulaLexer: разбиение текста на лексемы
+    Parse,         // FormulaParser: построение дерева разбора
+    BuildAst,      // обход дерева разбора ParseASTListener
+    Canonicalize,  // печать формулы в каноническом виде (GetExpression)
+    Execute,       // FormulaAST::Execute
+    Count,
+};
+
+struct FormulaPhaseStats {
+    uint64_t calls = 0;
+    uint64_t ticks = 0;
+};
+
+struct FormulaStats {
+    std::array<FormulaPhaseStats, static_cast<size_t>(FormulaPhase::Count)> phases{};
+
+    const FormulaPhaseStats& operator[](FormulaPhase phase) const {
+        return phases[static_cast<size_t>(phase)];
+    }
+};
+
+inline constexpr bool IsFormulaStatsEnabled() {
+    return SPREADSHEET_FORMULA_STATS != 0;
+}
+
+const char* GetFormulaPhaseName(FormulaPhase phase);
+
+// Сумма по всем потокам, включая завершившиеся
+FormulaStats GetFormulaStats();
+void ResetFormulaStats();
+
+// Печатает таблицу этапов (по умолчанию вызывающий передаёт std::cerr)
+void DumpFormulaStats(std::ostream& output);
+// Пишет статистику в JSON
+void WriteFormulaStatsJson(std::ostream& output);
+
+#if SPREADSHEET_FORMULA_STATS
+
+namespace formula_stats_detail {
+
+    // Показание счётчика тактов
+    uint64_t ReadTicks();
+    // Добавляет вызов этапа в счётчики текущего потока
+    void AddPhase(FormulaPhase phase, uint64_t ticks);
+
+    // Засекает время от создания до конца области видимости
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(FormulaPhase phase)
+            : phase_(phase)
+            , start_(ReadTicks()) {
+        }
+        ~PhaseTimer() {
+            AddPhase(phase_, ReadTicks() - start_);
+        }
+
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    private:
+        FormulaPhase phase_;
+        uint64_t start_;
+    };
+
+}  // namespace formula_stats_detail
+
+#define SPREADSHEET_FORMULA_STATS_CONCAT2(a, b) a##b
+#define SPREADSHEET_FORMULA_STATS_CONCAT(a, b) SPREADSHEET_FORMULA_STATS_CONCAT2(a, b)
+// Учитывает время до конца текущей области видимости в этапе phase
+#define SPREADSHEET_FORMULA_PHASE(phase) \
+    const formula_stats_detail::PhaseTimer SPREADSHEET_FORMULA_STATS_CONCAT(formula_phase_timer_, __LINE__)(phase)
+
+#else
+
+#define SPREADSHEET_FORMULA_PHASE(phase) static_cast<void>(0)
+
+#endif
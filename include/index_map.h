@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Отображение логических номеров строк (или столбцов) таблицы на физические
+// номера, под которыми ячейки хранятся в Sheet::Table. Вставка, удаление и
+// перемещение строк переставляют номера в отображении, а сами ячейки остаются
+// на месте. Отображение всегда является перестановкой [0, size): номера,
+// вытесненные за конец таблицы, переиспользуются для вставляемых строк.
+// Таблица ограничена Position::MAX_ROWS строками, поэтому перестановка хранится
+// плоскими массивами: сдвиг нескольких десятков килобайт дешевле обхода дерева.
+class IndexMap {
+public:
+    explicit IndexMap(int size);
+
+    int GetSize() const {
+        return size_;
+    }
+
+    int ToPhysical(int logical) const {
+        return to_physical_.empty() ? logical : to_physical_[logical];
+    }
+
+    int ToLogical(int physical) const {
+        return to_logical_.empty() ? physical : to_logical_[physical];
+    }
+
+    // Вставляет count номеров перед номером before. Последние count номеров
+    // вытесняются за конец и занимают места вставленных, поэтому хранящиеся под
+    // ними ячейки должны быть удалены заранее.
+    void Insert(int before, int count);
+
+    // Удаляет номера [first, first + count) и возвращает их физические номера.
+    // Удалённые номера переносятся в конец отображения.
+    std::vector<int> Erase(int first, int count);
+
+    // Переносит номера [first, first + count) так, чтобы они стояли перед
+    // номером before (в нумерации до переноса)
+    void Move(int first, int count, int before);
+
+    // Переставляет номера [first, first + order.size()): на место i-го из них
+    // встаёт номер first + order[i]
+    void Permute(int first, const std::vector<int>& order);
+
+    // Возвращает тождественное отображение
+    void Reset();
+
+    // Память массивов отображения в байтах
+    size_t GetMemoryUsage() const {
+        return (to_physical_.capacity() + to_logical_.capacity()) * sizeof(int);
+    }
+
+private:
+    // Заполняет массивы тождественным отображением перед первой перестановкой
+    void Materialize();
+    // Обновляет обратное отображение для логических номеров [first, last)
+    void UpdateInverse(int first, int last);
+
+private:
+    int size_;
+    // Пустые массивы означают тождественное отображение
+    std::vector<int> to_physical_;
+    std::vector<int> to_logical_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Настройки журнала изменений таблицы
+struct JournalOptions {
+    // Записи сбрасываются на диск (fsync) группой, когда их накопилось столько...
+    size_t group_commit_records = 1024;
+    // ...или когда с момента добавления первой из них прошло столько времени
+    std::chrono::milliseconds group_commit_interval{ 10 };
+    // Снимок, из которого таблица загружается при открытии и в который сжимается
+    // журнал. Пустая строка - без снимка и без сжатия
+    std::string snapshot_path;
+    // Журнал сжимается в снимок автоматически после стольких записей (0 - только
+    // явным вызовом Sheet::CompactJournal)
+    size_t compact_after_records = 0;
+};
+
+// Журнал изменений, дописываемый в конец файла компактными двоичными записями.
+// Запись: код операции, строка и столбец (varint) или первый номер и число
+// вставляемых/удаляемых строк, для SetCell, SortRange и PermuteRows длина
+// (varint) и текст, для перемещения номер назначения (varint), контрольная
+// сумма FNV-1a. Пакет
+// изменений ячеек хранится одной записью Batch: число изменений и их записи без
+// контрольных сумм в качестве текста, поэтому он восстанавливается целиком или
+// не восстанавливается вовсе. Записи сбрасываются на диск фоновым потоком
+// группами, поэтому fsync выполняется не на каждое изменение.
+class Journal {
+public:
+    enum class Op : uint8_t {
+        SetCell = 1,
+        ClearCell = 2,
+        InsertRows = 3,
+        InsertCols = 4,
+        DeleteRows = 5,
+        DeleteCols = 6,
+        MoveRows = 7,
+        MoveCols = 8,
+        SortRange = 9,
+        Batch = 10,
+        PermuteRows = 11,
+    };
+
+    // Для вставки, удаления и перемещения строк и столбцов pos.row - первый
+    // номер, pos.col - их число, before - номер, перед которым они переносятся.
+    // Для сортировки pos - левый верхний угол области, text - размер и ключи,
+    // для перестановки строк (отмены сортировки) - число столбцов и порядок строк
+    struct Record {
+        Op op;
+        Position pos;
+        std::string text;
+        int before = 0;
+    };
+
+    // Читает целые записи журнала, раскрывая пакеты в записи SetCell и
+    // ClearCell. Недописанная последняя запись (например, после сбоя во время
+    // записи) отбрасывается. Повреждённая запись, за которой есть данные, или
+    // запись с верной контрольной суммой, но недопустимыми полями - не хвост, а
+    // порча журнала: бросается std::runtime_error.
+    // Отсутствующий файл считается пустым журналом.
+    static std::vector<Record> ReadRecords(const std::string& filename);
+
+    // Открывает журнал для дозаписи, создавая файл при необходимости и отрезая
+    // недописанный хвост. Бросает std::runtime_error, если файл не открывается
+    // или повреждён (тогда файл не изменяется).
+    Journal(const std::string& filename, JournalOptions options);
+    // Сбрасывает на диск все добавленные записи
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Добавляет запись. Запись становится надёжной после ближайшего группового сброса
+    void Append(Op op, Position pos, std::string_view text = {});
+    // Добавляет запись о перемещении строк или столбцов
+    void AppendMove(Op op, int first, int count, int before);
+    // Добавляет записи SetCell и ClearCell одной записью пакета
+    void AppendBatch(const std::vector<Record>& records);
+
+    // Ждёт, пока все добавленные записи окажутся на диске
+    void Sync();
+
+    // Удаляет все записи (после того как их содержимое сохранено в снимок)
+    void Truncate();
+
+    // Возвращает число изменений в журнале, включая прочитанные при открытии
+    size_t GetRecordCount() const;
+
+    const JournalOptions& GetOptions() const {
+        return options_;
+    }
+
+private:
+    // Дописывает контрольную сумму и ставит запись, содержащую count изменений,
+    // в очередь на сброс
+    void Enqueue(std::string record, size_t count = 1);
+    // Цикл фонового потока, выполняющего групповые сбросы
+    void FlushLoop();
+    // Записывает накопленные данные и вызывает fsync. Вызывается без mutex_
+    void WriteAndSync(const std::string& data);
+
+private:
+    JournalOptions options_;
+    int fd_ = -1;
+
+    mutable std::mutex mutex_;
+    std::condition_variable flush_requested_;
+    std::condition_variable flushed_;
+    std::string pending_;           // записи, ещё не переданные ОС
+    size_t pending_records_ = 0;
+    size_t record_count_ = 0;
+    uint64_t appended_ = 0;         // номер последней добавленной записи
+    uint64_t durable_ = 0;          // номер последней записи на диске
+    size_t sync_waiters_ = 0;
+    bool failed_ = false;
+    bool stop_ = false;
+
+    // Сериализует запись в файл, fsync и усечение файла
+    std::mutex io_mutex_;
+    std::thread flusher_;
+};
+
+// Сбрасывает содержимое файла на диск. Бросает std::runtime_error при ошибке
+void SyncFileToDisk(const std::string& filename);
+
+// Сбрасывает на диск каталог файла, чтобы переименование или создание файла
+// пережило сбой. В Windows ничего не делает. Бросает std::runtime_error при ошибке
+void SyncParentDirectory(const std::string& filename);
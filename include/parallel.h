@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+// Минимальный объём работы на один поток, меньшие задачи выполняются в текущем потоке
+inline constexpr size_t MIN_ITEMS_PER_THREAD = 4096;
+
+// Задаёт число потоков параллельных операций (вместе с вызывающим); 0 - по
+// числу процессоров (по умолчанию). Вызывается, пока параллельные операции не
+// выполняются
+void SetThreadCount(size_t threads);
+size_t GetThreadCount();
+
+// Возвращает число потоков, на которое имеет смысл делить count элементов
+inline size_t GetWorkerCount(size_t count, size_t min_items_per_thread = MIN_ITEMS_PER_THREAD) {
+    return std::clamp<size_t>(count / std::max<size_t>(min_items_per_thread, 1), 1, GetThreadCount());
+}
+
+namespace parallel_detail {
+
+    // Выполняет task(i) для каждого i из [0, count) на потоках общего пула и в
+    // вызывающем потоке, возвращается после завершения всех задач. Вызывающий
+    // поток сам берёт невыполненные задачи, поэтому вложенный вызов из задачи
+    // не ждёт занятых потоков пула. task не должна бросать исключения
+    void RunTasks(size_t count, const std::function<void(size_t)>& task);
+
+}  // namespace parallel_detail
+
+// Делит диапазон [0, count) на непрерывные части и вызывает func(begin, end) для
+// каждой части в потоках общего пула, создаваемых один раз. Первое исключение
+// из частей пробрасывается в вызывающий поток после завершения всех частей.
+template <typename Func>
+void ParallelFor(size_t count, Func func, size_t min_items_per_thread = MIN_ITEMS_PER_THREAD) {
+    const size_t workers = GetWorkerCount(count, min_items_per_thread);
+    if (workers <= 1) {
+        func(size_t{ 0 }, count);
+        return;
+    }
+
+    std::vector<std::exception_ptr> errors(workers);
+    const size_t chunk = (count + workers - 1) / workers;
+    parallel_detail::RunTasks(workers, [&](size_t index) {
+        try {
+            func(std::min(index * chunk, count), std::min((index + 1) * chunk, count));
+        } catch (...) {
+            errors[index] = std::current_exception();
+        }
+    });
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+// Устойчиво сортирует items: части сортируются параллельно std::stable_sort,
+// затем попарно сливаются std::merge (при равенстве первым идёт элемент левой
+// части, поэтому порядок равных элементов сохраняется).
+template <typename T, typename Compare>
+void ParallelStableSort(std::vector<T>& items, Compare comp, size_t min_items_per_thread = MIN_ITEMS_PER_THREAD) {
+    const size_t count = items.size();
+    const size_t parts = GetWorkerCount(count, min_items_per_thread);
+    if (parts <= 1) {
+        std::stable_sort(items.begin(), items.end(), comp);
+        return;
+    }
+
+    std::vector<size_t> bounds(parts + 1);
+    for (size_t i = 0; i <= parts; ++i) {
+        bounds[i] = std::min(i * ((count + parts - 1) / parts), count);
+    }
+    ParallelFor(parts, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::stable_sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], comp);
+        }
+    }, /* min_items_per_thread = */ 1);
+
+    std::vector<T> buffer(count);
+    for (size_t width = 1; width < parts; width *= 2) {
+        const size_t groups = (parts + 2 * width - 1) / (2 * width);
+        ParallelFor(groups, [&](size_t begin, size_t end) {
+            for (size_t group = begin; group < end; ++group) {
+                const size_t lo = bounds[group * 2 * width];
+                const size_t mid = bounds[std::min(group * 2 * width + width, parts)];
+                const size_t hi = bounds[std::min(group * 2 * width + 2 * width, parts)];
+                std::merge(std::make_move_iterator(items.begin() + lo), std::make_move_iterator(items.begin() + mid),
+                           std::make_move_iterator(items.begin() + mid), std::make_move_iterator(items.begin() + hi),
+                           buffer.begin() + lo, comp);
+            }
+        }, /* min_items_per_thread = */ 1);
+        items.swap(buffer);
+    }
+}
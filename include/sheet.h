@@ -1,40 +1,140 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_grid.h"
 #include "common.h"
+#include "index_map.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "undo_history.h"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-//  CellHasher      
-class CellHasher {
+//        PrintTexts
+struct ImportResult {
+    //   
+    size_t imported = 0;
+    //    ,       
+    std::vector<std::pair<Position, SetCellResult>> errors;
+};
+
+// ,      
+class BatchException : public std::runtime_error {
 public:
-    //        
-    size_t operator()(const Position p) const {
-        return std::hash<std::string>()(p.ToString());  //       
+    using std::runtime_error::runtime_error;
+};
+
+//   
+struct Range {
+    Position top_left;
+    Size size;
+};
+
+//  :    
+struct SortKey {
+    int col = 0;
+    bool ascending = true;
+};
+
+//    ReadRange():   ()   
+//   .     nullptr,    
+struct RangeBuffers {
+    //   , NaN  
+    double* numbers = nullptr;
+    //   
+    CellValueType* types = nullptr;
+    //  i  i / 64 ,   i - 
+    uint64_t* number_mask = nullptr;
+    //    (   ),   
+    std::string_view* texts = nullptr;
+};
+
+//  ,   (. Sheet::GetMemoryStats())
+struct SheetMemoryStats {
+    //  :      
+    CellGridMemoryStats grid;
+    //           
+    size_t line_bytes = 0;
+    //    
+    size_t undo_bytes = 0;
+    //    ,     . 
+    //  ,   ,   GetTotalBytes()  
+    size_t mapped_snapshot_bytes = 0;
+
+    size_t GetTotalBytes() const {
+        return grid.GetTotalBytes() + line_bytes + undo_bytes;
     }
 };
 
-//  CellComparator      
-class CellComparator {
+//      (. Sheet::GetSlowestFormulas())
+struct FormulaProfileEntry {
+    Position pos;
+    //      '='
+    std::string expression;
+    FormulaCellProfile profile;
+};
+
+//       Sheet::Snapshot().
+//          , 
+//       ,  
+//  .        .
+class SheetSnapshot {
 public:
-    //        
-    bool operator()(const Position& lhs, const Position& rhs) const {
-        return lhs == rhs;  //     
-    }
+    //      SheetInterface  Sheet
+    const CellInterface* GetCell(Position pos) const;
+    //   buffers ,   
+    size_t ReadRange(Range range, const RangeBuffers& buffers) const;
+    Size GetPrintableSize() const;
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    friend class Sheet;
+
+    SheetSnapshot(CellGrid cells, std::shared_ptr<const IndexMap> rows, std::shared_ptr<const IndexMap> cols);
+
+    CellGrid cells_;
+    std::shared_ptr<const IndexMap> rows_;
+    std::shared_ptr<const IndexMap> cols_;
+};
+
+//  ,  :    
+//  ,        .
+//      
+struct ChangeSet {
+    std::vector<Range> ranges;
 };
 
+//      ,     
+using ChangeListener = std::function<void(const ChangeSet& changes, const SheetSnapshot& snapshot)>;
+using SubscriptionId = uint64_t;
+
 //  Sheet   SheetInterface     
 class Sheet : public SheetInterface {
 public:
-    //   Table  unordered_map   Position   Cell
-    using Table = std::unordered_map<Position, Cell, CellHasher, CellComparator>;
-
     //  
     ~Sheet();
 
     //        
     void SetCell(Position pos, std::string text) override;
 
+    //          
+    SetCellResult TrySetCell(Position pos, std::string text) override;
+
     //          
     const CellInterface* GetCell(Position pos) const override;
 
@@ -44,6 +144,34 @@ public:
     //       
     void ClearCell(Position pos) override;
 
+    //        .   :
+    //        (IndexMap)
+    void InsertRows(int before, int count = 1) override;
+    void InsertCols(int before, int count = 1) override;
+    void DeleteRows(int first, int count = 1) override;
+    void DeleteCols(int first, int count = 1) override;
+
+    //     () [first, first + count) , 
+    //     () before    .
+    //  InvalidPositionException,   .
+    void MoveRows(int first, int count, int before);
+    void MoveCols(int first, int count, int before);
+
+    //       range   keys.
+    //     CellInterface::Value:  <  < ,
+    //      ,     .
+    //   range     ,   
+    //  ,    .
+    //  InvalidPositionException,     .
+    void SortRange(Range range, const std::vector<SortKey>& keys);
+
+    //           :
+    //    ,  .
+    //     .   buffers ,
+    //    ;      
+    // Snapshot().  InvalidPositionException,   .
+    size_t ReadRange(Range range, const RangeBuffers& buffers) const;
+
     //     ,     
     Size GetPrintableSize() const override;
 
@@ -53,7 +181,331 @@ public:
     //        
     void PrintTexts(std::ostream& output) const override;
 
+    //         PrintTexts.  
+    //   ,  TrySetCell(),     .
+    //      .
+    ImportResult ImportTexts(std::string_view data);
+
+    //         PrintTexts,   
+    ImportResult ImportTextsFromFile(const std::string& filename);
+
+    //     .  
+    // options.snapshot_path (  ),    filename
+    //        SetCell, TrySetCell,
+    // ClearCell  ImportTexts.   CellInterface::Set 
+    // LoadSnapshot    .
+    void OpenJournal(const std::string& filename, JournalOptions options = {});
+
+    //    :    ,  
+    void CompactJournal();
+
+    //       
+    void SyncJournal();
+
+    //       
+    //   O(1).     ,    
+    // (    );     
+    //   .   ,    
+    // GetCell(),     .
+    SheetSnapshot Snapshot() const;
+
+    //        SetCell, TrySetCell  .
+    //       ( -
+    //  ),       GetValue(),
+    // GetText()   Prepare().     .
+    void SetFormulaParsing(FormulaParsing parsing);
+
+    //     . ,  
+    //  (SetCell, TrySetCell, , ),  
+    // ,     ,     .
+    //       .  
+    //  
+    void SetFormulaProfiling(bool enabled);
+
+    //      count    
+    //     ,   
+    std::vector<FormulaProfileEntry> GetSlowestFormulas(size_t count) const;
+
+    //       ().
+    //  FormulaException,  -    .
+    void Prepare() const;
+
+    //        (. snapshot.h)
+    void SaveSnapshot(const std::string& filename) const;
+
+    //         .
+    //    ,        
+    //    :     .
+    void LoadSnapshot(const std::string& filename);
+
+    //     .  BeginBatch() 
+    // SetCell, TrySetCell  ClearCell     
+    // (   )   ,    
+    //   . Commit()   , 
+    //      (   ) 
+    //           .
+    //  -    , Commit()   
+    //  FormulaException,   . Rollback()  .
+    // , , , ,    
+    //  ,    BeginBatch()  Commit()  ,
+    //  BatchException.  GetCell()    
+    //  .
+    void BeginBatch();
+    void Commit();
+    void Rollback();
+    bool IsInBatch() const;
+
+    //   .      
+    //     ( ,  
+    //  -   )   options.memory_budget.
+    //  SetCell, TrySetCell, ClearCell, , , , ,
+    //    -  ;    
+    // . Undo()  Redo()  false,   ,  
+    //    BatchException  .  
+    // CellInterface::Set    ;    
+    //   .    .
+    void EnableUndo(UndoOptions options = {});
+    void DisableUndo();
+    bool Undo();
+    bool Redo();
+    bool CanUndo() const;
+    bool CanRedo() const;
+
+    //      region.   
+    //  ( -  )     
+    //  ,   region,     .
+    //     ,  ,
+    //   ,      : 
+    //    .    
+    //  ,       .
+    // Unsubscribe()   ,     ,
+    //    .
+    SubscriptionId Subscribe(Range region, ChangeListener listener);
+    void Unsubscribe(SubscriptionId id);
+
+    //     .   SetCell, TrySetCell,
+    // ClearCell  GetCell     :  
+    //     (. CellGrid),    
+    //   .     .
+    //     ,      , 
+    //   ,         
+    //  (. StructureMutex),        .
+    // ,  GetCell(),  ,   
+    //     ;     
+    // Snapshot().        .
+    void SetConcurrentMode(bool enabled);
+
+    //    ,  ,   .
+    //       ,   
+    //   GetCell()      (
+    //  ),        . ,
+    //     ,  
+    SheetMemoryStats GetMemoryStats() const;
+
 private:
-    //   
-    Table cells_;
+    //  ,    
+    static constexpr size_t LOCK_STRIPES = 64;
+
+    //     ,     
+    //      
+    struct alignas(64) PaddedMutex {
+        std::shared_mutex mutex;
+    };
+
+    //       : 
+    //      ,  -  
+    //   .         
+    //    .       .
+    //   std::shared_lock  std::unique_lock
+    class StructureMutex {
+    public:
+        void lock();
+        void unlock();
+        void lock_shared();
+        void unlock_shared();
+
+    private:
+        static constexpr size_t SLOTS = 16;
+        std::array<PaddedMutex, SLOTS> slots_;
+    };
+
+    //         
+    struct CellLock {
+        std::shared_lock<StructureMutex> structure;
+        //    ,  -   
+        std::unique_lock<std::shared_mutex> stripe;
+        std::shared_lock<std::shared_mutex> shared_stripe;
+    };
+    //     :    
+    struct ReadAllLock {
+        std::shared_lock<StructureMutex> structure;
+        std::array<std::shared_lock<std::shared_mutex>, LOCK_STRIPES> stripes;
+    };
+
+    //       (  -  ,
+    //     ),        
+    //    ;    
+    CellLock LockCell(Position pos, bool write) const;
+    //     
+    static size_t GetStripeIndex(Position physical);
+    ReadAllLock LockAllForRead() const;
+    std::shared_lock<StructureMutex> LockShared() const;
+    std::unique_lock<StructureMutex> LockExclusive() const;
+
+    //         
+    void SaveSnapshotLocked(const std::string& filename) const;
+    void LoadSnapshotLocked(const std::string& filename);
+    void CompactJournalLocked();
+    //   
+    void ReplayJournal(const std::string& filename);
+    //        
+    void CompactJournalAfterWrite();
+
+    //     ,   
+    static SetCellResult CheckCellText(std::string_view text);
+
+    //      (  - )
+    struct BatchEdit {
+        Position pos;
+        std::optional<std::string> text;
+    };
+
+    //  ,   .   LockCell()
+    bool AddToBatch(Position pos, std::optional<std::string> text);
+    //  BatchException,   
+    void CheckNoBatch() const;
+
+    //     ,   
+    void AddChange(Range range);
+    void AddCellChange(Position pos);
+    //    .   
+    void NotifyChanges();
+    //        
+    bool ApplyHistoryStep(bool undo);
+
+    // ,      
+    bool IsRecording() const;
+    //          old
+    void RecordCellEdit(Position pos, std::optional<Cell> old);
+    //     () [first, first + count)
+    std::vector<CellDelta::Entry> CollectLines(bool rows, int first, int count) const;
+    //  (undo)    
+    void ApplyStep(UndoStep& step, bool undo);
+    //    delta       
+    void SwapCells(CellDelta& delta);
+
+    //         
+    void ApplySet(Position pos, std::string text);
+    void ApplyClear(Position pos);
+
+    //           
+    void ApplyStructural(Journal::Op op, int first, int count);
+
+    //         
+    void ApplyMove(Journal::Op op, int first, int count, int before);
+
+    //        
+    void ApplySort(Range range, const std::vector<SortKey>& keys);
+
+    //    top_left x cols:   i-  
+    //  order[i]. ApplyPermute      
+    void ApplyPermute(Position top_left, int cols, const std::vector<int>& order);
+    void PermuteRows(Position top_left, int cols, const std::vector<int>& order);
+
+    //  count   before     .
+    //  TableTooBigException,     .
+    void InsertLines(bool rows, int before, int count);
+    //   [first, first + count)    
+    void DeleteLines(bool rows, int first, int count);
+    //       () lines. 
+    // require_empty,     TableTooBigException  
+    void EraseLines(bool rows, const std::vector<int>& lines, bool require_empty);
+
+    //       
+    Position ToPhysical(Position pos) const;
+    Position ToLogical(Position pos) const;
+
+    //     ,   
+    IndexMap& GetMapForWrite(bool rows);
+
+    //    ,       
+    Cell& GetOrCreateCell(Position physical);
+    Cell& InsertCell(Position physical, Cell cell) const;
+
+    //         
+    void LogMutation(Journal::Op op, Position pos, std::string_view text = {});
+    // ,     compact_after_records 
+    bool IsCompactionDue() const;
+    //  ,   (   -   )
+    void CompactJournalIfNeeded();
+
+    //  ,      
+    const Cell* FindCell(Position pos) const;
+    //     :     
+    Cell* FindCellForWrite(Position pos);
+
+    //          
+    void MaterializeAll() const;
+    //   ,    :   cells_ 
+    //   ,    
+    Size GetPrintableSizeWithBase() const;
+
+    //       ( 
+    //     )
+    mutable CellGrid cells_;
+
+    //   cells_       
+    //  (  ).   
+    mutable std::vector<std::atomic<uint32_t>> row_entries_ = std::vector<std::atomic<uint32_t>>(Position::MAX_ROWS);
+    mutable std::vector<std::atomic<uint32_t>> col_entries_ = std::vector<std::atomic<uint32_t>>(Position::MAX_COLS);
+
+    //          cells_
+    std::shared_ptr<IndexMap> rows_ = std::make_shared<IndexMap>(Position::MAX_ROWS);
+    std::shared_ptr<IndexMap> cols_ = std::make_shared<IndexMap>(Position::MAX_COLS);
+
+    //  ,       cells_.  
+    // ,     
+    mutable std::shared_ptr<const SnapshotFile> base_;
+    //   base_      ,  
+    // cells_ (      )
+    mutable std::vector<uint32_t> base_shadowed_rows_;
+    mutable std::vector<uint32_t> base_shadowed_cols_;
+
+    //     
+    FormulaParsing parsing_ = FormulaParsing::Eager;
+    //    
+    bool profiling_ = false;
+
+    //  ,   
+    std::unique_ptr<Journal> journal_;
+
+    //      .  
+    // batch_mutex_,         
+    std::optional<std::vector<BatchEdit>> batch_;
+    std::mutex batch_mutex_;
+
+    //    Undo()  Redo()
+    UndoHistory history_;
+    //           
+    bool replaying_ = false;
+
+    //      , 
+    //    changes_mutex_ (   ),
+    //    delivery_mutex_,   
+    struct Subscription {
+        Range region;
+        std::shared_ptr<const ChangeListener> listener;
+    };
+    std::map<SubscriptionId, Subscription> subscriptions_;
+    SubscriptionId next_subscription_id_ = 1;
+    std::vector<Range> changes_;
+    std::atomic<bool> has_changes_ = false;
+    std::mutex changes_mutex_;
+    std::mutex delivery_mutex_;
+
+    //  :    structure_mutex_   
+    //    ,   - structure_mutex_ 
+    bool concurrent_ = false;
+    mutable StructureMutex structure_mutex_;
+    mutable std::array<PaddedMutex, LOCK_STRIPES> stripes_;
 };
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "file_mapping.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Исключение, выбрасываемое при чтении повреждённого или несовместимого снимка
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичный формат снимка таблицы (версия 1, порядок байт платформы):
+// заголовок, записи ячеек, упорядоченные по позиции, таблица смещений строк и
+// сами строки. Все секции выровнены на 8 байт, поэтому файл можно читать прямо
+// из отображённой памяти.
+namespace snapshot_format {
+
+    inline constexpr char MAGIC[8] = { 'S', 'P', 'S', 'H', 'E', 'E', 'T', '\0' };
+    inline constexpr uint32_t VERSION = 1;
+    inline constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint64_t cell_count;
+        uint64_t string_count;
+        uint64_t cells_offset;
+        uint64_t string_offsets_offset;  // uint64_t[string_count + 1]
+        uint64_t string_data_offset;
+    };
+
+    enum CellKind : uint8_t {
+        CK_TEXT = 0,
+        CK_FORMULA = 1,
+    };
+
+    enum ValueKind : uint8_t {
+        VK_NONE = 0,    // значение текстовой ячейки выводится из её текста
+        VK_NUMBER = 1,
+        VK_ERROR = 2,   // сообщение об ошибке хранится в строке error_id
+    };
+
+    struct CellRecord {
+        int32_t row;
+        int32_t col;
+        uint32_t text_id;
+        uint32_t error_id;
+        uint8_t kind;
+        uint8_t value_kind;
+        uint8_t reserved[6];
+        double number;
+    };
+
+    static_assert(sizeof(Header) == 56);
+    static_assert(sizeof(CellRecord) == 32);
+
+}  // namespace snapshot_format
+
+// Собирает снимок: интернирует строки и записывает файл
+class SnapshotWriter {
+public:
+    // Добавляет ячейку. Ячейки должны добавляться в порядке возрастания позиции
+    void AddCell(Position pos, std::string_view text, const CellInterface::Value& value);
+
+    void Write(std::ostream& output) const;
+
+private:
+    uint32_t Intern(std::string_view str);
+
+private:
+    std::vector<snapshot_format::CellRecord> cells_;
+    std::vector<std::string> strings_;
+    std::unordered_map<std::string, uint32_t> string_ids_;
+};
+
+// Снимок таблицы, отображённый в память. Ячейки создаются по запросу
+class SnapshotFile {
+public:
+    // Бросает SnapshotException, если файл повреждён или записан другой версией,
+    // в том числе если позиция записи недопустима или записи не упорядочены
+    explicit SnapshotFile(const std::string& filename);
+
+    size_t GetCellCount() const {
+        return cell_count_;
+    }
+
+    // Размер отображённого в память файла
+    size_t GetFileSize() const {
+        return file_.GetSize();
+    }
+
+    const snapshot_format::CellRecord& GetRecord(size_t index) const {
+        return cells_[index];
+    }
+
+    // Число записей в строке row и в столбце col снимка
+    uint32_t GetRowCellCount(int row) const {
+        return row_cells_[row];
+    }
+    uint32_t GetColCellCount(int col) const {
+        return col_cells_[col];
+    }
+
+    // Ищет запись ячейки двоичным поиском, возвращает nullptr, если её нет
+    const snapshot_format::CellRecord* Find(Position pos) const;
+
+    // Создаёт ячейку по записи без разбора формулы
+    Cell MakeCell(const snapshot_format::CellRecord& record) const;
+
+private:
+    std::string_view GetString(uint32_t id) const;
+
+private:
+    MappedFile file_;
+    const snapshot_format::CellRecord* cells_ = nullptr;
+    size_t cell_count_ = 0;
+    const uint64_t* string_offsets_ = nullptr;
+    size_t string_count_ = 0;
+    std::string_view string_data_;
+    std::vector<uint32_t> row_cells_;
+    std::vector<uint32_t> col_cells_;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Трассировка интервалов выполнения (импорт, разбор, печать...) по потокам с
+// выводом в формате Chrome trace event для chrome://tracing и Perfetto.
+// Каждый поток пишет завершённые интервалы в собственный кольцевой буфер без
+// блокировок; при переполнении затираются самые старые интервалы. Память буфера
+// выделяется частями по мере записи, а буфер завершившегося потока достаётся
+// следующему новому потоку, поэтому в трассе tid - это дорожка, которую могут
+// по очереди занимать несколько потоков. Пока трассировка не запущена,
+// интервал стоит одной атомарной загрузки.
+
+struct SpanTraceOptions {
+    // Число интервалов, которое хранит буфер каждого потока
+    size_t spans_per_thread = size_t{ 1 } << 16;
+};
+
+// Начинает новую трассу, забывая интервалы предыдущей
+void StartSpanTrace(SpanTraceOptions options = {});
+// Прекращает запись интервалов; записанные хранятся до следующего запуска
+void StopSpanTrace();
+bool IsSpanTraceActive();
+
+// Пишет записанные интервалы в формате Chrome trace event (JSON). Вызывается
+// после StopSpanTrace(): интервалы, завершающиеся во время записи, могут
+// оказаться испорчены
+void WriteSpanTrace(std::ostream& output);
+// То же в файл. Бросает std::runtime_error, если файл не открывается
+void WriteSpanTraceFile(const std::string& filename);
+
+// Число интервалов, затёртых при переполнении буферов
+size_t GetDroppedSpanCount();
+
+namespace span_trace_detail {
+
+    // Номер текущей трассы, 0 - трассировка не запущена
+    extern std::atomic<uint64_t> active_trace;
+
+    uint64_t Now();
+    void Record(uint64_t trace, const char* name, uint64_t start, uint64_t finish);
+
+}  // namespace span_trace_detail
+
+// Интервал от создания до разрушения объекта. name должен жить до записи
+// трассы (обычно это строковый литерал)
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name)
+        : trace_(span_trace_detail::active_trace.load(std::memory_order_relaxed)) {
+        if (trace_ != 0) {
+            name_ = name;
+            start_ = span_trace_detail::Now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (trace_ != 0) {
+            span_trace_detail::Record(trace_, name_, start_, span_trace_detail::Now());
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    uint64_t trace_;
+    const char* name_ = nullptr;
+    uint64_t start_ = 0;
+};
+
+#define SPREADSHEET_SPAN_CONCAT2(a, b) a##b
+#define SPREADSHEET_SPAN_CONCAT(a, b) SPREADSHEET_SPAN_CONCAT2(a, b)
+// Записывает интервал до конца текущей области видимости
+#define SPREADSHEET_TRACE_SPAN(name) const TraceSpan SPREADSHEET_SPAN_CONCAT(trace_span_, __LINE__)(name)
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <set>
@@ -79,6 +82,46 @@ inline void Assert(bool b, const std::string& hint) {
   AssertEqual(b, true, hint);
 }
 
+// Медиана времени repetitions запусков func
+template <class Func>
+std::chrono::nanoseconds MedianTime(Func func, size_t repetitions = 5) {
+  std::vector<std::chrono::nanoseconds> times;
+  for (size_t i = 0; i < std::max<size_t>(repetitions, 1); ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    times.push_back(std::chrono::steady_clock::now() - start);
+  }
+  std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+  return times[times.size() / 2];
+}
+
+// Проверяет отношение времён large = time(2 * n) и small = time(n): оно не
+// должно превышать max_factor
+inline void AssertScalingRatio(std::chrono::nanoseconds small, std::chrono::nanoseconds large, size_t n,
+                               double max_factor, const std::string& hint = {}) {
+  const double factor = static_cast<double>(large.count()) / static_cast<double>(std::max<int64_t>(small.count(), 1));
+  if (factor > max_factor) {
+    std::ostringstream os;
+    os << "Scaling assertion failed: time(" << 2 * n << ") / time(" << n << ") = " << factor << " > "
+       << max_factor << " (" << small.count() << " ns -> " << large.count() << " ns)";
+    if (!hint.empty()) {
+      os << " hint: " << hint;
+    }
+    throw std::runtime_error(os.str());
+  }
+}
+
+// Проверяет, что func(2 * n) выполняется не больше чем в max_factor раз
+// дольше func(n) (по медиане). Например, для линейного алгоритма подходит
+// множитель 3, а квадратичный даст около 4. Чтобы шум не влиял на отношение,
+// func(n) должен выполняться хотя бы миллисекунды
+template <class Func>
+void AssertScaling(Func func, size_t n, double max_factor, const std::string& hint = {}) {
+  const auto small = MedianTime([&func, n] { func(n); });
+  const auto large = MedianTime([&func, n] { func(2 * n); });
+  AssertScalingRatio(small, large, n, max_factor, hint);
+}
+
 class TestRunner {
 public:
   template <class TestFunc>
@@ -95,6 +138,21 @@ public:
     }
   }
 
+  // Тест дополнительно проваливается, если выполнялся дольше budget
+  template <class TestFunc>
+  void RunTimedTest(TestFunc func, const std::string& test_name, std::chrono::milliseconds budget) {
+    RunTest([&func, budget] {
+      const auto start = std::chrono::steady_clock::now();
+      func();
+      const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+      if (elapsed > budget) {
+        std::ostringstream os;
+        os << "Time budget exceeded: " << elapsed.count() << " ms > " << budget.count() << " ms";
+        throw std::runtime_error(os.str());
+      }
+    }, test_name);
+  }
+
   ~TestRunner() {
     std::cerr.flush();
     if (fail_count > 0) {
@@ -127,4 +185,15 @@ private:
     Assert(x, __assert_private_os.str());                          \
   }
 
-#define RUN_TEST(tr, func) tr.RunTest(func, #func)
\ No newline at end of file
+#define ASSERT_SCALING(func, n, max_factor)                             \
+  {                                                                     \
+    std::ostringstream __assert_scaling_private_os;                     \
+    __assert_scaling_private_os << #func << " scaling, " << FILE_NAME   \
+                                << ":" << __LINE__;                     \
+    AssertScaling(func, n, max_factor, __assert_scaling_private_os.str()); \
+  }
+
+#define RUN_TEST(tr, func) tr.RunTest(func, #func)
+
+#define RUN_TIMED_TEST(tr, func, budget_ms) \
+  tr.RunTimedTest(func, #func, std::chrono::milliseconds(budget_ms))
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Вызов SheetInterface в трассе
+struct TraceEvent {
+    enum class Op : uint8_t {
+        SetCell = 1,
+        TrySetCell = 2,
+        GetCell = 3,
+        ClearCell = 4,
+        InsertRows = 5,
+        InsertCols = 6,
+        DeleteRows = 7,
+        DeleteCols = 8,
+        GetPrintableSize = 9,
+        PrintValues = 10,
+        PrintTexts = 11,
+    };
+
+    Op op = Op::GetCell;
+    // Время вызова от начала записи
+    std::chrono::nanoseconds time{ 0 };
+    // Позиция ячейки; для вставки и удаления pos.row - первый номер (номер,
+    // перед которым выполняется вставка), pos.col - число строк или столбцов
+    Position pos;
+    // Текст SetCell и TrySetCell
+    std::string text;
+};
+
+// Название операции для отчётов
+const char* GetTraceOpName(TraceEvent::Op op);
+
+// Таблица, записывающая все вызовы SheetInterface в двоичную трассу и
+// передающая их исходной таблице. Трасса: заголовок, затем записи из кода
+// операции, прироста времени с прошлой записи в наносекундах (varint),
+// аргументов (varint) и текста (длина и байты). Вызов записывается до
+// выполнения, поэтому в трассу попадают и вызовы, бросившие исключение.
+// Изменения через CellInterface::Set не записываются.
+class RecordingSheet : public SheetInterface {
+public:
+    // Поток output должен жить дольше таблицы
+    RecordingSheet(std::unique_ptr<SheetInterface> sheet, std::ostream& output);
+    ~RecordingSheet() override;
+
+    void SetCell(Position pos, std::string text) override;
+    SetCellResult TrySetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    void InsertRows(int before, int count = 1) override;
+    void InsertCols(int before, int count = 1) override;
+    void DeleteRows(int first, int count = 1) override;
+    void DeleteCols(int first, int count = 1) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Сбрасывает записанные события в поток
+    void Flush();
+
+    SheetInterface& GetSheet() {
+        return *sheet_;
+    }
+
+private:
+    void Record(TraceEvent::Op op, Position pos = {}, std::string_view text = {}) const;
+
+private:
+    std::unique_ptr<SheetInterface> sheet_;
+    std::chrono::steady_clock::time_point start_;
+
+    // Вызовы могут приходить из нескольких потоков
+    mutable std::mutex mutex_;
+    std::ostream& output_;
+    mutable std::chrono::nanoseconds last_time_{ 0 };
+};
+
+// Читает трассу, записанную RecordingSheet. Недописанная последняя запись
+// (например, после аварийного завершения) отбрасывается. Бросает
+// std::runtime_error, если данные не являются трассой
+std::vector<TraceEvent> ReadTrace(std::istream& input);
+
+// Гистограмма задержек: логарифмические интервалы, каждая степень двойки
+// делится на 8 равных частей (погрешность не больше 12.5%)
+class LatencyHistogram {
+public:
+    void Add(std::chrono::nanoseconds latency);
+
+    size_t GetCount() const {
+        return count_;
+    }
+    std::chrono::nanoseconds GetTotal() const {
+        return total_;
+    }
+    std::chrono::nanoseconds GetMax() const {
+        return max_;
+    }
+    // Верхняя граница интервала, в который попадает перцентиль percent
+    std::chrono::nanoseconds GetPercentile(double percent) const;
+
+private:
+    static constexpr size_t SUB_BUCKETS = 8;
+    static constexpr size_t BUCKET_COUNT = 62 * SUB_BUCKETS;
+
+    static size_t GetBucket(uint64_t value);
+    static uint64_t GetBucketUpperBound(size_t bucket);
+
+private:
+    std::array<uint64_t, BUCKET_COUNT> buckets_{};
+    size_t count_ = 0;
+    std::chrono::nanoseconds total_{ 0 };
+    std::chrono::nanoseconds max_{ 0 };
+};
+
+struct ReplayOptions {
+    // Выдерживать записанные интервалы между вызовами (иначе - с полной скоростью)
+    bool paced = false;
+    // Во сколько раз ускорить записанный темп
+    double speed = 1.0;
+};
+
+// Результат воспроизведения трассы
+struct ReplayReport {
+    // Задержки по операциям, индекс - код операции
+    std::array<LatencyHistogram, 12> latencies;
+    // Вызовы, бросившие исключение (при записи они, скорее всего, тоже бросали)
+    size_t failed = 0;
+    std::chrono::nanoseconds elapsed{ 0 };
+
+    // Печатает таблицу: операция, число вызовов, среднее, p50, p90, p99, максимум (мкс)
+    void Print(std::ostream& output) const;
+};
+
+// Выполняет вызовы трассы над таблицей и измеряет задержку каждого. Вывод
+// PrintValues и PrintTexts отбрасывается
+ReplayReport ReplayTrace(SheetInterface& sheet, const std::vector<TraceEvent>& events, ReplayOptions options = {});
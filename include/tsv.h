@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+#include <string_view>
+#include <vector>
+
+// Непустое поле текста в формате Sheet::PrintTexts. Позиция может выходить за
+// пределы таблицы, если файл слишком большой; текст ссылается на исходные данные.
+struct TsvField {
+    Position pos;
+    std::string_view text;
+};
+
+// Разбивает текст на поля: столбцы разделяются '\t', строки - '\n' (завершающий
+// '\r' отбрасывается). Пустые поля пропускаются. Границы ищутся SIMD-сканированием.
+std::vector<TsvField> SplitTsv(std::string_view data);
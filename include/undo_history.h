@@ -0,0 +1,124 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "journal.h"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Настройки истории изменений таблицы
+struct UndoOptions {
+    // Оценка памяти, которую может занимать история; при превышении забываются
+    // самые старые шаги (последний шаг остаётся всегда)
+    size_t memory_budget = size_t{ 64 } << 20;
+    // Изменения одной ячейки, следующие друг за другом чаще этого интервала,
+    // отменяются одним шагом
+    std::chrono::milliseconds coalesce_interval{ 500 };
+};
+
+// Содержимое изменённых ячеек по логическим позициям (nullopt - ячейки нет).
+// Ячейки хранятся отрезками соседних ячеек строки, поэтому изменение области
+// не хранит позицию каждой ячейки. Сами ячейки разделяют реализацию с
+// таблицей и не копируют текст.
+class CellDelta {
+public:
+    using Entry = std::pair<Position, std::optional<Cell>>;
+
+    CellDelta() = default;
+    // Из нескольких записей одной позиции остаётся первая
+    explicit CellDelta(std::vector<Entry> cells);
+
+    // Вызывает func(pos, cell) для каждой ячейки; cell можно заменить
+    template <typename Func>
+    void ForEach(Func func);
+
+    size_t GetCellCount() const;
+    // Оценивает память, занимаемую ячейками и их текстом
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Run {
+        Position start;
+        std::vector<std::optional<Cell>> cells;
+    };
+    std::vector<Run> runs_;
+};
+
+// Шаг истории. Вид шага задаёт op:
+//   Batch - изменение ячеек, cells хранит их содержимое до (или после) шага;
+//   InsertRows...DeleteCols - first и count, для удаления в cells удалённые ячейки;
+//   MoveRows, MoveCols - first, count и before;
+//   SortRange - order, перестановка строк области top_left x cols.
+// Отмена и повтор обменивают содержимое cells с таблицей.
+struct UndoStep {
+    Journal::Op op = Journal::Op::Batch;
+    int first = 0;
+    int count = 0;
+    int before = 0;
+    Position top_left;
+    int cols = 0;
+    std::vector<int> order;
+    CellDelta cells;
+    // Ячейка, изменения которой можно объединять в один шаг
+    std::optional<Position> coalesce_pos;
+    std::chrono::steady_clock::time_point time;
+    size_t memory = 0;
+};
+
+// Стеки отмены и повтора с ограничением памяти. Добавлять шаги можно из
+// нескольких потоков; включение и выключение выполняются под монопольной
+// блокировкой таблицы.
+class UndoHistory {
+public:
+    void Enable(UndoOptions options);
+    void Disable();
+    bool IsEnabled() const {
+        return options_.has_value();
+    }
+
+    // Добавляет шаг новой правки и забывает отменённые шаги. Шаг изменения той
+    // же ячейки вскоре после предыдущего объединяется с ним: в истории остаётся
+    // содержимое ячейки до первого изменения
+    void Record(UndoStep step);
+
+    // Снимает шаг со стека отмены или повтора
+    std::optional<UndoStep> TakeUndo();
+    std::optional<UndoStep> TakeRedo();
+    // Кладёт выполненный шаг на противоположный стек
+    void PutUndo(UndoStep step);
+    void PutRedo(UndoStep step);
+
+    bool CanUndo() const;
+    bool CanRedo() const;
+    size_t GetMemoryUsage() const;
+    void Clear();
+
+private:
+    void Put(std::deque<UndoStep>& steps, UndoStep step);
+    std::optional<UndoStep> Take(std::deque<UndoStep>& steps);
+    // Забывает самые старые шаги, пока история не уложится в бюджет
+    void Evict();
+
+private:
+    std::optional<UndoOptions> options_;
+
+    mutable std::mutex mutex_;
+    // Последний шаг - в конце
+    std::deque<UndoStep> undo_;
+    std::deque<UndoStep> redo_;
+    size_t memory_ = 0;
+};
+
+template <typename Func>
+void CellDelta::ForEach(Func func) {
+    for (Run& run : runs_) {
+        for (size_t i = 0; i < run.cells.size(); ++i) {
+            func(Position{ run.start.row, run.start.col + static_cast<int>(i) }, run.cells[i]);
+        }
+    }
+}
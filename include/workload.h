@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Параметры синтетической таблицы. Содержимое каждой ячейки определяется
+// только seed и её позицией, поэтому одинаковые параметры дают одинаковую
+// таблицу на любой платформе и при любом порядке обхода.
+struct WorkloadOptions {
+    uint64_t seed = 1;
+    // Размер области, в которой расставляются ячейки
+    Size size{ 1000, 26 };
+    // Доля заполненных ячеек области
+    double density = 1.0;
+    // Доля текстовых столбцов: все ячейки такого столбца - текст
+    double text_column_ratio = 0.0;
+    // Средняя длина текста в текстовых столбцах
+    size_t text_length = 16;
+    // Доля формул среди нетекстовых ячеек, остальные - числа, записанные текстом
+    double formula_ratio = 0.5;
+    // Глубина вложенности скобок в формулах
+    int formula_depth = 2;
+};
+
+// Готовые формы таблиц
+// Все ячейки заполнены числами и формулами
+WorkloadOptions DenseNumericWorkload(Size size, uint64_t seed = 1);
+// Редкие ячейки, разбросанные по всей таблице
+WorkloadOptions SparseScatterWorkload(Size size, double density, uint64_t seed = 1);
+// Половина столбцов - длинный текст
+WorkloadOptions TextColumnsWorkload(Size size, size_t text_length, uint64_t seed = 1);
+// Только формулы с глубокой вложенностью
+WorkloadOptions DeepFormulaWorkload(Size size, int depth, uint64_t seed = 1);
+
+// Возвращает текст ячейки pos или пустую строку, если ячейка не заполнена
+std::string GenerateCellText(const WorkloadOptions& options, Position pos);
+
+// Заполняет таблицу через SetCell() и возвращает число заданных ячеек.
+// Бросает InvalidPositionException, если область не помещается в таблицу
+size_t FillSheet(SheetInterface& sheet, const WorkloadOptions& options);
+
+// Пишет таблицу в формате Sheet::PrintTexts (для Sheet::ImportTexts) и
+// возвращает число заданных ячеек. Строки и столбцы после последней
+// заполненной ячейки не выводятся, как и в PrintTexts
+size_t WriteWorkloadTsv(std::ostream& output, const WorkloadOptions& options);
@@ -3,9 +3,13 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula_stats.h"
+#include "span_trace.h"
 
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -81,6 +85,9 @@ public:
     // Возвращает приоритет выражения
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // Добавляет к nodes и bytes число узлов поддерева и занимаемую ими память
+    virtual void AddMemoryUsage(size_t& nodes, size_t& bytes) const = 0;
+
     // Метод для печати формулы с учетом приоритетов
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
@@ -183,6 +190,13 @@ public:
         return result;
     }
 
+    void AddMemoryUsage(size_t& nodes, size_t& bytes) const override {
+        ++nodes;
+        bytes += sizeof(*this);
+        lhs_->AddMemoryUsage(nodes, bytes);
+        rhs_->AddMemoryUsage(nodes, bytes);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
@@ -242,6 +256,12 @@ public:
         return result;
     }
 
+    void AddMemoryUsage(size_t& nodes, size_t& bytes) const override {
+        ++nodes;
+        bytes += sizeof(*this);
+        operand_->AddMemoryUsage(nodes, bytes);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -271,6 +291,11 @@ public:
         return value_;
     }
 
+    void AddMemoryUsage(size_t& nodes, size_t& bytes) const override {
+        ++nodes;
+        bytes += sizeof(*this);
+    }
+
 private:
     double value_;
 };
@@ -360,6 +385,152 @@ public:
     }
 };
 
+// Класс для проверки синтаксиса формулы без ANTLR и без исключений.
+// Распознаёт тот же язык, что и грамматика Formula.g4, но не строит дерево:
+// expr   : term (('+' | '-') term)*
+// term   : factor (('*' | '/') factor)*
+// factor : ('+' | '-')* (NUMBER | '(' expr ')')
+class SyntaxChecker {
+public:
+    explicit SyntaxChecker(std::string_view text)
+        : text_(text) {
+    }
+
+    // Возвращает смещение первого ошибочного символа или std::nullopt
+    std::optional<size_t> Check() {
+        if (!ParseExpr()) {
+            return error_;
+        }
+        SkipSpaces();
+        if (pos_ != text_.size()) {
+            return pos_;
+        }
+        return std::nullopt;
+    }
+
+private:
+    bool ParseExpr() {
+        if (!ParseTerm()) {
+            return false;
+        }
+        while (SkipSpaces(), pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-')) {
+            ++pos_;
+            if (!ParseTerm()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ParseTerm() {
+        if (!ParseFactor()) {
+            return false;
+        }
+        while (SkipSpaces(), pos_ < text_.size() && (text_[pos_] == '*' || text_[pos_] == '/')) {
+            ++pos_;
+            if (!ParseFactor()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ParseFactor() {
+        // Унарные операции обрабатываем циклом, чтобы не углублять рекурсию
+        while (SkipSpaces(), pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-')) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            return Fail(pos_);
+        }
+        if (text_[pos_] == '(') {
+            ++pos_;
+            if (!ParseExpr()) {
+                return false;
+            }
+            SkipSpaces();
+            if (pos_ == text_.size() || text_[pos_] != ')') {
+                return Fail(pos_);
+            }
+            ++pos_;
+            return true;
+        }
+        return ParseNumber();
+    }
+
+    // NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    bool ParseNumber() {
+        const size_t start = pos_;
+        const size_t int_digits = SkipDigits();
+        size_t frac_digits = 0;
+        if (pos_ < text_.size() && text_[pos_] == '.') {
+            ++pos_;
+            frac_digits = SkipDigits();
+            if (frac_digits == 0) {
+                return Fail(int_digits == 0 ? start : pos_ - 1);
+            }
+        }
+        if (int_digits == 0 && frac_digits == 0) {
+            return Fail(start);
+        }
+
+        bool has_exponent = false;
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            size_t exp_pos = pos_ + 1;
+            if (exp_pos < text_.size() && (text_[exp_pos] == '+' || text_[exp_pos] == '-')) {
+                ++exp_pos;
+            }
+            // Лексер ANTLR не поглощает "e" без цифр, и оставшийся символ становится ошибкой
+            if (exp_pos == text_.size() || !IsDigit(text_[exp_pos])) {
+                return Fail(pos_);
+            }
+            pos_ = exp_pos;
+            SkipDigits();
+            has_exponent = true;
+        }
+
+        // Переполнение возможно только с экспонентой или при очень длинной записи;
+        // в этом случае ParseASTListener отвергает литерал как "Invalid number"
+        if (has_exponent || pos_ - start > std::numeric_limits<double>::max_exponent10) {
+            const std::string literal(text_.substr(start, pos_ - start));
+            if (std::isinf(std::strtod(literal.c_str(), nullptr))) {
+                return Fail(start);
+            }
+        }
+        return true;
+    }
+
+    size_t SkipDigits() {
+        const size_t start = pos_;
+        while (pos_ < text_.size() && IsDigit(text_[pos_])) {
+            ++pos_;
+        }
+        return pos_ - start;
+    }
+
+    // Пропускает те же пробельные символы, что и правило WS грамматики
+    void SkipSpaces() {
+        while (pos_ < text_.size()
+               && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+    }
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    bool Fail(size_t offset) {
+        error_ = offset;
+        return false;
+    }
+
+private:
+    std::string_view text_;
+    size_t pos_ = 0;
+    size_t error_ = 0;
+};
+
 }  // namespace
 }  // namespace ASTImpl
 
@@ -367,29 +538,46 @@ public:
 FormulaAST ParseFormulaAST(std::istream& in) {
     using namespace antlr4;
 
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
+    std::optional<ANTLRInputStream> input;
+    std::optional<FormulaLexer> lexer;
     ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
+    std::optional<CommonTokenStream> tokens;
+    {
+        SPREADSHEET_FORMULA_PHASE(FormulaPhase::Lex);
+        input.emplace(in);
+        lexer.emplace(&*input);
+        lexer->removeErrorListeners();
+        lexer->addErrorListener(&error_listener);
+        tokens.emplace(&*lexer);
+#if SPREADSHEET_FORMULA_STATS
+        // Обычно лексемы читаются по мере разбора; для раздельного учёта
+        // этапов они читаются заранее
+        tokens->fill();
+#endif
+    }
 
-    FormulaParser parser(&tokens);
+    FormulaParser parser(&*tokens);
     auto error_handler = std::make_shared<BailErrorStrategy>();
     parser.setErrorHandler(error_handler);
     parser.removeErrorListeners();
 
-    tree::ParseTree* tree = parser.main();
+    tree::ParseTree* tree = nullptr;
+    {
+        SPREADSHEET_FORMULA_PHASE(FormulaPhase::Parse);
+        tree = parser.main();
+    }
     ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    {
+        SPREADSHEET_FORMULA_PHASE(FormulaPhase::BuildAst);
+        tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    }
 
     return FormulaAST(listener.MoveRoot());
 }
 
 // Функция для парсинга AST формулы из строки
 FormulaAST ParseFormulaAST(const std::string& in_str) {
+    SPREADSHEET_TRACE_SPAN("ParseFormulaAST");
     std::istringstream in(in_str);
     try {
         return ParseFormulaAST(in);
@@ -398,6 +586,11 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     }
 }
 
+// Функция для проверки синтаксиса формулы без построения AST и без исключений
+std::optional<size_t> CheckFormulaSyntax(std::string_view expression) {
+    return ASTImpl::SyntaxChecker(expression).Check();
+}
+
 // Метод для печати AST в поток вывода
 void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
@@ -405,14 +598,30 @@ void FormulaAST::Print(std::ostream& out) const {
 
 // Метод для печати формулы в поток вывода
 void FormulaAST::PrintFormula(std::ostream& out) const {
+    SPREADSHEET_FORMULA_PHASE(FormulaPhase::Canonicalize);
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
 // Метод для выполнения формулы и получения результата
 double FormulaAST::Execute() const {
+    SPREADSHEET_FORMULA_PHASE(FormulaPhase::Execute);
     return root_expr_->Evaluate();
 }
 
+size_t FormulaAST::GetNodeCount() const {
+    size_t nodes = 0;
+    size_t bytes = 0;
+    root_expr_->AddMemoryUsage(nodes, bytes);
+    return nodes;
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    size_t nodes = 0;
+    size_t bytes = 0;
+    root_expr_->AddMemoryUsage(nodes, bytes);
+    return bytes;
+}
+
 // Конструктор класса FormulaAST
 FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr)
     : root_expr_(std::move(root_expr)) {
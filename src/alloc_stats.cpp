@@ -0,0 +1,348 @@
+#include "alloc_stats.h"
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+#if SPREADSHEET_ALLOC_STATS
+#include <cstdlib>
+#include <memory>
+#include <new>
+#endif
+
+namespace {
+
+    // Счётчики потока. Структура без конструктора, чтобы к ней можно было
+    // обращаться из operator new в любой момент жизни потока
+    struct ThreadAllocState {
+        uint64_t allocations;
+        uint64_t bytes;
+        int depth;
+        AllocCounters scope_start;
+        // Выделения operator new не считаются: их уже учёл ресурс pmr
+        int suppressed;
+    };
+
+    thread_local ThreadAllocState thread_state;
+
+#if SPREADSHEET_ALLOC_STATS
+
+    // Операции одного потока. Пишет только владелец, атомарность нужна для
+    // чтения из GetAllocStats()
+    struct OpEntry {
+        std::atomic<const char*> name{ nullptr };
+        std::atomic<uint64_t> calls{ 0 };
+        std::atomic<uint64_t> allocations{ 0 };
+        std::atomic<uint64_t> bytes{ 0 };
+    };
+
+    // Последняя запись собирает операции, не поместившиеся в таблицу
+    constexpr size_t MAX_OPS = 64;
+    constexpr const char* OTHER_OP = "(other)";
+
+    struct OpTable {
+        std::array<OpEntry, MAX_OPS> entries;
+    };
+
+    // Таблицы живых потоков и сумма по завершившимся
+    struct Registry {
+        std::mutex mutex;
+        std::vector<OpTable*> tables;
+        std::map<std::string, AllocOpStats> retired;
+    };
+
+    Registry& GetRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    void AddTo(const OpTable& table, std::map<std::string, AllocOpStats>& stats) {
+        for (const OpEntry& entry : table.entries) {
+            const char* name = entry.name.load(std::memory_order_relaxed);
+            if (name == nullptr) {
+                break;
+            }
+            AllocOpStats& op = stats[name];
+            op.calls += entry.calls.load(std::memory_order_relaxed);
+            op.allocations += entry.allocations.load(std::memory_order_relaxed);
+            op.bytes += entry.bytes.load(std::memory_order_relaxed);
+        }
+    }
+
+    class OpTableHolder {
+    public:
+        OpTableHolder()
+            : registry_(GetRegistry()) {
+            std::lock_guard lock(registry_.mutex);
+            registry_.tables.push_back(&table_);
+        }
+
+        ~OpTableHolder() {
+            std::lock_guard lock(registry_.mutex);
+            AddTo(table_, registry_.retired);
+            registry_.tables.erase(std::find(registry_.tables.begin(), registry_.tables.end(), &table_));
+        }
+
+        OpEntry& Find(const char* name) {
+            for (size_t i = 0; i + 1 < MAX_OPS; ++i) {
+                OpEntry& entry = table_.entries[i];
+                const char* entry_name = entry.name.load(std::memory_order_relaxed);
+                if (entry_name == name) {
+                    return entry;
+                }
+                if (entry_name == nullptr) {
+                    entry.name.store(name, std::memory_order_relaxed);
+                    return entry;
+                }
+            }
+            OpEntry& other = table_.entries.back();
+            other.name.store(OTHER_OP, std::memory_order_relaxed);
+            return other;
+        }
+
+    private:
+        Registry& registry_;
+        OpTable table_;
+    };
+
+    void Increment(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void CountAllocation(size_t size) {
+        if (thread_state.suppressed != 0) {
+            return;
+        }
+        ++thread_state.allocations;
+        thread_state.bytes += size;
+    }
+
+    // Отключает учёт operator new на время выделения вышестоящим ресурсом pmr
+    class SuppressCounting {
+    public:
+        SuppressCounting() {
+            ++thread_state.suppressed;
+        }
+        ~SuppressCounting() {
+            --thread_state.suppressed;
+        }
+
+        SuppressCounting(const SuppressCounting&) = delete;
+        SuppressCounting& operator=(const SuppressCounting&) = delete;
+    };
+
+    void* AllocateCounted(size_t size) {
+        CountAllocation(size);
+        for (;;) {
+            if (void* p = std::malloc(size != 0 ? size : 1)) {
+                return p;
+            }
+            const std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr) {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    void* AllocateCountedAligned(size_t size, std::align_val_t alignment) {
+        CountAllocation(size);
+        const auto align = static_cast<size_t>(alignment);
+        // aligned_alloc требует размер, кратный выравниванию
+        const size_t rounded = (std::max<size_t>(size, 1) + align - 1) / align * align;
+        for (;;) {
+#ifdef _MSC_VER
+            if (void* p = _aligned_malloc(rounded, align)) {
+#else
+            if (void* p = std::aligned_alloc(align, rounded)) {
+#endif
+                return p;
+            }
+            const std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr) {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    void FreeAligned(void* p) {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+
+#endif
+
+}  // namespace
+
+#if SPREADSHEET_ALLOC_STATS
+
+// Остальные формы operator new и operator delete по умолчанию выражены через эти
+void* operator new(size_t size) {
+    return AllocateCounted(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return AllocateCountedAligned(size, alignment);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    FreeAligned(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    FreeAligned(p);
+}
+
+namespace alloc_stats_detail {
+
+    void BeginScope() {
+        if (thread_state.depth++ == 0) {
+            thread_state.scope_start = { thread_state.allocations, thread_state.bytes };
+        }
+    }
+
+    void EndScope(const char* name) {
+        if (--thread_state.depth != 0) {
+            return;
+        }
+        // Выделения самой таблицы операций не приписываются операции
+        const uint64_t allocations = thread_state.allocations - thread_state.scope_start.allocations;
+        const uint64_t bytes = thread_state.bytes - thread_state.scope_start.bytes;
+        thread_local OpTableHolder holder;
+        OpEntry& entry = holder.Find(name);
+        Increment(entry.calls, 1);
+        Increment(entry.allocations, allocations);
+        Increment(entry.bytes, bytes);
+    }
+
+}  // namespace alloc_stats_detail
+
+#endif
+
+AllocCounters GetThreadAllocCounters() {
+    return { thread_state.allocations, thread_state.bytes };
+}
+
+std::vector<AllocOpStats> GetAllocStats() {
+    std::map<std::string, AllocOpStats> stats;
+#if SPREADSHEET_ALLOC_STATS
+    Registry& registry = GetRegistry();
+    {
+        std::lock_guard lock(registry.mutex);
+        stats = registry.retired;
+        for (const OpTable* table : registry.tables) {
+            AddTo(*table, stats);
+        }
+    }
+#endif
+    std::vector<AllocOpStats> result;
+    for (auto& [name, op] : stats) {
+        // После сброса в таблицах остаются имена операций без вызовов
+        if (op.calls == 0) {
+            continue;
+        }
+        op.name = name;
+        result.push_back(std::move(op));
+    }
+    std::stable_sort(result.begin(), result.end(), [](const AllocOpStats& lhs, const AllocOpStats& rhs) {
+        return lhs.bytes > rhs.bytes;
+    });
+    return result;
+}
+
+void ResetAllocStats() {
+#if SPREADSHEET_ALLOC_STATS
+    // Вызовы, завершающиеся в других потоках во время сброса, могут потеряться
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.retired.clear();
+    for (OpTable* table : registry.tables) {
+        for (OpEntry& entry : table->entries) {
+            entry.calls.store(0, std::memory_order_relaxed);
+            entry.allocations.store(0, std::memory_order_relaxed);
+            entry.bytes.store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
+}
+
+void DumpAllocStats(std::ostream& output) {
+    if (!IsAllocStatsEnabled()) {
+        output << "allocation stats are disabled (build with SPREADSHEET_ALLOC_STATS=1)\n";
+        return;
+    }
+    output << std::left << std::setw(28) << "operation" << std::right << std::setw(12) << "calls"
+           << std::setw(14) << "allocs/call" << std::setw(14) << "bytes/call" << std::setw(16) << "bytes" << '\n';
+    output << std::fixed << std::setprecision(2);
+    for (const AllocOpStats& op : GetAllocStats()) {
+        const double calls = static_cast<double>(std::max<uint64_t>(op.calls, 1));
+        output << std::left << std::setw(28) << op.name << std::right << std::setw(12) << op.calls
+               << std::setw(14) << static_cast<double>(op.allocations) / calls
+               << std::setw(14) << static_cast<double>(op.bytes) / calls << std::setw(16) << op.bytes << '\n';
+    }
+}
+
+void* CountingMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+#if SPREADSHEET_ALLOC_STATS
+    void* p = nullptr;
+    {
+        const SuppressCounting suppress;
+        p = upstream_->allocate(bytes, alignment);
+    }
+    CountAllocation(bytes);
+#else
+    void* p = upstream_->allocate(bytes, alignment);
+#endif
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    in_use_.fetch_add(bytes, std::memory_order_relaxed);
+    return p;
+}
+
+void CountingMemoryResource::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    upstream_->deallocate(p, bytes, alignment);
+    in_use_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+bool CountingMemoryResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+AllocDelegation::AllocDelegation()
+    : in_scope_(thread_state.depth > 0) {
+}
+
+AllocDelegation::~AllocDelegation() {
+    thread_state.allocations += allocations_.load(std::memory_order_relaxed);
+    thread_state.bytes += bytes_.load(std::memory_order_relaxed);
+}
+
+AllocCounters AllocDelegation::BeginTask() {
+    if (in_scope_) {
+        ++thread_state.depth;
+    }
+    return GetThreadAllocCounters();
+}
+
+void AllocDelegation::EndTask(AllocCounters start) {
+    allocations_.fetch_add(thread_state.allocations - start.allocations, std::memory_order_relaxed);
+    bytes_.fetch_add(thread_state.bytes - start.bytes, std::memory_order_relaxed);
+    if (in_scope_) {
+        --thread_state.depth;
+    }
+}
@@ -1,37 +1,198 @@
 #include "cell.h"
 
+#include "alloc_stats.h"
+
 #include <cassert>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <optional>
 
 
 // Реализуйте следующие методы
 Cell::Cell() {
-	impl_ = std::make_unique<EmptyImpl>();
+	impl_ = std::make_shared<EmptyImpl>();
+}
+
+Cell::Cell(std::string text, FormulaParsing parsing, bool profile)
+	: impl_(MakeImpl(std::move(text), parsing, profile)) {
+}
+
+Cell::Cell(std::string formula_text, FormulaInterface::Value value)
+	: impl_(std::make_shared<FormulaImpl>(std::move(formula_text), std::move(value))) {
 }
 
 Cell::~Cell() {}
 
-void Cell::Set(std::string text) {
-	if (text.size() == 0) {
-		impl_ = std::make_unique<EmptyImpl>();
-	}
-	else if (text.size() > 1 && text[0] == '=') {
-		impl_ = std::make_unique<FormulaImpl>(std::move(text));
+Cell::Cell(const Cell& other)
+	: impl_(other.impl_) {
+}
+
+Cell& Cell::operator=(const Cell& other) {
+	if (this != &other) {
+		SetImpl(other.impl_);
 	}
-	else {
-		impl_ = std::make_unique<TextImpl>(std::move(text));
+	return *this;
+}
+
+// Реализация учтённой ячейки не забирается: ячейка остаётся в счётчиках
+Cell::Cell(Cell&& other) noexcept
+	: impl_(other.totals_ != nullptr ? other.impl_ : std::move(other.impl_)) {
+}
+
+Cell& Cell::operator=(Cell&& other) noexcept {
+	if (this != &other) {
+		SetImpl(other.totals_ != nullptr ? other.impl_ : std::move(other.impl_));
 	}
+	return *this;
+}
+
+void Cell::Set(std::string text) {
+	SPREADSHEET_ALLOC_SCOPE("Cell::Set");
+	SetImpl(MakeImpl(std::move(text), FormulaParsing::Eager));
+}
+
+void Cell::Set(std::string text, FormulaParsing parsing, bool profile) {
+	SetImpl(MakeImpl(std::move(text), parsing, profile));
 }
 
 void Cell::Clear() {
-	impl_ = std::make_unique<EmptyImpl>();
+	SetImpl(std::make_shared<EmptyImpl>());
+}
+
+void Cell::SetImpl(std::shared_ptr<const Impl> impl) {
+	if (totals_ == nullptr) {
+		impl_ = std::move(impl);
+		return;
+	}
+	totals_->Subtract(impl_->Detach(*totals_));
+	impl_ = std::move(impl);
+	totals_->Add(impl_->Attach(*totals_));
 }
 
 Cell::Value Cell::GetValue() const {
+	SPREADSHEET_ALLOC_SCOPE("Cell::GetValue");
 	return impl_->GetValue();
 }
 std::string Cell::GetText() const {
+	SPREADSHEET_ALLOC_SCOPE("Cell::GetText");
 	return impl_->GetText();
-}
\ No newline at end of file
+}
+
+bool Cell::IsEmpty() const {
+	return impl_->IsEmpty();
+}
+
+size_t Cell::GetTextSize() const {
+	return impl_->GetTextSize();
+}
+
+void Cell::Prepare() const {
+	impl_->Prepare();
+}
+
+CellValueType Cell::ReadValue(double& number, std::string_view& text) const {
+	return impl_->ReadValue(number, text);
+}
+
+void Cell::AddMemoryUsage(CellMemoryStats& stats) const {
+	impl_->AddMemoryUsage(stats);
+}
+
+void Cell::AttachMemoryTotals(CellMemoryTotals* totals) {
+	DetachMemoryTotals();
+	totals_ = totals;
+	totals_->Add(impl_->Attach(*totals_));
+}
+
+void Cell::DetachMemoryTotals() {
+	if (totals_ != nullptr) {
+		totals_->Subtract(impl_->Detach(*totals_));
+		totals_ = nullptr;
+	}
+}
+
+void Cell::TakeOverMemoryTotals(const Cell& original) {
+	totals_ = original.totals_;
+}
+
+std::optional<FormulaCellProfile> Cell::GetProfile() const {
+	return impl_->GetProfile();
+}
+
+size_t Cell::Impl::GetHeapBytes(const std::string& str) {
+	// Ёмкость пустой строки равна размеру внутреннего буфера
+	static const size_t inline_capacity = std::string().capacity();
+	return str.capacity() > inline_capacity ? str.capacity() + 1 : 0;
+}
+
+size_t Cell::Impl::GetHeapBytes(const Value& value) {
+	const auto* str = std::get_if<std::string>(&value);
+	return str != nullptr ? GetHeapBytes(*str) : 0;
+}
+
+namespace {
+
+	// Поля CellMemoryStats по порядку (для поэлементных операций)
+	constexpr size_t CellMemoryStats::* kMemoryStatsFields[] = {
+		&CellMemoryStats::empty_cells,
+		&CellMemoryStats::text_cells,
+		&CellMemoryStats::formula_cells,
+		&CellMemoryStats::empty_bytes,
+		&CellMemoryStats::text_cell_bytes,
+		&CellMemoryStats::formula_cell_bytes,
+		&CellMemoryStats::text_bytes,
+		&CellMemoryStats::ast_nodes,
+		&CellMemoryStats::ast_bytes,
+		&CellMemoryStats::unparsed_formulas,
+	};
+	static_assert(std::size(kMemoryStatsFields) * sizeof(size_t) == sizeof(CellMemoryStats));
+
+}  // namespace
+
+CellMemoryStats& CellMemoryStats::operator+=(const CellMemoryStats& other) {
+	for (auto field : kMemoryStatsFields) {
+		this->*field += other.*field;
+	}
+	return *this;
+}
+
+void CellMemoryTotals::Add(const CellMemoryStats& stats) {
+	for (size_t i = 0; i < values_.size(); ++i) {
+		if (const size_t value = stats.*kMemoryStatsFields[i]) {
+			values_[i].fetch_add(value, std::memory_order_relaxed);
+		}
+	}
+}
+
+void CellMemoryTotals::Subtract(const CellMemoryStats& stats) {
+	for (size_t i = 0; i < values_.size(); ++i) {
+		if (const size_t value = stats.*kMemoryStatsFields[i]) {
+			values_[i].fetch_sub(value, std::memory_order_relaxed);
+		}
+	}
+}
+
+CellMemoryStats CellMemoryTotals::Load() const {
+	CellMemoryStats stats;
+	for (size_t i = 0; i < values_.size(); ++i) {
+		stats.*kMemoryStatsFields[i] = values_[i].load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+size_t CellMemoryStats::GetTotalBytes() const {
+	return empty_bytes + text_cell_bytes + formula_cell_bytes + text_bytes + ast_bytes;
+}
+
+std::shared_ptr<const Cell::Impl> Cell::MakeImpl(std::string text, FormulaParsing parsing, bool profile) {
+	if (text.size() == 0) {
+		return std::make_shared<EmptyImpl>();
+	}
+	else if (text.size() > 1 && text[0] == '=') {
+		return std::make_shared<FormulaImpl>(text, parsing, profile);
+	}
+	else {
+		return std::make_shared<TextImpl>(std::move(text));
+	}
+}
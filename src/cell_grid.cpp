@@ -0,0 +1,209 @@
+#include "cell_grid.h"
+
+static_assert(Position::MAX_ROWS % CellGrid::TILE_SIZE == 0 && Position::MAX_COLS % CellGrid::TILE_SIZE == 0);
+
+namespace {
+
+    // Память объекта типа T, созданного make_shared (с блоком управления)
+    template <typename T>
+    constexpr size_t GetSharedSize() {
+        return sizeof(T) + sizeof(void*) + 2 * sizeof(int);
+    }
+
+    // Узел хеш-таблицы: указатель на следующий узел, элемент и сохранённый хеш
+    constexpr size_t NODE_SIZE = sizeof(void*) + sizeof(CellGrid::Table::value_type) + sizeof(size_t);
+
+}  // namespace
+
+CellGrid::CellGrid()
+    : totals_(std::make_unique<MemoryTotals>()) {
+}
+
+CellGrid::CellGrid(const CellGrid& other)
+    : root_(other.root_) {
+}
+
+CellGrid& CellGrid::operator=(const CellGrid& other) {
+    root_ = other.root_;
+    totals_.reset();
+    return *this;
+}
+
+const Cell* CellGrid::Find(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    if (tile == nullptr) {
+        return nullptr;
+    }
+    auto it = tile->cells.find(pos);
+    return it != tile->cells.end() ? &it->second : nullptr;
+}
+
+Cell* CellGrid::FindForWrite(Position pos) {
+    if (Find(pos) == nullptr) {
+        return nullptr;
+    }
+    return &GetTileForWrite(pos, false)->cells.find(pos)->second;
+}
+
+std::pair<Cell*, bool> CellGrid::InsertOrAssign(Position pos, Cell cell) {
+    Tile& tile = *GetTileForWrite(pos, true);
+    const size_t old_buckets = tile.cells.bucket_count();
+    // Присваивание учтённой ячейке само переносит изменение в счётчики
+    auto [it, inserted] = tile.cells.insert_or_assign(pos, std::move(cell));
+    if (inserted) {
+        AttachCell(it->second);
+        UpdateBuckets(tile, old_buckets);
+    }
+    return { &it->second, inserted };
+}
+
+std::optional<Cell> CellGrid::Extract(Position pos) {
+    if (Find(pos) == nullptr) {
+        return std::nullopt;
+    }
+    Table& cells = GetTileForWrite(pos, false)->cells;
+    auto it = cells.find(pos);
+    DetachCell(it->second);
+    auto node = cells.extract(it);
+    return std::move(node.mapped());
+}
+
+void CellGrid::Clear() {
+    root_.reset();
+    // Ячейки, оставшиеся в копиях, продолжают учитываться в прежних счётчиках
+    if (totals_) {
+        totals_ = std::make_unique<MemoryTotals>();
+    }
+}
+
+bool CellGrid::IsWritable(Position pos) const {
+    if (!root_ || root_.use_count() > 1) {
+        return false;
+    }
+    const auto& band = root_->bands[pos.row / TILE_SIZE];
+    if (!band || band.use_count() > 1) {
+        return false;
+    }
+    const auto& tile = band->tiles[pos.col / TILE_SIZE];
+    return tile && tile.use_count() == 1;
+}
+
+void CellGrid::PrepareForWrite(Position pos) {
+    GetTileForWrite(pos, true);
+}
+
+const CellGrid::Tile* CellGrid::FindTile(Position pos) const {
+    if (!root_) {
+        return nullptr;
+    }
+    const auto& band = root_->bands[pos.row / TILE_SIZE];
+    return band ? band->tiles[pos.col / TILE_SIZE].get() : nullptr;
+}
+
+CellGrid::Tile* CellGrid::GetTileForWrite(Position pos, bool create) {
+    if (!create && FindTile(pos) == nullptr) {
+        return nullptr;
+    }
+    if (totals_ && !root_) {
+        totals_->index_bytes += GetSharedSize<Root>();
+    }
+    auto& band_ptr = Unshare(root_).bands[pos.row / TILE_SIZE];
+    if (totals_ && !band_ptr) {
+        totals_->index_bytes += GetSharedSize<Band>();
+    }
+    auto& tile_ptr = Unshare(band_ptr).tiles[pos.col / TILE_SIZE];
+    if (!tile_ptr) {
+        tile_ptr = std::make_shared<Tile>();
+        if (totals_) {
+            ++totals_->tiles;
+            totals_->index_bytes += GetSharedSize<Tile>();
+            UpdateBuckets(*tile_ptr, 0);
+        }
+    } else if (tile_ptr.use_count() > 1) {
+        // Ячейки копии учитываются вместо ячеек плитки, оставшейся в других копиях
+        const std::shared_ptr<Tile> original = tile_ptr;
+        tile_ptr = std::make_shared<Tile>(*original);
+        if (totals_) {
+            for (auto& [cell_pos, cell] : tile_ptr->cells) {
+                cell.TakeOverMemoryTotals(original->cells.find(cell_pos)->second);
+            }
+            UpdateBuckets(*tile_ptr, original->cells.bucket_count());
+        }
+    }
+    return tile_ptr.get();
+}
+
+void CellGrid::AttachCell(Cell& cell) {
+    if (totals_) {
+        cell.AttachMemoryTotals(totals_->cells.get());
+        totals_->index_bytes += NODE_SIZE;
+    }
+}
+
+void CellGrid::DetachCell(Cell& cell) {
+    if (totals_) {
+        cell.DetachMemoryTotals();
+        totals_->index_bytes -= NODE_SIZE;
+    }
+}
+
+void CellGrid::UpdateBuckets(const Tile& tile, size_t old_buckets) {
+    const size_t buckets = tile.cells.bucket_count();
+    if (!totals_ || buckets == old_buckets) {
+        return;
+    }
+    // Беззнаковое переполнение при уменьшении числа корзин даёт верную разность
+    totals_->buckets += buckets - old_buckets;
+    totals_->index_bytes += (buckets - old_buckets) * sizeof(void*);
+}
+
+CellGridMemoryStats CellGrid::GetMemoryStats() const {
+    if (!totals_) {
+        return ComputeMemoryStats();
+    }
+    CellGridMemoryStats stats;
+    stats.tiles = totals_->tiles.load(std::memory_order_relaxed);
+    stats.buckets = totals_->buckets.load(std::memory_order_relaxed);
+    stats.index_bytes = totals_->index_bytes.load(std::memory_order_relaxed);
+    stats.cells = totals_->cells->Load();
+    return stats;
+}
+
+CellGridMemoryStats CellGrid::ComputeMemoryStats() const {
+    CellGridMemoryStats stats;
+    if (!root_) {
+        return stats;
+    }
+    stats.index_bytes += GetSharedSize<Root>();
+    for (const auto& band : root_->bands) {
+        if (!band) {
+            continue;
+        }
+        stats.index_bytes += GetSharedSize<Band>();
+        for (const auto& tile : band->tiles) {
+            if (!tile) {
+                continue;
+            }
+            ++stats.tiles;
+            stats.buckets += tile->cells.bucket_count();
+            stats.index_bytes += GetSharedSize<Tile>() + tile->cells.bucket_count() * sizeof(void*)
+                + tile->cells.size() * NODE_SIZE;
+            for (const auto& [pos, cell] : tile->cells) {
+                cell.AddMemoryUsage(stats.cells);
+            }
+        }
+    }
+    return stats;
+}
+
+CellGridMemoryStats& CellGridMemoryStats::operator+=(const CellGridMemoryStats& other) {
+    tiles += other.tiles;
+    buckets += other.buckets;
+    index_bytes += other.index_bytes;
+    cells += other.cells;
+    return *this;
+}
+
+size_t CellGridMemoryStats::GetTotalBytes() const {
+    return index_bytes + cells.GetTotalBytes();
+}
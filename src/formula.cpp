@@ -38,6 +38,14 @@ namespace {
 			return out.str();
 		}
 
+		size_t GetAstNodeCount() const override {
+			return ast_.GetNodeCount();
+		}
+
+		size_t GetAstMemoryUsage() const override {
+			return ast_.GetMemoryUsage();
+		}
+
 	private:
 		//  AST 
 		FormulaAST ast_;
@@ -0,0 +1,186 @@
+#include "formula_stats.h"
+
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if SPREADSHEET_FORMULA_STATS
+#include <algorithm>
+#include <chrono>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define SPREADSHEET_FORMULA_STATS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SPREADSHEET_FORMULA_STATS_RDTSC
+#endif
+#endif
+
+namespace {
+
+    constexpr size_t PHASE_COUNT = static_cast<size_t>(FormulaPhase::Count);
+
+#if SPREADSHEET_FORMULA_STATS
+
+    // Счётчики одного потока. Пишет в них только владелец, поэтому хватает
+    // обычных загрузки и записи без атомарного сложения; атомарность нужна
+    // только для чтения из GetFormulaStats()
+    struct ThreadCounters {
+        std::array<std::atomic<uint64_t>, PHASE_COUNT> calls{};
+        std::array<std::atomic<uint64_t>, PHASE_COUNT> ticks{};
+
+        void AddTo(FormulaStats& stats) const {
+            for (size_t i = 0; i < PHASE_COUNT; ++i) {
+                stats.phases[i].calls += calls[i].load(std::memory_order_relaxed);
+                stats.phases[i].ticks += ticks[i].load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // Счётчики всех живых потоков и сумма по завершившимся
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ThreadCounters*> threads;
+        FormulaStats retired;
+    };
+
+    Registry& GetRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    class ThreadCountersHolder {
+    public:
+        ThreadCountersHolder()
+            : registry_(GetRegistry()) {
+            std::lock_guard lock(registry_.mutex);
+            registry_.threads.push_back(&counters_);
+        }
+
+        ~ThreadCountersHolder() {
+            std::lock_guard lock(registry_.mutex);
+            counters_.AddTo(registry_.retired);
+            registry_.threads.erase(std::find(registry_.threads.begin(), registry_.threads.end(), &counters_));
+        }
+
+        ThreadCounters& Get() {
+            return counters_;
+        }
+
+    private:
+        Registry& registry_;
+        ThreadCounters counters_;
+    };
+
+    ThreadCounters& GetThreadCounters() {
+        thread_local ThreadCountersHolder holder;
+        return holder.Get();
+    }
+
+    void Increment(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+#endif
+
+    constexpr const char* TICKS_UNIT =
+#if defined(SPREADSHEET_FORMULA_STATS_RDTSC)
+        "cycles";
+#else
+        "ns";
+#endif
+
+}  // namespace
+
+#if SPREADSHEET_FORMULA_STATS
+
+namespace formula_stats_detail {
+
+    uint64_t ReadTicks() {
+#if defined(SPREADSHEET_FORMULA_STATS_RDTSC)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    void AddPhase(FormulaPhase phase, uint64_t ticks) {
+        ThreadCounters& counters = GetThreadCounters();
+        const auto index = static_cast<size_t>(phase);
+        Increment(counters.calls[index], 1);
+        Increment(counters.ticks[index], ticks);
+    }
+
+}  // namespace formula_stats_detail
+
+#endif
+
+const char* GetFormulaPhaseName(FormulaPhase phase) {
+    switch (phase) {
+    case FormulaPhase::Lex: return "lex";
+    case FormulaPhase::Parse: return "parse";
+    case FormulaPhase::BuildAst: return "build_ast";
+    case FormulaPhase::Canonicalize: return "canonicalize";
+    case FormulaPhase::Execute: return "execute";
+    case FormulaPhase::Count: break;
+    }
+    return "unknown";
+}
+
+FormulaStats GetFormulaStats() {
+    FormulaStats stats;
+#if SPREADSHEET_FORMULA_STATS
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    stats = registry.retired;
+    for (const ThreadCounters* counters : registry.threads) {
+        counters->AddTo(stats);
+    }
+#endif
+    return stats;
+}
+
+void ResetFormulaStats() {
+#if SPREADSHEET_FORMULA_STATS
+    // Вызовы, завершающиеся в других потоках во время сброса, могут потеряться
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.retired = {};
+    for (ThreadCounters* counters : registry.threads) {
+        for (size_t i = 0; i < PHASE_COUNT; ++i) {
+            counters->calls[i].store(0, std::memory_order_relaxed);
+            counters->ticks[i].store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
+}
+
+void DumpFormulaStats(std::ostream& output) {
+    if (!IsFormulaStatsEnabled()) {
+        output << "formula stats are disabled (build with SPREADSHEET_FORMULA_STATS=1)\n";
+        return;
+    }
+    const FormulaStats stats = GetFormulaStats();
+    output << std::left << std::setw(14) << "phase" << std::right << std::setw(12) << "calls"
+           << std::setw(18) << TICKS_UNIT << std::setw(14) << "per call" << '\n';
+    for (size_t i = 0; i < PHASE_COUNT; ++i) {
+        const FormulaPhaseStats& phase = stats.phases[i];
+        output << std::left << std::setw(14) << GetFormulaPhaseName(static_cast<FormulaPhase>(i)) << std::right
+               << std::setw(12) << phase.calls << std::setw(18) << phase.ticks << std::setw(14)
+               << (phase.calls == 0 ? 0 : phase.ticks / phase.calls) << '\n';
+    }
+}
+
+void WriteFormulaStatsJson(std::ostream& output) {
+    const FormulaStats stats = GetFormulaStats();
+    output << "{\"enabled\": " << (IsFormulaStatsEnabled() ? "true" : "false") << ", \"unit\": \"" << TICKS_UNIT
+           << "\", \"phases\": {";
+    for (size_t i = 0; i < PHASE_COUNT; ++i) {
+        output << (i == 0 ? "" : ", ") << '"' << GetFormulaPhaseName(static_cast<FormulaPhase>(i))
+               << "\": {\"calls\": " << stats.phases[i].calls << ", \"ticks\": " << stats.phases[i].ticks << '}';
+    }
+    output << "}}\n";
+}
@@ -0,0 +1,80 @@
+#include "index_map.h"
+
+#include <algorithm>
+#include <numeric>
+
+IndexMap::IndexMap(int size)
+    : size_(size) {
+}
+
+void IndexMap::Insert(int before, int count) {
+    count = std::min(count, size_ - before);
+    if (count <= 0) {
+        return;
+    }
+    Materialize();
+    std::rotate(to_physical_.begin() + before, to_physical_.end() - count, to_physical_.end());
+    UpdateInverse(before, size_);
+}
+
+std::vector<int> IndexMap::Erase(int first, int count) {
+    count = std::min(count, size_ - first);
+    if (count <= 0) {
+        return {};
+    }
+    Materialize();
+    std::rotate(to_physical_.begin() + first, to_physical_.begin() + first + count, to_physical_.end());
+    UpdateInverse(first, size_);
+    return std::vector<int>(to_physical_.end() - count, to_physical_.end());
+}
+
+void IndexMap::Move(int first, int count, int before) {
+    count = std::min(count, size_ - first);
+    if (count <= 0 || (before >= first && before <= first + count)) {
+        return;
+    }
+    Materialize();
+    auto begin = to_physical_.begin();
+    if (before < first) {
+        std::rotate(begin + before, begin + first, begin + first + count);
+        UpdateInverse(before, first + count);
+    } else {
+        std::rotate(begin + first, begin + first + count, begin + before);
+        UpdateInverse(first, before);
+    }
+}
+
+void IndexMap::Permute(int first, const std::vector<int>& order) {
+    if (order.empty()) {
+        return;
+    }
+    Materialize();
+    std::vector<int> permuted(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        permuted[i] = to_physical_[first + order[i]];
+    }
+    std::copy(permuted.begin(), permuted.end(), to_physical_.begin() + first);
+    UpdateInverse(first, first + static_cast<int>(order.size()));
+}
+
+void IndexMap::Reset() {
+    to_physical_.clear();
+    to_physical_.shrink_to_fit();
+    to_logical_.clear();
+    to_logical_.shrink_to_fit();
+}
+
+void IndexMap::Materialize() {
+    if (!to_physical_.empty()) {
+        return;
+    }
+    to_physical_.resize(size_);
+    std::iota(to_physical_.begin(), to_physical_.end(), 0);
+    to_logical_ = to_physical_;
+}
+
+void IndexMap::UpdateInverse(int first, int last) {
+    for (int logical = first; logical < last; ++logical) {
+        to_logical_[to_physical_[logical]] = logical;
+    }
+}
@@ -0,0 +1,499 @@
+#include "journal.h"
+
+#include "file_mapping.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    // Заголовок файла журнала
+    constexpr char MAGIC[8] = { 'S', 'P', 'J', 'R', 'N', 'L', '0', '1' };
+
+    uint32_t Fnv1a(std::string_view data) {
+        uint32_t hash = 2166136261u;
+        for (char c : data) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    void PutVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    bool GetVarint(std::string_view data, size_t& offset, uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+            const auto byte = static_cast<unsigned char>(data[offset++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool HasText(Journal::Op op) {
+        return op == Journal::Op::SetCell || op == Journal::Op::SortRange || op == Journal::Op::Batch
+            || op == Journal::Op::PermuteRows;
+    }
+
+    // Кодирует запись без контрольной суммы
+    void PutRecord(std::string& out, Journal::Op op, Position pos, std::string_view text) {
+        out.push_back(static_cast<char>(op));
+        PutVarint(out, static_cast<uint64_t>(pos.row));
+        PutVarint(out, static_cast<uint64_t>(pos.col));
+        if (HasText(op)) {
+            PutVarint(out, text.size());
+            out.append(text);
+        }
+    }
+
+    // Запись до контрольной суммы; текст указывает в разбираемые данные
+    struct RawRecord {
+        Journal::Op op;
+        uint64_t row = 0;
+        uint64_t col = 0;
+        uint64_t before = 0;
+        std::string_view text;
+    };
+
+    // Результат разбора записи
+    enum class ParseStatus {
+        Ok,
+        // Данные кончились раньше конца записи
+        Incomplete,
+        // Данные есть, но записью журнала не являются
+        Invalid,
+    };
+
+    // Читает varint поля записи: нехватка данных отличается от испорченного числа
+    ParseStatus GetField(std::string_view data, size_t& offset, uint64_t& value) {
+        if (GetVarint(data, offset, value)) {
+            return ParseStatus::Ok;
+        }
+        return offset >= data.size() ? ParseStatus::Incomplete : ParseStatus::Invalid;
+    }
+
+    // Находит границы записи без контрольной суммы, начиная с offset. Значения
+    // полей не проверяются (см. ValidateRecord)
+    ParseStatus FrameRecord(std::string_view data, size_t& offset, RawRecord& record) {
+        if (offset >= data.size()) {
+            return ParseStatus::Incomplete;
+        }
+        const auto op = static_cast<Journal::Op>(data[offset++]);
+        record.op = op;
+        if (op < Journal::Op::SetCell || op > Journal::Op::PermuteRows) {
+            return ParseStatus::Invalid;
+        }
+        for (uint64_t* field : { &record.row, &record.col }) {
+            if (const ParseStatus status = GetField(data, offset, *field); status != ParseStatus::Ok) {
+                return status;
+            }
+        }
+        uint64_t length = 0;
+        if (HasText(op)) {
+            if (const ParseStatus status = GetField(data, offset, length); status != ParseStatus::Ok) {
+                return status;
+            }
+            if (length > data.size() - offset) {
+                return ParseStatus::Incomplete;
+            }
+        }
+        if (op == Journal::Op::MoveRows || op == Journal::Op::MoveCols) {
+            if (const ParseStatus status = GetField(data, offset, record.before); status != ParseStatus::Ok) {
+                return status;
+            }
+        }
+        record.text = data.substr(offset, static_cast<size_t>(length));
+        offset += static_cast<size_t>(length);
+        return ParseStatus::Ok;
+    }
+
+    // Проверяет значения полей записи
+    bool ValidateRecord(const RawRecord& record) {
+        // У структурных изменений номер может указывать на конец таблицы, а
+        // у пакета строка - число изменений в нём
+        if (record.op == Journal::Op::Batch) {
+            return record.col == 0;
+        }
+        const uint64_t extra = HasText(record.op) || record.op == Journal::Op::ClearCell ? 0 : 1;
+        return record.row < static_cast<uint64_t>(Position::MAX_ROWS) + extra
+            && record.col < static_cast<uint64_t>(Position::MAX_COLS) + extra
+            && record.before <= static_cast<uint64_t>(Position::MAX_ROWS);
+    }
+
+    Journal::Record ToRecord(const RawRecord& raw) {
+        return { raw.op, { static_cast<int>(raw.row), static_cast<int>(raw.col) }, std::string(raw.text),
+                 static_cast<int>(raw.before) };
+    }
+
+    // Разбирает изменения ячеек внутри пакета; повреждённый пакет отбрасывается целиком
+    bool ParseBatch(const RawRecord& batch, std::vector<Journal::Record>* records) {
+        std::vector<Journal::Record> parsed;
+        size_t offset = 0;
+        for (uint64_t i = 0; i < batch.row; ++i) {
+            RawRecord raw;
+            if (FrameRecord(batch.text, offset, raw) != ParseStatus::Ok || !ValidateRecord(raw)
+                || (raw.op != Journal::Op::SetCell && raw.op != Journal::Op::ClearCell)) {
+                return false;
+            }
+            if (records != nullptr) {
+                parsed.push_back(ToRecord(raw));
+            }
+        }
+        if (offset != batch.text.size()) {
+            return false;
+        }
+        if (records != nullptr) {
+            std::move(parsed.begin(), parsed.end(), std::back_inserter(*records));
+        }
+        return true;
+    }
+
+    // Разбирает запись с контрольной суммой, начиная с offset
+    ParseStatus ParseRecord(std::string_view data, size_t& offset, RawRecord& record,
+                            std::vector<Journal::Record>* records) {
+        const size_t begin = offset;
+        if (const ParseStatus status = FrameRecord(data, offset, record); status != ParseStatus::Ok) {
+            return status;
+        }
+        uint32_t checksum = 0;
+        if (data.size() - offset < sizeof(checksum)) {
+            return ParseStatus::Incomplete;
+        }
+        std::memcpy(&checksum, data.data() + offset, sizeof(checksum));
+        offset += sizeof(checksum);
+        if (checksum != Fnv1a(data.substr(begin, offset - sizeof(checksum) - begin))) {
+            // Последняя запись могла попасть на диск не полностью
+            return offset == data.size() ? ParseStatus::Incomplete : ParseStatus::Invalid;
+        }
+        // Запись с верной контрольной суммой дописана целиком
+        if (!ValidateRecord(record) || (record.op == Journal::Op::Batch && !ParseBatch(record, records))) {
+            return ParseStatus::Invalid;
+        }
+        return ParseStatus::Ok;
+    }
+
+    // Разбирает записи и возвращает смещение конца последней целой записи.
+    // Недописанная последняя запись (а также хвост из нулей, если размер файла
+    // успел увеличиться раньше записи данных) отбрасывается; повреждённая
+    // запись в середине журнала - ошибка, а не хвост: бросается std::runtime_error
+    size_t ParseRecords(const std::string& filename, std::string_view data, std::vector<Journal::Record>* records,
+                        size_t& record_count) {
+        size_t end = sizeof(MAGIC);
+        while (end < data.size()) {
+            size_t offset = end;
+            RawRecord raw;
+            const ParseStatus status = ParseRecord(data, offset, raw, records);
+            if (status != ParseStatus::Ok) {
+                if (status == ParseStatus::Incomplete || data.find_first_not_of('\0', end) == std::string_view::npos) {
+                    break;
+                }
+                throw std::runtime_error("Corrupted sheet journal " + filename + " at offset " + std::to_string(end));
+            }
+
+            if (raw.op == Journal::Op::Batch) {
+                record_count += static_cast<size_t>(raw.row);
+            } else {
+                if (records != nullptr) {
+                    records->push_back(ToRecord(raw));
+                }
+                ++record_count;
+            }
+            end = offset;
+        }
+        return end;
+    }
+
+    // Проверяет заголовок и возвращает длину целой части журнала (0 - файла нет)
+    size_t ReadJournal(const std::string& filename, std::vector<Journal::Record>* records, size_t& record_count) {
+        if (!std::filesystem::exists(filename)) {
+            return 0;
+        }
+        MappedFile file(filename);
+        const std::string_view data = file.GetData();
+        if (data.size() < sizeof(MAGIC)) {
+            // Файл создан, но сбой случился до записи заголовка
+            return 0;
+        }
+        if (std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+            throw std::runtime_error("Not a sheet journal: " + filename);
+        }
+        return ParseRecords(filename, data, records, record_count);
+    }
+
+#ifdef _WIN32
+    int OpenForAppend(const std::string& filename) {
+        return _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+
+    bool TruncateFile(int fd, size_t size) {
+        return _chsize_s(fd, static_cast<long long>(size)) == 0;
+    }
+
+    bool SyncFile(int fd) {
+        return _commit(fd) == 0;
+    }
+
+    long long WriteFile(int fd, const char* data, size_t size) {
+        return _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+    }
+
+    void CloseFile(int fd) {
+        _close(fd);
+    }
+#else
+    int OpenForAppend(const std::string& filename) {
+        return open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+
+    bool TruncateFile(int fd, size_t size) {
+        return ftruncate(fd, static_cast<off_t>(size)) == 0;
+    }
+
+    bool SyncFile(int fd) {
+        return fsync(fd) == 0;
+    }
+
+    long long WriteFile(int fd, const char* data, size_t size) {
+        return write(fd, data, size);
+    }
+
+    void CloseFile(int fd) {
+        close(fd);
+    }
+#endif
+
+    void WriteAll(int fd, std::string_view data) {
+        while (!data.empty()) {
+            const long long written = WriteFile(fd, data.data(), data.size());
+            if (written <= 0) {
+                throw std::runtime_error("Cannot write journal");
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+
+}  // namespace
+
+std::vector<Journal::Record> Journal::ReadRecords(const std::string& filename) {
+    std::vector<Record> records;
+    size_t record_count = 0;
+    ReadJournal(filename, &records, record_count);
+    return records;
+}
+
+Journal::Journal(const std::string& filename, JournalOptions options)
+    : options_(std::move(options)) {
+    const size_t valid_size = ReadJournal(filename, nullptr, record_count_);
+
+    fd_ = OpenForAppend(filename);
+    if (fd_ < 0) {
+        throw std::runtime_error("Cannot open journal: " + filename);
+    }
+    // Отрезаем недописанный хвост, иначе новые записи окажутся за мусором
+    if (!TruncateFile(fd_, valid_size)) {
+        CloseFile(fd_);
+        throw std::runtime_error("Cannot truncate journal: " + filename);
+    }
+    if (valid_size == 0) {
+        WriteAll(fd_, std::string_view(MAGIC, sizeof(MAGIC)));
+        SyncFile(fd_);
+    }
+
+    flusher_ = std::thread([this] {
+        FlushLoop();
+    });
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    flush_requested_.notify_one();
+    flusher_.join();
+    CloseFile(fd_);
+}
+
+void Journal::Append(Op op, Position pos, std::string_view text) {
+    std::string record;
+    PutRecord(record, op, pos, text);
+    Enqueue(std::move(record));
+}
+
+void Journal::AppendBatch(const std::vector<Record>& records) {
+    if (records.empty()) {
+        return;
+    }
+    std::string body;
+    for (const Record& record : records) {
+        PutRecord(body, record.op, record.pos, record.text);
+    }
+    std::string batch;
+    PutRecord(batch, Op::Batch, { static_cast<int>(records.size()), 0 }, body);
+    Enqueue(std::move(batch), records.size());
+}
+
+void Journal::AppendMove(Op op, int first, int count, int before) {
+    std::string record;
+    record.push_back(static_cast<char>(op));
+    PutVarint(record, static_cast<uint64_t>(first));
+    PutVarint(record, static_cast<uint64_t>(count));
+    PutVarint(record, static_cast<uint64_t>(before));
+    Enqueue(std::move(record));
+}
+
+void Journal::Enqueue(std::string record, size_t count) {
+    const uint32_t checksum = Fnv1a(record);
+    record.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+
+    bool notify = false;
+    {
+        std::lock_guard lock(mutex_);
+        if (failed_) {
+            throw std::runtime_error("Journal is not writable after an I/O error");
+        }
+        // Фоновый поток будим на первой записи группы и при заполнении группы
+        notify = pending_.empty() || pending_records_ + 1 >= options_.group_commit_records;
+        pending_ += record;
+        ++pending_records_;
+        record_count_ += count;
+        ++appended_;
+    }
+    if (notify) {
+        flush_requested_.notify_one();
+    }
+}
+
+void Journal::Sync() {
+    std::unique_lock lock(mutex_);
+    const uint64_t target = appended_;
+    ++sync_waiters_;
+    flush_requested_.notify_one();
+    flushed_.wait(lock, [this, target] {
+        return durable_ >= target || failed_;
+    });
+    --sync_waiters_;
+    if (failed_) {
+        throw std::runtime_error("Cannot write journal");
+    }
+}
+
+void Journal::Truncate() {
+    Sync();
+    std::lock_guard io_lock(io_mutex_);
+    if (!TruncateFile(fd_, sizeof(MAGIC)) || !SyncFile(fd_)) {
+        throw std::runtime_error("Cannot truncate journal");
+    }
+    std::lock_guard lock(mutex_);
+    record_count_ = 0;
+}
+
+size_t Journal::GetRecordCount() const {
+    std::lock_guard lock(mutex_);
+    return record_count_;
+}
+
+void Journal::FlushLoop() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        // Ждём первую запись группы, затем даём группе набраться
+        flush_requested_.wait(lock, [this] {
+            return stop_ || !pending_.empty();
+        });
+        flush_requested_.wait_for(lock, options_.group_commit_interval, [this] {
+            return stop_ || sync_waiters_ > 0 || pending_records_ >= options_.group_commit_records;
+        });
+
+        if (!pending_.empty()) {
+            std::string data;
+            data.swap(pending_);
+            const uint64_t target = appended_;
+            pending_records_ = 0;
+
+            lock.unlock();
+            bool ok = true;
+            try {
+                WriteAndSync(data);
+            } catch (const std::exception&) {
+                ok = false;
+            }
+            lock.lock();
+
+            if (ok) {
+                durable_ = target;
+            } else {
+                failed_ = true;
+            }
+            flushed_.notify_all();
+        }
+        if (stop_ && pending_.empty()) {
+            break;
+        }
+    }
+}
+
+void Journal::WriteAndSync(const std::string& data) {
+    std::lock_guard io_lock(io_mutex_);
+    WriteAll(fd_, data);
+    if (!SyncFile(fd_)) {
+        throw std::runtime_error("Cannot sync journal");
+    }
+}
+
+void SyncFileToDisk(const std::string& filename) {
+#ifdef _WIN32
+    int fd = _open(filename.c_str(), _O_RDWR | _O_BINARY);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+#endif
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    const bool ok = SyncFile(fd);
+    CloseFile(fd);
+    if (!ok) {
+        throw std::runtime_error("Cannot sync file: " + filename);
+    }
+}
+
+void SyncParentDirectory(const std::string& filename) {
+#ifndef _WIN32
+    std::string directory = std::filesystem::path(filename).parent_path().string();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open directory: " + directory);
+    }
+    const bool ok = SyncFile(fd);
+    CloseFile(fd);
+    if (!ok) {
+        throw std::runtime_error("Cannot sync directory: " + directory);
+    }
+#else
+    static_cast<void>(filename);
+#endif
+}
@@ -1,5 +1,27 @@
+#include "alloc_stats.h"
+#include "cell_grid.h"
 #include "common.h"
+#include "formula.h"
+#include "formula_stats.h"
+#include "parallel.h"
+#include "sheet.h"
+#include "span_trace.h"
 #include "test_runner_p.h"
+#include "trace.h"
+#include "workload.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
 
 //   <<     Position  
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -118,6 +140,1496 @@ namespace {
 		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 1 })); //      
 	}
 
+	//      
+	void TestTrySetCell() {
+		auto sheet = CreateSheet(); //    
+
+		ASSERT(sheet->TrySetCell("A1"_pos, "=1+2").IsOk()); //  
+		ASSERT(sheet->TrySetCell(Position{ -1, 0 }, "text").status == CellStatus::InvalidPosition); //  
+
+		auto result = sheet->TrySetCell("A1"_pos, "=1+*2"); //    '*'
+		ASSERT(result.status == CellStatus::FormulaSyntaxError);
+		ASSERT_EQUAL(result.error_offset, 3u);
+		ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1+2"); //   
+
+		//  TrySetCell    ,   SetCell 
+		const std::vector<std::string> formulas = {
+			"=1", "=-(1+2)*3", "=+-+1", "=1--1", "=.5e-3", "= ( 1 ) ", "=1e+10/2E2",
+			"=1+", "=(1", "=1)", "=1 2", "=1.", "=1.2.3", "=1e", "=1e+", "=x", "=1e999", "= ", "=()",
+		};
+		for (const auto& text : formulas) {
+			bool thrown = false;
+			try {
+				sheet->SetCell("B1"_pos, text);
+			}
+			catch (const FormulaException&) {
+				thrown = true;
+			}
+			ASSERT_EQUAL(sheet->TrySetCell("B1"_pos, text).IsOk(), !thrown);
+		}
+	}
+
+	//         PrintTexts
+	void TestImportTexts() {
+		Sheet source; //  
+		source.SetCell("A1"_pos, "=1/0");
+		source.SetCell("C1"_pos, "'=escaped");
+		source.SetCell("B3"_pos, "meow");
+		for (int row = 3; row < 3000; ++row) { //  ,      
+			source.SetCell(Position{ row, 1 }, "=" + std::to_string(row) + "*2");
+		}
+		std::ostringstream texts;
+		source.PrintTexts(texts);
+
+		Sheet imported; // ,   
+		auto result = imported.ImportTexts(texts.str());
+		ASSERT_EQUAL(result.imported, 3000u);
+		ASSERT(result.errors.empty());
+		std::ostringstream imported_texts;
+		imported.PrintTexts(imported_texts);
+		ASSERT_EQUAL(imported_texts.str(), texts.str()); //    
+		ASSERT_EQUAL(std::get<double>(imported.GetCell("B10"_pos)->GetValue()), 18.0);
+
+		//   ,   ;   
+		const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_import_test.tsv").string();
+		{
+			std::ofstream file(path, std::ios::binary);
+			file << "1\t=1+\t\r\n\t=2*3";
+		}
+		Sheet from_file;
+		result = from_file.ImportTextsFromFile(path);
+		std::remove(path.c_str());
+		ASSERT_EQUAL(result.imported, 2u);
+		ASSERT_EQUAL(result.errors.size(), 1u);
+		ASSERT(result.errors[0].first == "B1"_pos);
+		ASSERT_EQUAL(result.errors[0].second.error_offset, 3u);
+		ASSERT_EQUAL(from_file.GetCell("A1"_pos)->GetText(), "1");
+		ASSERT_EQUAL(from_file.GetCell("B2"_pos)->GetText(), "=2*3");
+		ASSERT_EQUAL(from_file.GetPrintableSize(), (Size{ 2, 2 }));
+	}
+
+	//        
+	void TestSnapshot() {
+		Sheet source; //  
+		source.SetCell("A1"_pos, "=1/0");
+		source.SetCell("B1"_pos, "=(1+2)*3");
+		source.SetCell("C2"_pos, "'=escaped");
+		source.SetCell("A3"_pos, "meow");
+		source.SetCell("B3"_pos, "meow");
+		source.SetCell("D4"_pos, "cleared");
+		source.ClearCell("D4"_pos);
+
+		const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin").string();
+		source.SaveSnapshot(path);
+
+		Sheet loaded; // ,   
+		loaded.SetCell("Z9"_pos, "replaced on load");
+		loaded.LoadSnapshot(path);
+		ASSERT(loaded.GetCell("Z9"_pos) == nullptr); //   
+		ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetText(), "=(1+2)*3");
+		ASSERT_EQUAL(std::get<double>(loaded.GetCell("B1"_pos)->GetValue()), 9.0);
+		ASSERT(std::holds_alternative<FormulaError>(loaded.GetCell("A1"_pos)->GetValue()));
+		ASSERT_EQUAL(std::get<std::string>(loaded.GetCell("C2"_pos)->GetValue()), "=escaped");
+		ASSERT(loaded.GetCell("D4"_pos) == nullptr);
+
+		ASSERT_EQUAL(loaded.GetPrintableSize(), (Size{ 3, 3 })); //     
+		ASSERT(loaded.GetMemoryStats().mapped_snapshot_bytes > 0);
+
+		loaded.ClearCell("A3"_pos); //    
+		loaded.SetCell("B3"_pos, "purr");
+		loaded.ClearCell("C2"_pos);
+		source.ClearCell("A3"_pos);
+		source.SetCell("B3"_pos, "purr");
+		source.ClearCell("C2"_pos);
+		ASSERT_EQUAL(loaded.GetPrintableSize(), (Size{ 3, 2 }));
+		ASSERT(loaded.GetMemoryStats().mapped_snapshot_bytes > 0);
+		std::ostringstream expected, actual;
+		source.PrintValues(expected);
+		loaded.PrintValues(actual);
+		ASSERT_EQUAL(actual.str(), expected.str());
+
+		//      
+		source.SaveSnapshot(path);
+		std::string data;
+		{
+			std::ifstream file(path, std::ios::binary);
+			data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		//     ,    
+		//  ,   ,   
+		auto replace_file = [&](const std::string& contents) {
+			const std::string temp_path = path + ".tmp";
+			{
+				std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+				file << contents;
+			}
+			std::filesystem::rename(temp_path, path);
+		};
+		auto load_patched = [&](size_t record, int32_t row) {
+			std::string patched = data;
+			const size_t offset = sizeof(snapshot_format::Header) + record * sizeof(snapshot_format::CellRecord)
+				+ offsetof(snapshot_format::CellRecord, row);
+			std::memcpy(patched.data() + offset, &row, sizeof(row));
+			replace_file(patched);
+			try {
+				loaded.LoadSnapshot(path);
+			}
+			catch (const SnapshotException&) {
+				return true;
+			}
+			return false;
+		};
+		ASSERT(!load_patched(0, 0));
+		ASSERT(load_patched(0, -1));
+		ASSERT(load_patched(0, Position::MAX_ROWS));
+		ASSERT(load_patched(0, 2)); //  A1  A3    B1
+
+		replace_file("garbage");
+		bool thrown = false;
+		try {
+			loaded.LoadSnapshot(path);
+		}
+		catch (const SnapshotException&) {
+			thrown = true;
+		}
+		std::remove(path.c_str());
+		ASSERT(thrown);
+		ASSERT_EQUAL(loaded.GetCell("B3"_pos)->GetText(), "purr"); //     
+	}
+
+	//     
+	void TestLazyFormulas() {
+		Sheet sheet; //   
+		sheet.SetFormulaParsing(FormulaParsing::Lazy);
+
+		sheet.SetCell("A1"_pos, "=((1))+(2*3)");
+		sheet.SetCell("A2"_pos, "=4/(2-2)");
+		ASSERT(sheet.GetCell("A1"_pos) != nullptr); //      
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 1 }));
+
+		bool thrown = false;
+		try {
+			sheet.SetCell("A3"_pos, "=1+"); //    
+		}
+		catch (const FormulaException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+		ASSERT(!sheet.TrySetCell("A3"_pos, "=(1").IsOk());
+
+		//         
+		const Cell lazy("=((1))+(2*3)", FormulaParsing::Lazy);
+		ASSERT_EQUAL(lazy.GetTextSize(), 12u);
+		const CellDelta delta({ { "A1"_pos, lazy } });
+		ASSERT(delta.GetMemoryUsage() >= 12u);
+		CellMemoryStats lazy_stats;
+		lazy.AddMemoryUsage(lazy_stats);
+		ASSERT_EQUAL(lazy_stats.unparsed_formulas, 1u);
+		ASSERT_EQUAL(lazy.GetText(), "=1+2*3");
+		ASSERT_EQUAL(lazy.GetTextSize(), 6u);
+		ASSERT_EQUAL(Cell("=1/0").GetTextSize(), 4u);
+		ASSERT_EQUAL(Cell("'=text").GetTextSize(), 6u);
+		ASSERT_EQUAL(Cell().GetTextSize(), 0u);
+
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 7.0); //    
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=1+2*3");
+		sheet.Prepare(); //   
+		ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=4/(2-2)");
+		ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("A2"_pos)->GetValue()));
+
+		std::ostringstream texts;
+		sheet.PrintTexts(texts);
+		ASSERT_EQUAL(texts.str(), "=1+2*3\n=4/(2-2)\n");
+	}
+
+	//       
+	void TestPrintBlocks() {
+		auto sheet = CreateSheet(); //    
+		for (int row = 0; row < 1000; row += 3) { //     
+			sheet->SetCell(Position{ row, row % 7 }, "=" + std::to_string(row) + "/7");
+			sheet->SetCell(Position{ row + 1, 0 }, "'=text " + std::to_string(row));
+		}
+		sheet->SetCell("E2"_pos, "=1/0");
+		sheet->SetCell("J1000"_pos, "last");
+		sheet->ClearCell("J1000"_pos);
+
+		// :      GetCell     
+		auto print_naive = [&](std::ostream& output, bool values) {
+			Size size = sheet->GetPrintableSize();
+			for (int row = 0; row < size.rows; ++row) {
+				for (int col = 0; col < size.cols; ++col) {
+					if (col > 0) {
+						output << "\t";
+					}
+					if (const CellInterface* cell = sheet->GetCell(Position{ row, col })) {
+						if (values) {
+							output << cell->GetValue();
+						}
+						else {
+							output << cell->GetText();
+						}
+					}
+				}
+				output << "\n";
+			}
+		};
+
+		std::ostringstream expected_values, actual_values, expected_texts, actual_texts;
+		expected_values.precision(3);
+		actual_values.precision(3);
+		print_naive(expected_values, true);
+		sheet->PrintValues(actual_values);
+		ASSERT_EQUAL(actual_values.str(), expected_values.str());
+		print_naive(expected_texts, false);
+		sheet->PrintTexts(actual_texts);
+		ASSERT_EQUAL(actual_texts.str(), expected_texts.str());
+	}
+
+	//        
+	void TestInsertDelete() {
+		auto sheet = CreateSheet(); //    
+		sheet->SetCell("A1"_pos, "a1");
+		sheet->SetCell("B2"_pos, "=1+1");
+		sheet->SetCell("C3"_pos, "c3");
+
+		sheet->InsertRows(1, 2); //      
+		ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "a1");
+		ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+		ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetText(), "=1+1");
+		ASSERT_EQUAL(sheet->GetCell("C5"_pos)->GetText(), "c3");
+
+		sheet->InsertCols(0); //    
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "a1");
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("C4"_pos)->GetValue()), 2.0);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 4 }));
+
+		sheet->DeleteRows(0, 3); //    "a1"
+		ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "=1+1");
+		ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetText(), "c3");
+		sheet->DeleteCols(2);
+		ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "c3");
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 3 }));
+		sheet->SetCell("A1"_pos, "new");
+
+		std::ostringstream texts;
+		sheet->PrintTexts(texts);
+		ASSERT_EQUAL(texts.str(), "new\t\t\n\t\tc3\n");
+
+		// ,      , 
+		const Position last_row{ Position::MAX_ROWS - 1, 0 };
+		sheet->SetCell(last_row, "bottom");
+		bool thrown = false;
+		try {
+			sheet->InsertRows(0);
+		}
+		catch (const TableTooBigException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+		ASSERT_EQUAL(sheet->GetCell(last_row)->GetText(), "bottom"); //   
+		sheet->ClearCell(last_row);
+		sheet->InsertRows(0); //     
+		ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetText(), "c3");
+		ASSERT(sheet->GetCell(Position{ 0, 0 }) == nullptr);
+		ASSERT(sheet->GetCell(last_row) == nullptr);
+
+		thrown = false;
+		try {
+			sheet->DeleteCols(-1);
+		}
+		catch (const InvalidPositionException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+
+		//         
+		Sheet big; //     
+		for (int row = 0; row < 10000; ++row) {
+			big.SetCell(Position{ row, 0 }, std::to_string(row));
+		}
+		for (int i = 0; i < 1000; ++i) {
+			big.InsertRows(0);
+		}
+		big.DeleteRows(0, 1000);
+		ASSERT_EQUAL(big.GetCell(Position{ 9999, 0 })->GetText(), "9999");
+		ASSERT_EQUAL(big.GetPrintableSize(), (Size{ 10000, 1 }));
+	}
+
+	//      
+	void TestMoveRowsCols() {
+		Sheet sheet; //   
+		for (int row = 0; row < 5; ++row) {
+			sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+		}
+		sheet.SetCell("B5"_pos, "=4*2");
+
+		sheet.MoveRows(3, 2, 1); //  4  5   
+		std::ostringstream texts;
+		sheet.PrintTexts(texts);
+		ASSERT_EQUAL(texts.str(), "0\t\n3\t\n4\t=4*2\n1\t\n2\t\n");
+
+		sheet.MoveRows(1, 2, 5); //    
+		ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "3");
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("B5"_pos)->GetValue()), 8.0);
+
+		sheet.MoveCols(1, 1, 0); //  B  
+		ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=4*2");
+		ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "4");
+		sheet.MoveRows(0, 3, 2); //      
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "0");
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 2 }));
+
+		bool thrown = false;
+		try {
+			sheet.MoveRows(Position::MAX_ROWS - 1, 2, 0);
+		}
+		catch (const InvalidPositionException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+
+	//        
+	void TestSortRange() {
+		Sheet sheet; //   
+		const std::vector<std::pair<std::string, std::string>> rows = {
+			{ "b", "1" }, { "=1/0", "2" }, { "=10", "3" }, { "", "4" }, { "a", "5" }, { "=2", "6" }, { "b", "7" }, { "=1+1", "8" },
+		};
+		for (int row = 0; row < static_cast<int>(rows.size()); ++row) {
+			if (!rows[row].first.empty()) {
+				sheet.SetCell(Position{ row, 0 }, rows[row].first);
+			}
+			sheet.SetCell(Position{ row, 1 }, rows[row].second);
+		}
+		auto column = [&sheet](int col) {
+			std::string result;
+			for (int row = 0; row < sheet.GetPrintableSize().rows; ++row) {
+				const CellInterface* cell = sheet.GetCell(Position{ row, col });
+				result += (cell ? cell->GetText() : "_") + " ";
+			}
+			return result;
+		};
+
+		// ,  ,  ,    ;   
+		sheet.SortRange({ "A1"_pos, { 8, 2 } }, { { 0, true } });
+		ASSERT_EQUAL(column(1), "6 8 3 5 1 7 2 4 ");
+		sheet.SortRange({ "A1"_pos, { 8, 2 } }, { { 0, false }, { 1, false } });
+		ASSERT_EQUAL(column(1), "2 7 1 5 3 8 6 4 ");
+
+		//      ,     
+		sheet.SetCell("C1"_pos, "stays");
+		sheet.SortRange({ "A1"_pos, { 4, 2 } }, { { 1, true } });
+		ASSERT_EQUAL(column(1), "1 2 5 7 3 8 6 4 ");
+		ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "stays");
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "b");
+
+		bool thrown = false;
+		try {
+			sheet.SortRange({ "A1"_pos, { 4, 2 } }, { { 2, true } });
+		}
+		catch (const InvalidPositionException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+
+		//        std::stable_sort
+		Sheet big; //     
+		std::vector<std::pair<int, int>> expected;
+		for (int row = 0; row < 12000; ++row) {
+			const int key = (row * 7919) % 101;
+			big.SetCell(Position{ row, 0 }, "=" + std::to_string(key));
+			big.SetCell(Position{ row, 1 }, std::to_string(row));
+			expected.emplace_back(key, row);
+		}
+		std::stable_sort(expected.begin(), expected.end(), [](const auto& lhs, const auto& rhs) {
+			return lhs.first > rhs.first;
+		});
+		big.SortRange({ "A1"_pos, { 12000, 2 } }, { { 0, false } });
+		for (int row = 0; row < 12000; ++row) {
+			ASSERT_EQUAL(big.GetCell(Position{ row, 1 })->GetText(), std::to_string(expected[row].second));
+		}
+	}
+
+	//        
+	void TestSheetSnapshot() {
+		Sheet sheet; //   
+		for (int row = 0; row < 300; ++row) {
+			sheet.SetCell(Position{ row, row % 5 }, "=" + std::to_string(row) + "+1");
+		}
+		const SheetSnapshot snapshot = sheet.Snapshot();
+		std::ostringstream expected;
+		sheet.PrintValues(expected);
+
+		//          ,   
+		int mismatches = 0;
+		std::thread reader([&snapshot, &expected, &mismatches] {
+			for (int i = 0; i < 20; ++i) {
+				std::ostringstream actual;
+				snapshot.PrintValues(actual);
+				mismatches += actual.str() != expected.str();
+			}
+		});
+		for (int row = 0; row < 300; ++row) {
+			sheet.SetCell(Position{ row, row % 5 }, "changed");
+		}
+		sheet.InsertRows(0, 10);
+		sheet.ClearCell("A11"_pos);
+		sheet.GetCell("B12"_pos)->Set("edited in place");
+		sheet.SortRange({ "A1"_pos, { 310, 5 } }, { { 0, false } });
+		reader.join();
+		ASSERT_EQUAL(mismatches, 0);
+
+		ASSERT_EQUAL(std::get<double>(snapshot.GetCell("A1"_pos)->GetValue()), 1.0);
+		ASSERT_EQUAL(snapshot.GetCell("B2"_pos)->GetText(), "=1+1");
+		ASSERT_EQUAL(snapshot.GetPrintableSize(), (Size{ 300, 5 }));
+		ASSERT(sheet.GetCell("A1"_pos) != nullptr && sheet.GetCell("A1"_pos)->GetText() == "changed");
+
+		const SheetSnapshot second = sheet.Snapshot(); //     
+		sheet.SetCell("A1"_pos, "latest");
+		ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "changed");
+		ASSERT_EQUAL(sheet.Snapshot().GetCell("A1"_pos)->GetText(), "latest");
+	}
+
+	//         
+	void TestConcurrentWrites() {
+		Sheet sheet; //   
+		sheet.SetConcurrentMode(true);
+		constexpr int WRITERS = 16;
+		constexpr int ROWS = 200;
+		constexpr int COLS_PER_WRITER = 4;
+		//      
+		constexpr int WRITER_STRIDE = CellGrid::TILE_SIZE;
+
+		//    ,     
+		//    
+		std::vector<std::thread> writers;
+		for (int writer = 0; writer < WRITERS; ++writer) {
+			writers.emplace_back([&sheet, writer] {
+				for (int row = 0; row < ROWS; ++row) {
+					for (int col = 0; col < COLS_PER_WRITER; ++col) {
+						sheet.SetCell(Position{ row, writer * WRITER_STRIDE + col }, "=" + std::to_string(row) + "+" + std::to_string(col));
+					}
+				}
+			});
+		}
+		int broken = 0;
+		std::thread reader([&sheet, &broken] {
+			for (int i = 0; i < 20; ++i) {
+				const SheetSnapshot snapshot = sheet.Snapshot();
+				const CellInterface* cell = snapshot.GetCell(Position{ 0, 0 });
+				broken += cell != nullptr && cell->GetText() != "=0+0";
+				sheet.GetCell(Position{ ROWS - 1, 1 });
+			}
+		});
+		std::atomic<int> broken_reads = 0;
+		std::vector<std::thread> range_readers;
+		for (int reader_index = 0; reader_index < 2; ++reader_index) {
+			range_readers.emplace_back([&sheet, &broken_reads, reader_index] {
+				//        NaN
+				std::vector<double> numbers(ROWS);
+				for (int i = 0; i < 20; ++i) {
+					const int col = reader_index * WRITER_STRIDE;
+					sheet.ReadRange({ Position{ 0, col }, { ROWS, 1 } }, { numbers.data() });
+					for (int row = 0; row < ROWS; ++row) {
+						broken_reads += !std::isnan(numbers[row]) && numbers[row] != static_cast<double>(row);
+					}
+				}
+			});
+		}
+		for (auto& writer : writers) {
+			writer.join();
+		}
+		reader.join();
+		for (auto& range_reader : range_readers) {
+			range_reader.join();
+		}
+		ASSERT_EQUAL(broken, 0);
+		ASSERT_EQUAL(broken_reads.load(), 0);
+
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ ROWS, (WRITERS - 1) * WRITER_STRIDE + COLS_PER_WRITER }));
+		for (int row = 0; row < ROWS; ++row) {
+			for (int writer = 0; writer < WRITERS; ++writer) {
+				for (int col = 0; col < COLS_PER_WRITER; ++col) {
+					const CellInterface* cell = sheet.GetCell(Position{ row, writer * WRITER_STRIDE + col });
+					ASSERT(cell != nullptr);
+					ASSERT_EQUAL(std::get<double>(cell->GetValue()), static_cast<double>(row + col));
+				}
+			}
+		}
+		sheet.InsertRows(0); //    
+		ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=0+0");
+	}
+
+	//     
+	void TestBatch() {
+		Sheet sheet; //     
+		sheet.SetCell("A1"_pos, "old");
+		sheet.SetCell("C3"_pos, "c");
+
+		sheet.BeginBatch();
+		ASSERT(sheet.IsInBatch());
+		sheet.SetCell("A1"_pos, "=1+2");
+		sheet.SetCell("A1"_pos, "=2+3"); //    
+		ASSERT(sheet.TrySetCell("B2"_pos, "text").IsOk());
+		sheet.ClearCell("C3"_pos);
+		ASSERT(sheet.TrySetCell("D4"_pos, "=1+").status == CellStatus::FormulaSyntaxError); //   
+		bool thrown = false;
+		try {
+			sheet.InsertRows(0);
+		}
+		catch (const BatchException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+
+		//  Commit()   
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "old");
+		ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.Snapshot().GetCell("C3"_pos)->GetText(), "c");
+
+		sheet.Commit();
+		ASSERT(!sheet.IsInBatch());
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 5.0);
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "text");
+		ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 2 }));
+
+		thrown = false;
+		try {
+			sheet.Commit();
+		}
+		catch (const BatchException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+
+		sheet.BeginBatch(); //     
+		sheet.SetCell("A1"_pos, "rolled back");
+		sheet.Rollback();
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 5.0);
+
+		const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_batch_test";
+		std::filesystem::remove_all(dir);
+		std::filesystem::create_directories(dir);
+		const auto journal_path = (dir / "sheet.journal").string();
+		{
+			Sheet journaled; //       
+			journaled.OpenJournal(journal_path);
+			journaled.BeginBatch();
+			for (int row = 0; row < 100; ++row) {
+				for (int col = 0; col < 100; ++col) {
+					journaled.SetCell(Position{ row, col }, "=" + std::to_string(row) + "*" + std::to_string(col));
+				}
+			}
+			journaled.ClearCell("A1"_pos);
+			journaled.Commit();
+			journaled.SyncJournal();
+		}
+		ASSERT_EQUAL(Journal::ReadRecords(journal_path).size(), 10000u);
+		Sheet restored;
+		restored.OpenJournal(journal_path);
+		ASSERT(restored.GetCell("A1"_pos) == nullptr);
+		ASSERT_EQUAL(std::get<double>(restored.GetCell(Position{ 99, 99 })->GetValue()), 9801.0);
+		ASSERT_EQUAL(restored.GetPrintableSize(), (Size{ 100, 100 }));
+		std::filesystem::remove_all(dir);
+	}
+
+	std::string PrintSheetTexts(const Sheet& sheet) {
+		std::ostringstream output;
+		sheet.PrintTexts(output);
+		return output.str();
+	}
+
+	//      
+	void TestUndoRedo() {
+		Sheet sheet; //    
+		UndoOptions options;
+		options.coalesce_interval = std::chrono::milliseconds{ 0 };
+		sheet.EnableUndo(options);
+		ASSERT(!sheet.Undo());
+
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("B1"_pos, "=1+1");
+		sheet.ClearCell("A1"_pos);
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+		ASSERT(sheet.Redo());
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 2.0);
+		ASSERT(sheet.Redo());
+		ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+		ASSERT(!sheet.CanRedo());
+
+		//     
+		sheet.Undo();
+		sheet.SetCell("C1"_pos, "c");
+		ASSERT(!sheet.CanRedo());
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+
+		//         
+		for (int row = 1; row < 6; ++row) {
+			sheet.SetCell(Position{ row, 0 }, std::to_string(10 - row));
+			sheet.SetCell(Position{ row, 1 }, "r" + std::to_string(row));
+		}
+		const std::string before = PrintSheetTexts(sheet);
+		sheet.InsertRows(0, 2);
+		sheet.DeleteRows(3, 2);
+		sheet.MoveCols(0, 1, 3);
+		sheet.SortRange({ "A1"_pos, { 10, 3 } }, { { 2, true } });
+		sheet.InsertCols(1);
+		ASSERT(PrintSheetTexts(sheet) != before);
+		for (int i = 0; i < 5; ++i) {
+			ASSERT(sheet.Undo());
+		}
+		ASSERT_EQUAL(PrintSheetTexts(sheet), before);
+		for (int i = 0; i < 5; ++i) {
+			ASSERT(sheet.Redo());
+		}
+		const std::string after = PrintSheetTexts(sheet);
+		sheet.Undo();
+		sheet.Redo();
+		ASSERT_EQUAL(PrintSheetTexts(sheet), after);
+
+		//      
+		sheet.BeginBatch();
+		sheet.SetCell("E1"_pos, "e1");
+		sheet.SetCell("E2"_pos, "e2");
+		sheet.Commit();
+		sheet.ImportTexts("\t\t\t\t\tf1\n");
+		sheet.Undo();
+		sheet.Undo();
+		ASSERT_EQUAL(PrintSheetTexts(sheet), after);
+
+		//     
+		sheet.EnableUndo({});
+		sheet.SetCell("Z1"_pos, "first");
+		sheet.SetCell("Z1"_pos, "second");
+		sheet.SetCell("Z1"_pos, "third");
+		sheet.Undo();
+		ASSERT(sheet.GetCell("Z1"_pos) == nullptr);
+
+		//   ,     
+		options.memory_budget = 4096;
+		sheet.EnableUndo(options);
+		for (int row = 0; row < 1000; ++row) {
+			sheet.SetCell(Position{ row, 20 }, std::string(100, 'x'));
+		}
+		int undone = 0;
+		while (sheet.Undo()) {
+			++undone;
+		}
+		ASSERT(undone > 0 && undone < 100);
+
+		//    
+		const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_undo_test";
+		std::filesystem::remove_all(dir);
+		std::filesystem::create_directories(dir);
+		const auto journal_path = (dir / "sheet.journal").string();
+		std::string expected;
+		{
+			Sheet journaled; //       
+			journaled.OpenJournal(journal_path);
+			journaled.EnableUndo(options);
+			for (int row = 0; row < 5; ++row) {
+				journaled.SetCell(Position{ row, 0 }, std::to_string(row % 3));
+			}
+			journaled.SortRange({ "A1"_pos, { 5, 1 } }, { { 0, false } });
+			journaled.DeleteRows(1);
+			journaled.Undo();
+			journaled.Undo();
+			journaled.ClearCell("A1"_pos);
+			journaled.Undo();
+			expected = PrintSheetTexts(journaled);
+			journaled.SyncJournal();
+		}
+		Sheet restored;
+		restored.OpenJournal(journal_path);
+		ASSERT_EQUAL(PrintSheetTexts(restored), expected);
+		ASSERT_EQUAL(expected, "0\n1\n2\n0\n1\n");
+		ASSERT(!restored.CanUndo());
+		std::filesystem::remove_all(dir);
+	}
+
+	//      
+	void TestSubscriptions() {
+		Sheet sheet; //   
+		std::vector<ChangeSet> top_changes;
+		std::vector<double> top_values;
+		const SubscriptionId top = sheet.Subscribe({ "A1"_pos, { 3, 3 } }, [&](const ChangeSet& changes, const SheetSnapshot& snapshot) {
+			top_changes.push_back(changes);
+			const CellInterface* cell = snapshot.GetCell("B2"_pos);
+			top_values.push_back(cell != nullptr ? std::get<double>(cell->GetValue()) : 0.0);
+		});
+		std::vector<ChangeSet> column_changes;
+		sheet.Subscribe({ "E1"_pos, { 10, 1 } }, [&](const ChangeSet& changes, const SheetSnapshot&) {
+			column_changes.push_back(changes);
+		});
+
+		sheet.SetCell("B2"_pos, "=1+1");
+		ASSERT_EQUAL(top_changes.size(), 1u);
+		ASSERT_EQUAL(top_changes[0].ranges.size(), 1u);
+		ASSERT(top_changes[0].ranges[0].top_left == "B2"_pos);
+		ASSERT_EQUAL(top_changes[0].ranges[0].size, (Size{ 1, 1 }));
+		ASSERT_EQUAL(top_values[0], 2.0);
+		sheet.SetCell("Z100"_pos, "far away"); //     
+		ASSERT_EQUAL(top_changes.size(), 1u);
+		ASSERT(column_changes.empty());
+
+		//    ,   -  
+		sheet.BeginBatch();
+		for (int row = 0; row < 4; ++row) {
+			for (int col = 0; col < 4; ++col) {
+				sheet.SetCell(Position{ row, col }, "=" + std::to_string(row + col));
+			}
+		}
+		sheet.Commit();
+		ASSERT_EQUAL(top_changes.size(), 2u);
+		ASSERT_EQUAL(top_changes[1].ranges.size(), 1u);
+		ASSERT(top_changes[1].ranges[0].top_left == "A1"_pos);
+		ASSERT_EQUAL(top_changes[1].ranges[0].size, (Size{ 3, 3 }));
+		ASSERT_EQUAL(top_values[1], 2.0);
+
+		//        
+		sheet.InsertRows(5);
+		ASSERT_EQUAL(top_changes.size(), 2u);
+		ASSERT_EQUAL(column_changes.size(), 1u);
+		ASSERT(column_changes[0].ranges[0].top_left == "E6"_pos);
+		ASSERT_EQUAL(column_changes[0].ranges[0].size, (Size{ 5, 1 }));
+
+		// ,  ,  
+		sheet.Subscribe({ "H1"_pos, { 1, 1 } }, [&sheet](const ChangeSet&, const SheetSnapshot&) {
+			sheet.SetCell("E1"_pos, "echo");
+		});
+		sheet.SetCell("H1"_pos, "ping");
+		ASSERT_EQUAL(column_changes.size(), 2u);
+		ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "echo");
+
+		sheet.Unsubscribe(top);
+		sheet.ClearCell("B2"_pos);
+		ASSERT_EQUAL(top_changes.size(), 2u);
+	}
+
+	//      
+	void TestReadRange() {
+		Sheet sheet; //     
+		sheet.SetCell("B2"_pos, "=1+2");
+		sheet.SetCell("C2"_pos, "'=text");
+		sheet.SetCell("D2"_pos, "=1/0");
+		sheet.SetCell("B3"_pos, "plain");
+		sheet.SetCell("C3"_pos, "cleared");
+		sheet.ClearCell("C3"_pos);
+		sheet.SetCell("D4"_pos, "=7");
+		sheet.MoveRows(3, 1, 2); //  4    3
+
+		std::vector<double> numbers(9);
+		std::vector<CellValueType> types(9);
+		std::vector<uint64_t> mask(1);
+		std::vector<std::string_view> texts(9);
+		const RangeBuffers buffers{ numbers.data(), types.data(), mask.data(), texts.data() };
+		ASSERT_EQUAL(sheet.ReadRange({ "B2"_pos, { 3, 3 } }, buffers), 5u);
+		ASSERT(types[0] == CellValueType::Number && numbers[0] == 3.0);
+		ASSERT(types[1] == CellValueType::Text && texts[1] == "=text" && std::isnan(numbers[1]));
+		ASSERT(types[2] == CellValueType::Error);
+		ASSERT(types[5] == CellValueType::Number && numbers[5] == 7.0);
+		ASSERT(types[6] == CellValueType::Text && texts[6] == "plain");
+		ASSERT(types[7] == CellValueType::Empty && types[3] == CellValueType::Empty);
+		ASSERT_EQUAL(mask[0], (uint64_t{ 1 } << 0) | (uint64_t{ 1 } << 5));
+
+		//    ,     
+		std::vector<double> snapshot_numbers(9);
+		const SheetSnapshot snapshot = sheet.Snapshot();
+		ASSERT_EQUAL(snapshot.ReadRange({ "B2"_pos, { 3, 3 } }, { snapshot_numbers.data() }), 5u);
+		ASSERT_EQUAL(snapshot_numbers[5], 7.0);
+
+		//     
+		for (int row = 0; row < 1000; ++row) {
+			sheet.SetCell(Position{ row, 200 + row % 100 }, "=" + std::to_string(row));
+		}
+		sheet.SetCell(Position{ 0, 199 }, "=-1"); //       
+		sheet.SetCell(Position{ 1000, 200 }, "=-1");
+		std::vector<double> viewport(1000 * 100);
+		ASSERT_EQUAL(sheet.ReadRange({ Position{ 0, 200 }, { 1000, 100 } }, { viewport.data() }), 1000u);
+		ASSERT_EQUAL(viewport[999 * 100 + 99], 999.0);
+	}
+
+	//     
+	void TestWorkload() {
+		const WorkloadOptions options = SparseScatterWorkload({ 200, 40 }, 0.1, 42);
+		std::ostringstream tsv;
+		const size_t count = WriteWorkloadTsv(tsv, options);
+		ASSERT(count > 400 && count < 1200);
+
+		//     ,  seed - 
+		std::ostringstream same;
+		WriteWorkloadTsv(same, options);
+		ASSERT_EQUAL(tsv.str(), same.str());
+		std::ostringstream other;
+		WriteWorkloadTsv(other, SparseScatterWorkload({ 200, 40 }, 0.1, 43));
+		ASSERT(tsv.str() != other.str());
+
+		// ,  ,     TSV
+		Sheet filled;
+		ASSERT_EQUAL(FillSheet(filled, options), count);
+		Sheet imported;
+		const ImportResult result = imported.ImportTexts(tsv.str());
+		ASSERT_EQUAL(result.imported, count);
+		ASSERT(result.errors.empty());
+		ASSERT(PrintSheetTexts(filled) == PrintSheetTexts(imported));
+
+		//       
+		Sheet deep;
+		ASSERT_EQUAL(FillSheet(deep, DeepFormulaWorkload({ 10, 10 }, 20)), 100u);
+		const CellInterface* cell = deep.GetCell("J10"_pos);
+		ASSERT(cell != nullptr && std::holds_alternative<double>(cell->GetValue()));
+
+		//        ,  
+		Sheet text;
+		FillSheet(text, TextColumnsWorkload({ 20, 20 }, 64));
+		std::ostringstream values;
+		text.PrintValues(values);
+		ASSERT(values.str().find(' ') != std::string::npos);
+
+		bool thrown = false;
+		try {
+			FillSheet(text, DenseNumericWorkload({ Position::MAX_ROWS + 1, 1 }));
+		} catch (const InvalidPositionException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+
+	//        
+	void TestTraceReplay() {
+		std::stringstream trace;
+		std::string recorded_texts;
+		{
+			RecordingSheet sheet(CreateSheet(), trace);
+			sheet.SetCell("A1"_pos, "=1+2");
+			sheet.SetCell("B2"_pos, "text");
+			ASSERT(sheet.TrySetCell("C3"_pos, "=1+").status == CellStatus::FormulaSyntaxError);
+			ASSERT(sheet.GetCell("A1"_pos) != nullptr);
+			sheet.InsertRows(0, 2);
+			sheet.ClearCell("B4"_pos);
+			bool thrown = false;
+			try {
+				sheet.SetCell(Position{ -1, 0 }, "invalid");
+			} catch (const InvalidPositionException&) {
+				thrown = true;
+			}
+			ASSERT(thrown);
+			std::ostringstream output;
+			sheet.PrintTexts(output);
+			recorded_texts = output.str();
+		}
+
+		const std::vector<TraceEvent> events = ReadTrace(trace);
+		ASSERT_EQUAL(events.size(), 8u);
+		ASSERT(events[0].op == TraceEvent::Op::SetCell && events[0].pos == "A1"_pos && events[0].text == "=1+2");
+		ASSERT(events[4].op == TraceEvent::Op::InsertRows && events[4].pos.row == 0 && events[4].pos.col == 2);
+		ASSERT(events[6].pos.row == -1);
+		ASSERT(events[7].time >= events[0].time);
+
+		//        
+		auto replayed = CreateSheet();
+		const ReplayReport report = ReplayTrace(*replayed, events);
+		ASSERT_EQUAL(report.failed, 1u);
+		ASSERT_EQUAL(report.latencies[static_cast<size_t>(TraceEvent::Op::SetCell)].GetCount(), 3u);
+		std::ostringstream replayed_texts;
+		replayed->PrintTexts(replayed_texts);
+		ASSERT_EQUAL(replayed_texts.str(), recorded_texts);
+
+		//    
+		const std::string data = trace.str();
+		std::istringstream truncated(data.substr(0, data.size() - 1));
+		ASSERT_EQUAL(ReadTrace(truncated).size(), 7u);
+
+		LatencyHistogram histogram;
+		for (int i = 1; i <= 100; ++i) {
+			histogram.Add(std::chrono::microseconds(i));
+		}
+		const auto p50 = histogram.GetPercentile(50);
+		ASSERT(p50 >= std::chrono::microseconds(50) && p50 <= std::chrono::microseconds(57));
+		ASSERT_EQUAL(histogram.GetPercentile(100).count(), 100000);
+	}
+
+	//        
+	void TestFormulaStats() {
+		ResetFormulaStats();
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "=(1+2)*3");
+		sheet.SetCell("A2"_pos, "=4/2");
+		ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 9.0);
+		ASSERT_EQUAL(ParseFormula("(4)/2")->GetExpression(), "4/2");
+
+		const FormulaStats stats = GetFormulaStats();
+		if (IsFormulaStatsEnabled()) {
+			ASSERT(stats[FormulaPhase::Lex].calls >= 2 && stats[FormulaPhase::Parse].calls >= 2);
+			ASSERT(stats[FormulaPhase::BuildAst].calls >= 2 && stats[FormulaPhase::Execute].calls >= 1);
+			ASSERT(stats[FormulaPhase::Canonicalize].calls >= 1);
+			ASSERT(stats[FormulaPhase::Parse].ticks > 0);
+
+			//      
+			const uint64_t executed = stats[FormulaPhase::Execute].calls;
+			std::thread([] { ParseFormula("1+1")->Evaluate(); }).join();
+			ASSERT_EQUAL(GetFormulaStats()[FormulaPhase::Execute].calls, executed + 1);
+		} else {
+			for (const FormulaPhaseStats& phase : stats.phases) {
+				ASSERT_EQUAL(phase.calls, 0u);
+			}
+		}
+
+		std::ostringstream json;
+		WriteFormulaStatsJson(json);
+		ASSERT(json.str().find("\"execute\"") != std::string::npos);
+		ResetFormulaStats();
+		ASSERT_EQUAL(GetFormulaStats()[FormulaPhase::Lex].calls, 0u);
+	}
+
+	//       Chrome trace
+	void TestSpanTrace() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "before"); //     
+		StartSpanTrace();
+		sheet.SetCell("A2"_pos, "=1+2");
+		sheet.ImportTexts("x\t=2*3\ny\n");
+		std::ostringstream printed;
+		sheet.PrintValues(printed);
+		StopSpanTrace();
+		sheet.SetCell("A3"_pos, "after");
+
+		std::ostringstream trace;
+		WriteSpanTrace(trace);
+		const std::string json = trace.str();
+		ASSERT(json.find("\"traceEvents\"") != std::string::npos);
+		ASSERT(json.find("\"name\": \"thread_name\", \"ph\": \"M\"") != std::string::npos);
+		ASSERT(json.find("\"name\": \"Sheet::ImportTexts/parse\", \"ph\": \"X\"") != std::string::npos);
+		ASSERT(json.find("\"ParseFormulaAST\"") != std::string::npos);
+		ASSERT(json.find("\"Sheet::PrintValues\"") != std::string::npos);
+		size_t set_cells = 0;
+		for (size_t pos = json.find("\"Sheet::SetCell\""); pos != std::string::npos;
+			 pos = json.find("\"Sheet::SetCell\"", pos + 1)) {
+			++set_cells;
+		}
+		ASSERT_EQUAL(set_cells, 1u);
+		ASSERT_EQUAL(GetDroppedSpanCount(), 0u);
+
+		//      
+		StartSpanTrace({ 4 });
+		for (int i = 0; i < 10; ++i) {
+			sheet.ClearCell("A1"_pos);
+		}
+		StopSpanTrace();
+		ASSERT(GetDroppedSpanCount() > 0);
+		std::ostringstream overflow;
+		WriteSpanTrace(overflow);
+		ASSERT(overflow.str().find("\"Sheet::SetCell\"") == std::string::npos);
+		ASSERT(overflow.str().find("\"Sheet::ClearCell\"") != std::string::npos);
+
+		//        , 
+		//      
+		SetThreadCount(4);
+		Sheet dense;
+		FillSheet(dense, DenseNumericWorkload({ 600, 16 }));
+		StartSpanTrace();
+		std::ostringstream parallel;
+		dense.PrintValues(parallel);
+		for (int i = 0; i < 8; ++i) {
+			std::thread([] {
+				SPREADSHEET_TRACE_SPAN("TestSpanTrace/thread");
+			}).join();
+		}
+		StopSpanTrace();
+		SetThreadCount(0);
+		std::ostringstream parallel_trace;
+		WriteSpanTrace(parallel_trace);
+		const std::string parallel_json = parallel_trace.str();
+		auto count = [&parallel_json](const std::string& text) {
+			size_t result = 0;
+			for (size_t pos = parallel_json.find(text); pos != std::string::npos; pos = parallel_json.find(text, pos + 1)) {
+				++result;
+			}
+			return result;
+		};
+		ASSERT_EQUAL(count("\"TestSpanTrace/thread\""), 8u);
+		ASSERT(count("\"PrintTable/format\"") > 0);
+		ASSERT_EQUAL(count("\"Sheet::PrintValues\""), 1u);
+		//  ,          
+		const size_t tracks = count("\"thread_name\"");
+		ASSERT(tracks >= 2 && tracks <= 5);
+		ASSERT_EQUAL(count("{"), count("}"));
+		ASSERT_EQUAL(parallel_json.substr(parallel_json.size() - 4), std::string("\n]}\n"));
+		ASSERT_EQUAL(GetDroppedSpanCount(), 0u);
+	}
+
+	//       
+	void TestAllocStats() {
+		ResetAllocStats();
+		Sheet sheet;
+		const AllocCounters before = GetThreadAllocCounters();
+		sheet.SetCell("A1"_pos, "=1+2");
+		sheet.SetCell("A2"_pos, "text");
+		sheet.GetCell("A1"_pos)->GetValue();
+		const AllocCounters after = GetThreadAllocCounters();
+
+		const std::vector<AllocOpStats> stats = GetAllocStats();
+		auto find = [&stats](const std::string& name) {
+			return std::find_if(stats.begin(), stats.end(), [&name](const AllocOpStats& op) {
+				return op.name == name;
+			});
+		};
+		if (IsAllocStatsEnabled()) {
+			ASSERT(after.allocations > before.allocations && after.bytes > before.bytes);
+			const auto set_cell = find("Sheet::SetCell");
+			ASSERT(set_cell != stats.end() && set_cell->calls == 2 && set_cell->allocations > 0);
+			// Cell::Set  SetCell   
+			ASSERT(find("Sheet::GetCell") != stats.end() && find("Cell::Set") == stats.end());
+		} else {
+			ASSERT_EQUAL(after.allocations, before.allocations);
+			ASSERT(stats.empty());
+		}
+		ResetAllocStats();
+		ASSERT(GetAllocStats().empty());
+
+		//   pmr    ,  
+		//     operator new.   
+		// :  ASSERT   
+		CountingMemoryResource resource;
+		size_t bytes_in_use = 0;
+		{
+			SPREADSHEET_ALLOC_SCOPE("TestAllocStats/pmr");
+			std::pmr::vector<int> numbers(&resource);
+			numbers.resize(100);
+			bytes_in_use = resource.GetBytesInUse();
+		}
+		ASSERT_EQUAL(resource.GetCounters().allocations, 1u);
+		ASSERT(bytes_in_use >= 100 * sizeof(int));
+		ASSERT_EQUAL(resource.GetBytesInUse(), 0u);
+		const std::vector<AllocOpStats> pmr_stats = GetAllocStats();
+		if (IsAllocStatsEnabled()) {
+			ASSERT_EQUAL(pmr_stats.size(), 1u);
+			ASSERT_EQUAL(pmr_stats[0].name, "TestAllocStats/pmr");
+			ASSERT_EQUAL(pmr_stats[0].allocations, 1u);
+			ASSERT_EQUAL(pmr_stats[0].bytes, resource.GetCounters().bytes);
+		} else {
+			ASSERT(pmr_stats.empty());
+		}
+		ResetAllocStats();
+
+		//   ParallelFor     
+		//    ,     - 
+		SetThreadCount(4);
+		constexpr size_t PARTS = 4;
+		constexpr int ALLOCS_PER_PART = 100;
+		std::vector<std::vector<std::unique_ptr<int>>> kept(PARTS);
+		const AllocCounters parallel_before = GetThreadAllocCounters();
+		{
+			SPREADSHEET_ALLOC_SCOPE("TestAllocStats/parallel");
+			ParallelFor(PARTS, [&kept](size_t begin, size_t end) {
+				//   ,     
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				for (size_t part = begin; part < end; ++part) {
+					SPREADSHEET_ALLOC_SCOPE("TestAllocStats/part");
+					for (int i = 0; i < ALLOCS_PER_PART; ++i) {
+						kept[part].push_back(std::make_unique<int>(i));
+					}
+				}
+			}, /* min_items_per_thread = */ 1);
+		}
+		const AllocCounters parallel_after = GetThreadAllocCounters();
+		SetThreadCount(0);
+		const std::vector<AllocOpStats> parallel_stats = GetAllocStats();
+		if (IsAllocStatsEnabled()) {
+			ASSERT(parallel_after.allocations - parallel_before.allocations >= PARTS * ALLOCS_PER_PART);
+			ASSERT_EQUAL(parallel_stats.size(), 1u);
+			ASSERT_EQUAL(parallel_stats[0].name, "TestAllocStats/parallel");
+			ASSERT(parallel_stats[0].allocations >= PARTS * ALLOCS_PER_PART);
+		} else {
+			ASSERT_EQUAL(parallel_after.allocations, parallel_before.allocations);
+			ASSERT(parallel_stats.empty());
+		}
+	}
+
+	void TestMemoryStats() {
+		Sheet sheet;
+		ASSERT_EQUAL(sheet.GetMemoryStats().grid.tiles, 0u);
+
+		sheet.SetCell("A1"_pos, "=1+2*3");
+		sheet.SetCell("A2"_pos, std::string(100, 'x'));
+		sheet.SetCell("B1"_pos, "short");
+		sheet.SetCell("ZZ1000"_pos, "=-4");
+		SheetMemoryStats stats = sheet.GetMemoryStats();
+		ASSERT_EQUAL(stats.grid.tiles, 2u);
+		ASSERT(stats.grid.buckets >= 3 && stats.grid.index_bytes > 0);
+		ASSERT_EQUAL(stats.grid.cells.text_cells, 2u);
+		ASSERT_EQUAL(stats.grid.cells.formula_cells, 2u);
+		// 1+2*3 -  , -4 - 
+		ASSERT_EQUAL(stats.grid.cells.ast_nodes, 7u);
+		ASSERT(stats.grid.cells.ast_bytes > 0);
+		//      :    
+		ASSERT(stats.grid.cells.text_bytes >= 2 * 101);
+		ASSERT(stats.line_bytes > 0 && stats.GetTotalBytes() > stats.grid.GetTotalBytes());
+
+		//        
+		ASSERT_EQUAL(sheet.GetMemoryStats().GetTotalBytes(), stats.GetTotalBytes());
+
+		//   ,      
+		const SheetSnapshot snapshot = sheet.Snapshot();
+		sheet.ClearCell("A2"_pos);
+		stats = sheet.GetMemoryStats();
+		ASSERT_EQUAL(stats.grid.cells.text_cells, 1u);
+		ASSERT_EQUAL(stats.grid.cells.empty_cells, 1u);
+		ASSERT(stats.grid.cells.text_bytes < 2 * 101);
+
+		//     ,     
+		sheet.SetFormulaParsing(FormulaParsing::Lazy);
+		sheet.SetCell("C1"_pos, "=(1+2)");
+		ASSERT_EQUAL(sheet.GetMemoryStats().grid.cells.unparsed_formulas, 1u);
+		ASSERT_EQUAL(std::get<double>(sheet.Snapshot().GetCell("C1"_pos)->GetValue()), 3.0);
+		stats = sheet.GetMemoryStats();
+		ASSERT_EQUAL(stats.grid.cells.unparsed_formulas, 0u);
+		ASSERT_EQUAL(stats.grid.cells.ast_nodes, 10u);
+
+		//       GetCell()
+		sheet.GetCell("B1"_pos)->Set("=-1");
+		stats = sheet.GetMemoryStats();
+		ASSERT_EQUAL(stats.grid.cells.text_cells, 0u);
+		ASSERT_EQUAL(stats.grid.cells.formula_cells, 4u);
+		ASSERT_EQUAL(stats.grid.cells.ast_nodes, 12u);
+	}
+
+	//     :     
+	//     ,    
+	void TestCellGridMemoryTotals() {
+		auto same = [](const CellGridMemoryStats& lhs, const CellGridMemoryStats& rhs) {
+			return lhs.tiles == rhs.tiles && lhs.buckets == rhs.buckets && lhs.index_bytes == rhs.index_bytes
+				&& lhs.cells.empty_cells == rhs.cells.empty_cells && lhs.cells.text_cells == rhs.cells.text_cells
+				&& lhs.cells.formula_cells == rhs.cells.formula_cells && lhs.cells.ast_nodes == rhs.cells.ast_nodes
+				&& lhs.cells.unparsed_formulas == rhs.cells.unparsed_formulas
+				&& lhs.cells.GetTotalBytes() == rhs.cells.GetTotalBytes();
+		};
+		CellGrid grid;
+		ASSERT(same(grid.GetMemoryStats(), CellGrid(grid).GetMemoryStats()));
+
+		grid.InsertOrAssign("A1"_pos, Cell("=1+2", FormulaParsing::Lazy));
+		grid.InsertOrAssign("B200"_pos, Cell("text"));
+		for (int row = 0; row < 100; ++row) {
+			grid.InsertOrAssign({ row, 3 }, Cell(std::string(row, 'x')));
+		}
+		ASSERT(same(grid.GetMemoryStats(), CellGrid(grid).GetMemoryStats()));
+
+		// ,   ,   
+		const CellGrid copy = grid;
+		grid.FindForWrite("B200"_pos)->Set("=4*5");
+		grid.InsertOrAssign("A1"_pos, Cell("=(1)", FormulaParsing::Lazy));
+		ASSERT(grid.Extract({ 5, 3 }).has_value());
+		grid.EraseIf([](Position pos, const Cell&) { return pos.col == 3 && pos.row < 10; });
+		ASSERT(same(grid.GetMemoryStats(), CellGrid(grid).GetMemoryStats()));
+		ASSERT_EQUAL(copy.GetMemoryStats().cells.unparsed_formulas, 1u);
+
+		//    ,      
+		ASSERT_EQUAL(std::get<double>(copy.Find("A1"_pos)->GetValue()), 3.0);
+		ASSERT_EQUAL(grid.GetMemoryStats().cells.unparsed_formulas, 1u);
+		ASSERT_EQUAL(std::get<double>(grid.Find("A1"_pos)->GetValue()), 1.0);
+		ASSERT_EQUAL(grid.GetMemoryStats().cells.unparsed_formulas, 0u);
+		ASSERT(same(grid.GetMemoryStats(), CellGrid(grid).GetMemoryStats()));
+
+		// ,   ,   
+		std::optional<Cell> extracted = grid.Extract("A1"_pos);
+		grid.InsertOrAssign("A2"_pos, *extracted);
+		grid.InsertOrAssign("A3"_pos, Cell("=2+2", FormulaParsing::Lazy));
+		std::optional<Cell> lazy = grid.Extract("A3"_pos);
+		ASSERT_EQUAL(std::get<double>(lazy->GetValue()), 4.0);
+		grid.InsertOrAssign("A3"_pos, std::move(*lazy));
+		ASSERT(same(grid.GetMemoryStats(), CellGrid(grid).GetMemoryStats()));
+
+		grid.Clear();
+		ASSERT(same(grid.GetMemoryStats(), CellGridMemoryStats{}));
+	}
+
+	void TestPerformanceScaling() {
+		//   ,     .
+		//   ,      : 
+		//     ,    
+		std::map<size_t, std::unique_ptr<Sheet>> diagonals;
+		std::map<size_t, std::unique_ptr<Sheet>> columns;
+		for (size_t n : { 2048, 4096 }) {
+			auto& diagonal = diagonals[n] = std::make_unique<Sheet>();
+			for (int i = 0; i < static_cast<int>(n); ++i) {
+				diagonal->SetCell({ i, i }, "x");
+			}
+			auto& column = columns[n] = std::make_unique<Sheet>();
+			for (int i = 0; i < static_cast<int>(n); ++i) {
+				column->SetCell({ i, 0 }, "=" + std::to_string(i));
+			}
+		}
+
+		//    n  - n x n,     
+		ASSERT_SCALING([&diagonals](size_t n) {
+			for (int i = 0; i < 50; ++i) {
+				const Size size = diagonals.at(n)->GetPrintableSize();
+				ASSERT_EQUAL(size.rows, static_cast<int>(n));
+			}
+		}, 2048, 3.0);
+		ASSERT_SCALING([&columns](size_t n) {
+			std::ostringstream output;
+			columns.at(n)->PrintValues(output);
+			ASSERT(!output.str().empty());
+		}, 2048, 3.0);
+	}
+
+	void TestScalingAssertion() {
+		//  ,   ,       
+		using std::chrono::nanoseconds;
+		AssertScalingRatio(nanoseconds(1000), nanoseconds(2100), 150, 3.0); //   
+		AssertScalingRatio(nanoseconds(0), nanoseconds(1), 150, 3.0); //      
+		//      ( - )
+		bool thrown = false;
+		try {
+			AssertScalingRatio(nanoseconds(1000), nanoseconds(8000), 150, 3.0);
+		} catch (const std::runtime_error&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+
+	void TestFormulaProfiling() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "=1+1");
+		sheet.GetCell("A1"_pos)->GetValue();
+		// ,   ,  
+		sheet.SetFormulaProfiling(true);
+		ASSERT(sheet.GetSlowestFormulas(10).empty());
+
+		std::string deep = "1";
+		for (int i = 0; i < 200; ++i) {
+			deep = "(" + deep + "+1)";
+		}
+		sheet.SetCell("B2"_pos, "=" + deep);
+		sheet.SetCell("C3"_pos, "=2*3");
+		sheet.SetCell("D4"_pos, "text");
+		for (int i = 0; i < 50; ++i) {
+			sheet.GetCell("B2"_pos)->GetValue();
+		}
+		sheet.GetCell("C3"_pos)->GetValue();
+
+		const auto top = sheet.GetSlowestFormulas(10);
+		ASSERT_EQUAL(top.size(), 2u);
+		ASSERT(top[0].pos == "B2"_pos);
+		ASSERT_EQUAL(top[0].profile.evaluations, 50u);
+		ASSERT_EQUAL(top[0].profile.ast_nodes, 401u);
+		ASSERT(top[0].profile.parse_ns > 0 && top[0].profile.evaluation_ns > 0);
+		ASSERT(top[1].pos == "C3"_pos);
+		ASSERT_EQUAL(top[1].expression, std::string("=2*3"));
+		ASSERT_EQUAL(top[1].profile.evaluations, 1u);
+		ASSERT_EQUAL(top[1].profile.ast_nodes, 3u);
+
+		const auto first = sheet.GetSlowestFormulas(1);
+		ASSERT_EQUAL(first.size(), 1u);
+		ASSERT(first[0].pos == "B2"_pos);
+
+		//   - ,     
+		sheet.InsertRows(0, 2);
+		ASSERT(sheet.GetSlowestFormulas(1)[0].pos == "B4"_pos);
+	}
+
+	void TestThreadPool() {
+		SetThreadCount(4);
+		//    ,   : 
+		//      
+		const auto caller = std::this_thread::get_id();
+		std::atomic<int> pool_parts = 0;
+		std::atomic<int> reused_parts = 0;
+		for (int call = 0; call < 2; ++call) {
+			std::vector<int> seen(4, 0);
+			ParallelFor(seen.size(), [&](size_t begin, size_t end) {
+				thread_local int parts = 0;
+				for (size_t i = begin; i < end; ++i) {
+					++seen[i];
+				}
+				if (std::this_thread::get_id() != caller) {
+					++pool_parts;
+					reused_parts += parts++ > 0 ? 1 : 0;
+				}
+				//   ,     
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}, /* min_items_per_thread = */ 1);
+			ASSERT(std::all_of(seen.begin(), seen.end(), [](int count) { return count == 1; }));
+		}
+		ASSERT(pool_parts > 0 && reused_parts > 0);
+
+		//      ,    
+		std::atomic<size_t> nested = 0;
+		ParallelFor(8, [&nested](size_t begin, size_t end) {
+			ParallelFor(100 * (end - begin), [&nested](size_t b, size_t e) {
+				nested += e - b;
+			}, /* min_items_per_thread = */ 1);
+		}, /* min_items_per_thread = */ 1);
+		ASSERT_EQUAL(nested.load(), 800u);
+		bool thrown = false;
+		try {
+			ParallelFor(100, [](size_t begin, size_t) {
+				if (begin != 0) {
+					throw std::runtime_error("part failed");
+				}
+			}, /* min_items_per_thread = */ 1);
+		} catch (const std::runtime_error&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+
+		//        
+		Sheet sheet;
+		FillSheet(sheet, DenseNumericWorkload({ 600, 16 }));
+		std::ostringstream parallel;
+		sheet.PrintValues(parallel);
+		SetThreadCount(1);
+		std::ostringstream sequential;
+		sheet.PrintValues(sequential);
+		ASSERT_EQUAL(parallel.str(), sequential.str());
+		SetThreadCount(0);
+	}
+
+	//        
+	void TestJournal() {
+		const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_journal_test";
+		std::filesystem::remove_all(dir);
+		std::filesystem::create_directories(dir);
+		const auto journal_path = (dir / "sheet.journal").string();
+		JournalOptions options;
+		options.snapshot_path = (dir / "sheet.snapshot").string();
+
+		{
+			Sheet sheet; //   
+			sheet.OpenJournal(journal_path, options);
+			sheet.ImportTexts("x\ty\n");
+			sheet.SetCell("A1"_pos, "=1+2");
+			sheet.SetCell("B2"_pos, "meow");
+			ASSERT(sheet.TrySetCell("C3"_pos, "=1+").status == CellStatus::FormulaSyntaxError); //   
+			sheet.ClearCell("B2"_pos);
+			sheet.SyncJournal();
+		}
+		{
+			Sheet sheet; //    
+			sheet.OpenJournal(journal_path, options);
+			ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 3.0);
+			ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+			ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+			ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "y");
+
+			sheet.CompactJournal(); //    ,  
+			ASSERT(Journal::ReadRecords(journal_path).empty());
+			sheet.SetCell("D4"_pos, "after compaction");
+		}
+		{
+			std::ofstream file(journal_path, std::ios::binary | std::ios::app);
+			file << "\x01torn"; //    
+		}
+		{
+			Sheet sheet; //      
+			sheet.OpenJournal(journal_path, options);
+			ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=1+2");
+			ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "after compaction");
+			ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 4 }));
+			sheet.SetCell("E5"_pos, "=5");
+			sheet.InsertRows(0);
+			sheet.DeleteRows(0);
+		}
+		ASSERT_EQUAL(Journal::ReadRecords(journal_path).size(), 4u); //  ,   
+
+		options.compact_after_records = 100;
+		{
+			Sheet sheet; //  
+			sheet.OpenJournal(journal_path, options);
+			for (int row = 0; row < 250; ++row) {
+				sheet.SetCell(Position{ row, 9 }, std::to_string(row));
+			}
+		}
+		ASSERT_EQUAL(Journal::ReadRecords(journal_path).size(), 54u); //   96-  196- 
+		{
+			Sheet sheet;
+			sheet.OpenJournal(journal_path, options);
+			ASSERT_EQUAL(sheet.GetCell(Position{ 249, 9 })->GetText(), "249");
+			ASSERT_EQUAL(std::get<double>(sheet.GetCell("E5"_pos)->GetValue()), 5.0);
+			sheet.InsertCols(0, 2);
+			sheet.MoveRows(4, 1, 0);
+			sheet.SortRange({ "A1"_pos, { 5, 7 } }, { { 5, true } });
+			sheet.SyncJournal();
+		}
+		{
+			Sheet sheet; //   ,    
+			sheet.OpenJournal(journal_path, options);
+			ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "after compaction");
+			ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), "=5");
+		}
+
+		std::filesystem::remove(journal_path);
+		std::filesystem::remove(options.snapshot_path);
+		{
+			Sheet sheet; // ,    
+			sheet.OpenJournal(journal_path, options);
+			sheet.SetCell("A6"_pos, "deleted");
+			sheet.DeleteRows(3, 20000);
+			sheet.DeleteCols(Position::MAX_COLS - 1, Position::MAX_COLS);
+			sheet.SetCell("B2"_pos, "after");
+			sheet.SyncJournal();
+		}
+		ASSERT_EQUAL(Journal::ReadRecords(journal_path).size(), 4u);
+		{
+			Sheet sheet;
+			sheet.OpenJournal(journal_path, options);
+			ASSERT(sheet.GetCell("A6"_pos) == nullptr);
+			ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "after");
+		}
+
+		std::filesystem::remove(journal_path);
+		std::filesystem::remove(options.snapshot_path);
+		{
+			Sheet sheet;
+			sheet.OpenJournal(journal_path, options);
+			sheet.SetCell("A1"_pos, "first");
+			sheet.SetCell("A2"_pos, "second");
+		}
+		std::string journal_data;
+		{
+			std::ifstream file(journal_path, std::ios::binary);
+			journal_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		auto write_journal = [&journal_path](const std::string& data) {
+			std::ofstream file(journal_path, std::ios::binary | std::ios::trunc);
+			file << data;
+		};
+		{
+			//      - ,    
+			std::string corrupted = journal_data;
+			corrupted[corrupted.find("first")] = 'F';
+			write_journal(corrupted);
+			bool thrown = false;
+			try {
+				Sheet sheet;
+				sheet.OpenJournal(journal_path, options);
+			} catch (const std::runtime_error&) {
+				thrown = true;
+			}
+			ASSERT(thrown);
+			ASSERT_EQUAL(std::filesystem::file_size(journal_path), corrupted.size()); //   
+		}
+		{
+			//     - ,    
+			write_journal(journal_data + std::string(16, '\0'));
+			ASSERT_EQUAL(Journal::ReadRecords(journal_path).size(), 2u);
+			//  ,   , 
+			std::string torn = journal_data;
+			torn[torn.find("second")] = 'S';
+			write_journal(torn);
+			Sheet sheet;
+			sheet.OpenJournal(journal_path, options);
+			ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "first");
+			ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+		}
+		std::filesystem::remove_all(dir);
+	}
+
 }  // namespace
 
 int main() {
@@ -127,4 +1639,34 @@ int main() {
 	RUN_TEST(tr, TestSetCellPlainText); 
 	RUN_TEST(tr, TestClearCell); 
 	RUN_TEST(tr, TestPrint); 
+	RUN_TEST(tr, TestTrySetCell); 
+	RUN_TEST(tr, TestImportTexts); 
+	RUN_TEST(tr, TestSnapshot); 
+	RUN_TEST(tr, TestLazyFormulas); 
+	RUN_TEST(tr, TestPrintBlocks);
+	RUN_TEST(tr, TestJournal);
+	RUN_TEST(tr, TestInsertDelete);
+	RUN_TEST(tr, TestMoveRowsCols);
+	RUN_TEST(tr, TestSortRange);
+	RUN_TEST(tr, TestSheetSnapshot); 
+	RUN_TEST(tr, TestConcurrentWrites);
+	RUN_TEST(tr, TestBatch);
+	RUN_TEST(tr, TestUndoRedo);
+	RUN_TEST(tr, TestSubscriptions);
+	RUN_TEST(tr, TestReadRange);
+	RUN_TEST(tr, TestWorkload);
+	RUN_TEST(tr, TestTraceReplay);
+	RUN_TEST(tr, TestFormulaStats);
+	RUN_TEST(tr, TestSpanTrace);
+	RUN_TEST(tr, TestAllocStats);
+	RUN_TEST(tr, TestMemoryStats);
+	RUN_TEST(tr, TestCellGridMemoryTotals);
+	RUN_TEST(tr, TestScalingAssertion);
+	RUN_TEST(tr, TestFormulaProfiling);
+	RUN_TEST(tr, TestThreadPool);
+	//      , 
+	//    : SPREADSHEET_PERF_TESTS=1
+	if (const char* perf_tests = std::getenv("SPREADSHEET_PERF_TESTS"); perf_tests != nullptr && std::string_view(perf_tests) == "1") {
+		RUN_TIMED_TEST(tr, TestPerformanceScaling, 10000);
+	}
 }
\ No newline at end of file
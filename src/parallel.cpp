@@ -0,0 +1,148 @@
+#include "parallel.h"
+
+#include "alloc_stats.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+    // Задачи одного вызова RunTasks. Индексы разбирают потоки пула и
+    // вызывающий поток; задание остаётся в очереди, пока не разобраны все
+    struct Job {
+        Job(size_t count, const std::function<void(size_t)>& task, AllocDelegation& allocs)
+            : count(count)
+            , task(task)
+            , allocs(allocs) {
+        }
+
+        const size_t count;
+        const std::function<void(size_t)>& task;
+        // Выделения задач в потоках пула приписываются вызывающему потоку
+        AllocDelegation& allocs;
+        std::atomic<size_t> next{ 0 };
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t done = 0;
+    };
+
+    // Выполняет ещё не взятые задачи job; pooled - в потоке пула
+    void Execute(Job& job, bool pooled) {
+        for (size_t index; (index = job.next.fetch_add(1, std::memory_order_relaxed)) < job.count;) {
+            if (pooled) {
+                job.allocs.RunTask([&job, index] {
+                    job.task(index);
+                });
+            } else {
+                job.task(index);
+            }
+            std::lock_guard lock(job.mutex);
+            if (++job.done == job.count) {
+                job.finished.notify_all();
+            }
+        }
+    }
+
+    // Потоки создаются при первой потребности и живут до конца программы
+    class ThreadPool {
+    public:
+        static ThreadPool& Get() {
+            static ThreadPool pool;
+            return pool;
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard lock(mutex_);
+                stop_ = true;
+            }
+            ready_.notify_all();
+            for (auto& thread : threads_) {
+                thread.join();
+            }
+        }
+
+        void Run(size_t count, const std::function<void(size_t)>& task) {
+            AllocDelegation allocs;
+            auto job = std::make_shared<Job>(count, task, allocs);
+            {
+                std::lock_guard lock(mutex_);
+                // Вызывающий поток тоже выполняет задачи, поэтому потоков в пуле на один меньше
+                while (threads_.size() + 1 < count) {
+                    threads_.emplace_back([this] {
+                        Work();
+                    });
+                }
+                jobs_.push_back(job);
+            }
+            ready_.notify_all();
+
+            Execute(*job, /* pooled = */ false);
+            std::unique_lock lock(job->mutex);
+            job->finished.wait(lock, [&job] {
+                return job->done == job->count;
+            });
+        }
+
+    private:
+        void Work() {
+            for (;;) {
+                std::shared_ptr<Job> job;
+                {
+                    std::unique_lock lock(mutex_);
+                    ready_.wait(lock, [this] {
+                        return stop_ || !jobs_.empty();
+                    });
+                    if (stop_) {
+                        return;
+                    }
+                    job = jobs_.front();
+                    if (job->next.load(std::memory_order_relaxed) >= job->count) {
+                        // Все задачи разобраны, их завершения ждёт вызывающий поток
+                        jobs_.pop_front();
+                        continue;
+                    }
+                }
+                Execute(*job, /* pooled = */ true);
+            }
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<std::shared_ptr<Job>> jobs_;
+        std::vector<std::thread> threads_;
+        bool stop_ = false;
+    };
+
+    std::atomic<size_t> thread_count{ 0 };
+
+}  // namespace
+
+void SetThreadCount(size_t threads) {
+    thread_count.store(threads, std::memory_order_relaxed);
+}
+
+size_t GetThreadCount() {
+    const size_t threads = thread_count.load(std::memory_order_relaxed);
+    return threads != 0 ? threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+namespace parallel_detail {
+
+    void RunTasks(size_t count, const std::function<void(size_t)>& task) {
+        if (count <= 1) {
+            if (count == 1) {
+                task(0);
+            }
+            return;
+        }
+        ThreadPool::Get().Run(count, task);
+    }
+
+}  // namespace parallel_detail
@@ -1,37 +1,482 @@
 #include "sheet.h"
 
+#include "alloc_stats.h"
 #include "cell.h"
+#include "cell_grid.h"
 #include "common.h"
+#include "file_mapping.h"
+#include "index_map.h"
+#include "journal.h"
+#include "parallel.h"
+#include "snapshot.h"
+#include "span_trace.h"
+#include "tsv.h"
 
 #include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <numeric>
 #include <optional>
+#include <sstream>
+#include <tuple>
 
 using namespace std::literals;
 
+namespace {
+
+    // Номер потока для выбора слота блокировки: потоки нумеруются по порядку
+    // первого обращения, поэтому первые потоки попадают в разные слоты
+    size_t GetThreadSlot() {
+        static std::atomic<size_t> next_slot = 0;
+        thread_local const size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+        return slot;
+    }
+
+    // Число строк в блоке, который один поток форматирует в свой буфер
+    constexpr size_t PRINT_BLOCK_ROWS = 256;
+
+    // Выводит таблицу размера size: столбцы разделяются '\t', строки - '\n'.
+    // Позиции cells переводятся в логические отображениями rows и cols.
+    // Блоки строк форматируются параллельно в отдельные буферы с настройками
+    // формата output и записываются в output по порядку крупными write().
+    template <typename CellPrinter>
+    void PrintTable(const CellGrid& cells, const IndexMap& rows, const IndexMap& cols, Size size,
+                    std::ostream& output, CellPrinter print_cell) {
+        using RowEntry = std::pair<int, const Cell*>;
+
+        // Раскладываем непустые ячейки по строкам сортировкой подсчётом
+        std::vector<size_t> row_begin(static_cast<size_t>(size.rows) + 1, 0);
+        cells.ForEach([&](Position pos, const Cell& cell) {
+            if (!cell.IsEmpty()) {
+                ++row_begin[rows.ToLogical(pos.row) + 1];
+            }
+        });
+        for (size_t row = 0; row < static_cast<size_t>(size.rows); ++row) {
+            row_begin[row + 1] += row_begin[row];
+        }
+        std::vector<RowEntry> entries(row_begin.back());
+        std::vector<size_t> cursor(row_begin.begin(), row_begin.end() - 1);
+        cells.ForEach([&](Position pos, const Cell& cell) {
+            if (!cell.IsEmpty()) {
+                entries[cursor[rows.ToLogical(pos.row)]++] = { cols.ToLogical(pos.col), &cell };
+            }
+        });
+
+        auto format_block = [&](size_t block) {
+            std::ostringstream out;
+            out.copyfmt(output);
+            const size_t first_row = block * PRINT_BLOCK_ROWS;
+            const size_t last_row = std::min(first_row + PRINT_BLOCK_ROWS, static_cast<size_t>(size.rows));
+            for (size_t row = first_row; row < last_row; ++row) {
+                auto begin = entries.begin() + row_begin[row];
+                auto end = entries.begin() + row_begin[row + 1];
+                std::sort(begin, end, [](const RowEntry& lhs, const RowEntry& rhs) {
+                    return lhs.first < rhs.first;
+                });
+                // Перед ячейкой столбца col выводится ровно col разделителей
+                int tabs = 0;
+                for (auto it = begin; it != end; ++it) {
+                    for (; tabs < it->first; ++tabs) {
+                        out.put('\t');
+                    }
+                    print_cell(out, *it->second);
+                }
+                for (; tabs < size.cols - 1; ++tabs) {
+                    out.put('\t');
+                }
+                out.put('\n');
+            }
+            return out.str();
+        };
+
+        // Форматируем волнами, чтобы в памяти одновременно было немного буферов.
+        // Небольшие таблицы форматируются в вызывающем потоке: передача блоков
+        // пулу стоит дороже их форматирования
+        const size_t blocks = (static_cast<size_t>(size.rows) + PRINT_BLOCK_ROWS - 1) / PRINT_BLOCK_ROWS;
+        const bool parallel = entries.size() >= MIN_ITEMS_PER_THREAD;
+        const size_t wave = parallel ? GetWorkerCount(blocks, 1) * 2 : 1;
+        std::vector<std::string> buffers;
+        for (size_t first = 0; first < blocks; first += wave) {
+            buffers.assign(std::min(wave, blocks - first), std::string());
+            ParallelFor(buffers.size(), [&](size_t begin, size_t end) {
+                SPREADSHEET_TRACE_SPAN("PrintTable/format");
+                for (size_t i = begin; i < end; ++i) {
+                    buffers[i] = format_block(first + i);
+                }
+            }, /* min_items_per_thread = */ 1);
+            for (const auto& buffer : buffers) {
+                output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            }
+        }
+    }
+
+    // Вычисляет ограничивающий прямоугольник непустых ячеек в логических координатах
+    Size ComputePrintableSize(const CellGrid& cells, const IndexMap& rows, const IndexMap& cols) {
+        Size result{ 0, 0 };
+        cells.ForEach([&](Position pos, const Cell& cell) {
+            if (cell.IsEmpty()) return;
+            const int col = cols.ToLogical(pos.col);
+            const int row = rows.ToLogical(pos.row);
+
+            if (result.cols <= col) {
+                result.cols = col + 1;
+            }
+            if (result.rows <= row) {
+                result.rows = row + 1;
+            }
+        });
+        return result;
+    }
+
+    void CheckRange(Range range) {
+        const Position& top_left = range.top_left;
+        if (!top_left.IsValid() || range.size.rows < 0 || range.size.cols < 0
+            || range.size.rows > Position::MAX_ROWS - top_left.row || range.size.cols > Position::MAX_COLS - top_left.col) {
+            throw InvalidPositionException("Invalid range");
+        }
+    }
+
+    // Заполняет буферы значениями ячеек области range
+    size_t ReadCells(const CellGrid& cells, const IndexMap& rows, const IndexMap& cols, Range range,
+                     const RangeBuffers& buffers) {
+        const size_t area = static_cast<size_t>(range.size.rows) * static_cast<size_t>(range.size.cols);
+        if (buffers.numbers != nullptr) {
+            std::fill_n(buffers.numbers, area, std::numeric_limits<double>::quiet_NaN());
+        }
+        if (buffers.types != nullptr) {
+            std::fill_n(buffers.types, area, CellValueType::Empty);
+        }
+        if (buffers.number_mask != nullptr) {
+            std::fill_n(buffers.number_mask, (area + 63) / 64, uint64_t{ 0 });
+        }
+        if (buffers.texts != nullptr) {
+            std::fill_n(buffers.texts, area, std::string_view{});
+        }
+        if (area == 0) {
+            return 0;
+        }
+
+        // Признаки плиток, содержащих строки и столбцы области. Смещение ячейки
+        // внутри области находится обратным отображением, поэтому таблицы
+        // смещений на все строки и столбцы не нужны
+        std::array<bool, CellGrid::TILE_ROWS> bands{};
+        std::array<bool, CellGrid::TILE_COLS> tiles{};
+        for (int i = 0; i < range.size.rows; ++i) {
+            bands[rows.ToPhysical(range.top_left.row + i) / CellGrid::TILE_SIZE] = true;
+        }
+        for (int i = 0; i < range.size.cols; ++i) {
+            tiles[cols.ToPhysical(range.top_left.col + i) / CellGrid::TILE_SIZE] = true;
+        }
+
+        size_t count = 0;
+        cells.ForEachInTiles([&](int band_index, int tile_index) {
+            return bands[band_index] && tiles[tile_index];
+        }, [&](Position pos, const Cell& cell) {
+            // Беззнаковое сравнение отсекает и строки перед областью
+            const auto row = static_cast<unsigned>(rows.ToLogical(pos.row) - range.top_left.row);
+            const auto col = static_cast<unsigned>(cols.ToLogical(pos.col) - range.top_left.col);
+            if (row >= static_cast<unsigned>(range.size.rows) || col >= static_cast<unsigned>(range.size.cols)) {
+                return;
+            }
+            double number = 0;
+            std::string_view text;
+            const CellValueType type = cell.ReadValue(number, text);
+            if (type == CellValueType::Empty) {
+                return;
+            }
+            ++count;
+            const size_t index = static_cast<size_t>(row) * static_cast<size_t>(range.size.cols) + static_cast<size_t>(col);
+            if (buffers.types != nullptr) {
+                buffers.types[index] = type;
+            }
+            if (type == CellValueType::Number) {
+                if (buffers.numbers != nullptr) {
+                    buffers.numbers[index] = number;
+                }
+                if (buffers.number_mask != nullptr) {
+                    buffers.number_mask[index / 64] |= uint64_t{ 1 } << (index % 64);
+                }
+            } else if (type == CellValueType::Text && buffers.texts != nullptr) {
+                buffers.texts[index] = text;
+            }
+        });
+        return count;
+    }
+
+    void PrintCellValue(std::ostream& out, const Cell& cell) {
+        std::visit([&out](auto&& arg) { out << arg; }, cell.GetValue());
+    }
+
+    void PrintCellText(std::ostream& out, const Cell& cell) {
+        out << cell.GetText();
+    }
+
+    // Значение ячейки, извлечённое для сравнения при сортировке
+    struct SortValue {
+        // Порядок типов при сортировке по возрастанию
+        enum Kind : uint8_t {
+            NUMBER,
+            TEXT,
+            ERROR,
+            EMPTY,
+        };
+
+        Kind kind = EMPTY;
+        double number = 0;
+        std::string text;
+    };
+
+    SortValue MakeSortValue(const Cell* cell) {
+        SortValue result;
+        if (cell == nullptr || cell->IsEmpty()) {
+            return result;
+        }
+        const Cell::Value value = cell->GetValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            result.kind = SortValue::NUMBER;
+            result.number = *number;
+        } else if (const std::string* text = std::get_if<std::string>(&value)) {
+            result.kind = SortValue::TEXT;
+            result.text = *text;
+        } else {
+            result.kind = SortValue::ERROR;
+        }
+        return result;
+    }
+
+    // Возвращает знак сравнения lhs и rhs. Пустые значения больше любых других
+    // независимо от направления, ошибки равны между собой.
+    int CompareSortValues(const SortValue& lhs, const SortValue& rhs, bool ascending) {
+        if (lhs.kind == SortValue::EMPTY || rhs.kind == SortValue::EMPTY) {
+            return static_cast<int>(lhs.kind == SortValue::EMPTY) - static_cast<int>(rhs.kind == SortValue::EMPTY);
+        }
+        int result = 0;
+        if (lhs.kind != rhs.kind) {
+            result = lhs.kind < rhs.kind ? -1 : 1;
+        } else if (lhs.kind == SortValue::NUMBER) {
+            result = static_cast<int>(rhs.number < lhs.number) - static_cast<int>(lhs.number < rhs.number);
+        } else if (lhs.kind == SortValue::TEXT) {
+            const int cmp = lhs.text.compare(rhs.text);
+            result = static_cast<int>(cmp > 0) - static_cast<int>(cmp < 0);
+        }
+        return ascending ? result : -result;
+    }
+
+    // Записывает размер области и ключи сортировки для журнала: "rows cols col+ col- ..."
+    std::string EncodeSort(Size size, const std::vector<SortKey>& keys) {
+        std::string result = std::to_string(size.rows) + ' ' + std::to_string(size.cols);
+        for (const SortKey& key : keys) {
+            result += ' ' + std::to_string(key.col) + (key.ascending ? '+' : '-');
+        }
+        return result;
+    }
+
+    bool DecodeSort(const std::string& text, Size& size, std::vector<SortKey>& keys) {
+        std::istringstream input(text);
+        if (!(input >> size.rows >> size.cols)) {
+            return false;
+        }
+        SortKey key;
+        char direction = 0;
+        while (input >> key.col >> direction) {
+            if (direction != '+' && direction != '-') {
+                return false;
+            }
+            key.ascending = direction == '+';
+            keys.push_back(key);
+        }
+        return input.eof();
+    }
+
+    std::string EncodePermutation(int cols, const std::vector<int>& order) {
+        std::string result = std::to_string(cols);
+        for (int row : order) {
+            result += ' ' + std::to_string(row);
+        }
+        return result;
+    }
+
+    bool DecodePermutation(const std::string& text, int& cols, std::vector<int>& order) {
+        std::istringstream input(text);
+        if (!(input >> cols)) {
+            return false;
+        }
+        int row = 0;
+        while (input >> row) {
+            order.push_back(row);
+        }
+        // Перестановка проверяется, иначе повреждённая запись выведет за пределы области
+        std::vector<bool> seen(order.size());
+        for (int row : order) {
+            if (row < 0 || static_cast<size_t>(row) >= order.size() || seen[row]) {
+                return false;
+            }
+            seen[row] = true;
+        }
+        return input.eof();
+    }
+
+    // Пересечение областей или пустая область
+    Range Intersect(Range lhs, Range rhs) {
+        const int top = std::max(lhs.top_left.row, rhs.top_left.row);
+        const int left = std::max(lhs.top_left.col, rhs.top_left.col);
+        const int bottom = std::min(lhs.top_left.row + lhs.size.rows, rhs.top_left.row + rhs.size.rows);
+        const int right = std::min(lhs.top_left.col + lhs.size.cols, rhs.top_left.col + rhs.size.cols);
+        if (top >= bottom || left >= right) {
+            return {};
+        }
+        return { { top, left }, { bottom - top, right - left } };
+    }
+
+    // Объединяет соседние области строки в отрезки, а отрезки одинаковой
+    // ширины в соседних строках - в прямоугольники
+    std::vector<Range> CoalesceRanges(std::vector<Range> ranges) {
+        auto merge = [&ranges](auto less, auto mergeable) {
+            std::sort(ranges.begin(), ranges.end(), less);
+            size_t last = 0;
+            for (size_t i = 1; i < ranges.size(); ++i) {
+                if (!mergeable(ranges[last], ranges[i])) {
+                    ranges[++last] = ranges[i];
+                }
+            }
+            ranges.resize(ranges.empty() ? 0 : last + 1);
+        };
+        merge([](const Range& lhs, const Range& rhs) {
+            return std::tie(lhs.top_left.row, lhs.size.rows, lhs.top_left.col)
+                < std::tie(rhs.top_left.row, rhs.size.rows, rhs.top_left.col);
+        }, [](Range& cur, const Range& next) {
+            const int end = cur.top_left.col + cur.size.cols;
+            if (next.top_left.row != cur.top_left.row || next.size.rows != cur.size.rows || next.top_left.col > end) {
+                return false;
+            }
+            cur.size.cols = std::max(end, next.top_left.col + next.size.cols) - cur.top_left.col;
+            return true;
+        });
+        merge([](const Range& lhs, const Range& rhs) {
+            return std::tie(lhs.top_left.col, lhs.size.cols, lhs.top_left.row)
+                < std::tie(rhs.top_left.col, rhs.size.cols, rhs.top_left.row);
+        }, [](Range& cur, const Range& next) {
+            const int end = cur.top_left.row + cur.size.rows;
+            if (next.top_left.col != cur.top_left.col || next.size.cols != cur.size.cols || next.top_left.row > end) {
+                return false;
+            }
+            cur.size.rows = std::max(end, next.top_left.row + next.size.rows) - cur.top_left.row;
+            return true;
+        });
+        return ranges;
+    }
+
+    std::vector<int> InvertPermutation(const std::vector<int>& order) {
+        std::vector<int> inverse(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            inverse[order[i]] = static_cast<int>(i);
+        }
+        return inverse;
+    }
+
+}  // namespace
+
+SheetSnapshot::SheetSnapshot(CellGrid cells, std::shared_ptr<const IndexMap> rows, std::shared_ptr<const IndexMap> cols)
+    : cells_(std::move(cells))
+    , rows_(std::move(rows))
+    , cols_(std::move(cols)) {
+}
+
+const CellInterface* SheetSnapshot::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+
+    const Cell* cell = cells_.Find({ rows_->ToPhysical(pos.row), cols_->ToPhysical(pos.col) });
+    if (cell == nullptr || cell->IsEmpty()) {
+        return nullptr;
+    }
+
+    return cell;
+}
+
+size_t SheetSnapshot::ReadRange(Range range, const RangeBuffers& buffers) const {
+    CheckRange(range);
+    return ReadCells(cells_, *rows_, *cols_, range, buffers);
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+    return ComputePrintableSize(cells_, *rows_, *cols_);
+}
+
+void SheetSnapshot::PrintValues(std::ostream& output) const {
+    PrintTable(cells_, *rows_, *cols_, GetPrintableSize(), output, PrintCellValue);
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+    PrintTable(cells_, *rows_, *cols_, GetPrintableSize(), output, PrintCellText);
+}
+
 Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
+    SPREADSHEET_TRACE_SPAN("Sheet::SetCell");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::SetCell");
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
- 
-    cells_[pos].Set(text);
+
+    if (parsing_ == FormulaParsing::Lazy || IsInBatch()) {
+        // Формула не разбирается, но синтаксические ошибки сообщаются сразу
+        if (auto result = CheckCellText(text); !result.IsOk()) {
+            throw FormulaException("Formula syntax error at offset " + std::to_string(result.error_offset));
+        }
+    }
+    {
+        const CellLock lock = LockCell(pos, /* write = */ true);
+        if (AddToBatch(pos, text)) {
+            return;
+        }
+        ApplySet(pos, std::move(text));
+    }
+    CompactJournalAfterWrite();
+    NotifyChanges();
+}
+
+SetCellResult Sheet::TrySetCell(Position pos, std::string text) {
+    SPREADSHEET_TRACE_SPAN("Sheet::TrySetCell");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::TrySetCell");
+    if (!pos.IsValid()) {
+        return { CellStatus::InvalidPosition, 0 };
+    }
+
+    // Некорректную формулу отсекаем до ANTLR, чтобы не раскручивать стек исключением
+    if (auto result = CheckCellText(text); !result.IsOk()) {
+        return result;
+    }
+
+    try {
+        const CellLock lock = LockCell(pos, /* write = */ true);
+        if (AddToBatch(pos, text)) {
+            return {};
+        }
+        ApplySet(pos, std::move(text));
+    } catch (const FormulaException&) {
+        return { CellStatus::FormulaSyntaxError, 0 };
+    }
+    CompactJournalAfterWrite();
+    NotifyChanges();
+    return {};
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
+    SPREADSHEET_ALLOC_SCOPE("Sheet::GetCell");
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
-    
-    auto it = cells_.find(pos);
-    if (it == cells_.end()) {
-        return nullptr;
-    }
 
-    const Cell* cell = &cells_.at(pos);
-    if (cell->GetText().size() == 0) {
+    const CellLock lock = LockCell(pos, /* write = */ false);
+    const Cell* cell = FindCell(ToPhysical(pos));
+    if (cell == nullptr || cell->IsEmpty()) {
         return nullptr;
     }
 
@@ -39,17 +484,14 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
+    SPREADSHEET_ALLOC_SCOPE("Sheet::GetCell");
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
 
-    auto it = cells_.find(pos);
-    if (it == cells_.end()) {
-        return nullptr;
-    }
-
-    Cell* cell = &cells_.at(pos);
-    if (cell->GetText().size() == 0) {
+    const CellLock lock = LockCell(pos, /* write = */ true);
+    Cell* cell = FindCellForWrite(ToPhysical(pos));
+    if (cell == nullptr || cell->IsEmpty()) {
         return nullptr;
     }
 
@@ -57,71 +499,1312 @@ CellInterface* Sheet::GetCell(Position pos) {
 }
 
 void Sheet::ClearCell(Position pos) {
+    SPREADSHEET_TRACE_SPAN("Sheet::ClearCell");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::ClearCell");
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
 
-    cells_[pos].Clear();
+    {
+        const CellLock lock = LockCell(pos, /* write = */ true);
+        if (AddToBatch(pos, std::nullopt)) {
+            return;
+        }
+        ApplyClear(pos);
+    }
+    CompactJournalAfterWrite();
+    NotifyChanges();
 }
 
-Size Sheet::GetPrintableSize() const {
-    Size result{ 0, 0 };
-    
-    if (cells_.begin() == cells_.end()) {
-        return result;
+void Sheet::InsertRows(int before, int count) {
+    SPREADSHEET_TRACE_SPAN("Sheet::InsertRows");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::InsertRows");
+    if (before < 0 || before > Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("Invalid row insertion");
+    }
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplyStructural(Journal::Op::InsertRows, before, count);
     }
+    NotifyChanges();
+}
 
-    for (auto it = cells_.begin(); it != cells_.end(); ++it) {
-        if (it->second.GetText().size() == 0) continue;
-        const int col = it->first.col;
-        const int row = it->first.row;
+void Sheet::InsertCols(int before, int count) {
+    SPREADSHEET_TRACE_SPAN("Sheet::InsertCols");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::InsertCols");
+    if (before < 0 || before > Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("Invalid column insertion");
+    }
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplyStructural(Journal::Op::InsertCols, before, count);
+    }
+    NotifyChanges();
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    SPREADSHEET_TRACE_SPAN("Sheet::DeleteRows");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::DeleteRows");
+    if (first < 0 || first >= Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("Invalid row deletion");
+    }
+    // Удаляются только существующие строки: в истории и журнале хранится
+    // действительное число строк
+    count = std::min(count, Position::MAX_ROWS - first);
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplyStructural(Journal::Op::DeleteRows, first, count);
+    }
+    NotifyChanges();
+}
 
-        if (result.cols <= col) {
-            result.cols = col + 1;
+void Sheet::DeleteCols(int first, int count) {
+    SPREADSHEET_TRACE_SPAN("Sheet::DeleteCols");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::DeleteCols");
+    if (first < 0 || first >= Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("Invalid column deletion");
+    }
+    count = std::min(count, Position::MAX_COLS - first);
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplyStructural(Journal::Op::DeleteCols, first, count);
+    }
+    NotifyChanges();
+}
+
+void Sheet::SortRange(Range range, const std::vector<SortKey>& keys) {
+    SPREADSHEET_TRACE_SPAN("Sheet::SortRange");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::SortRange");
+    const Position& top_left = range.top_left;
+    if (!top_left.IsValid() || range.size.rows < 0 || range.size.cols < 0
+        || range.size.rows > Position::MAX_ROWS - top_left.row || range.size.cols > Position::MAX_COLS - top_left.col) {
+        throw InvalidPositionException("Invalid sort range");
+    }
+    for (const SortKey& key : keys) {
+        if (key.col < top_left.col || key.col >= top_left.col + range.size.cols) {
+            throw InvalidPositionException("Sort key is outside of the range");
         }
-        if (result.rows <= row) {
-            result.rows = row + 1;
+    }
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplySort(range, keys);
+    }
+    NotifyChanges();
+}
+
+void Sheet::MoveRows(int first, int count, int before) {
+    SPREADSHEET_TRACE_SPAN("Sheet::MoveRows");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::MoveRows");
+    if (first < 0 || count < 0 || first > Position::MAX_ROWS - count || before < 0 || before > Position::MAX_ROWS) {
+        throw InvalidPositionException("Invalid row move");
+    }
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplyMove(Journal::Op::MoveRows, first, count, before);
+    }
+    NotifyChanges();
+}
+
+void Sheet::MoveCols(int first, int count, int before) {
+    SPREADSHEET_TRACE_SPAN("Sheet::MoveCols");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::MoveCols");
+    if (first < 0 || count < 0 || first > Position::MAX_COLS - count || before < 0 || before > Position::MAX_COLS) {
+        throw InvalidPositionException("Invalid column move");
+    }
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        ApplyMove(Journal::Op::MoveCols, first, count, before);
+    }
+    NotifyChanges();
+}
+
+size_t Sheet::ReadRange(Range range, const RangeBuffers& buffers) const {
+    SPREADSHEET_TRACE_SPAN("Sheet::ReadRange");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::ReadRange");
+    CheckRange(range);
+    // В параллельном режиме снимок из файла уже перенесён в хранилище
+    // (SetConcurrentMode), поэтому чтение ничего не меняет
+    const ReadAllLock lock = LockAllForRead();
+    MaterializeAll();
+    return ReadCells(cells_, *rows_, *cols_, range, buffers);
+}
+
+// Чтение всей таблицы идёт по снимку: таблица блокируется только на время его создания
+Size Sheet::GetPrintableSize() const {
+    SPREADSHEET_TRACE_SPAN("Sheet::GetPrintableSize");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::GetPrintableSize");
+    {
+        const auto lock = LockExclusive();
+        if (base_) {
+            return GetPrintableSizeWithBase();
         }
     }
-    return { result.rows, result.cols };
+    return Snapshot().GetPrintableSize();
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for (int row = 0; row < size.rows; ++row) {
-        bool first = true;
-        for (int col = 0; col < size.cols; ++col) {
-            if (!first) {
-                output << "\t";
+    SPREADSHEET_TRACE_SPAN("Sheet::PrintValues");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::PrintValues");
+    Snapshot().PrintValues(output);
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    SPREADSHEET_TRACE_SPAN("Sheet::PrintTexts");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::PrintTexts");
+    Snapshot().PrintTexts(output);
+}
+
+ImportResult Sheet::ImportTexts(std::string_view data) {
+    SPREADSHEET_TRACE_SPAN("Sheet::ImportTexts");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::ImportTexts");
+    ImportResult result;
+    std::vector<TsvField> fields;
+    {
+        SPREADSHEET_TRACE_SPAN("Sheet::ImportTexts/split");
+        fields = SplitTsv(data);
+    }
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+
+        // Ячейки создаём параллельно: разбор формул - самая дорогая часть импорта
+        std::vector<std::optional<Cell>> cells(fields.size());
+        std::vector<SetCellResult> statuses(fields.size());
+        ParallelFor(fields.size(), [&](size_t begin, size_t end) {
+            SPREADSHEET_TRACE_SPAN("Sheet::ImportTexts/parse");
+            for (size_t i = begin; i < end; ++i) {
+                const TsvField& field = fields[i];
+                if (!field.pos.IsValid()) {
+                    statuses[i] = { CellStatus::InvalidPosition, 0 };
+                    continue;
+                }
+                statuses[i] = CheckCellText(field.text);
+                if (!statuses[i].IsOk()) {
+                    continue;
+                }
+                try {
+                    cells[i].emplace(std::string(field.text), parsing_, profiling_);
+                } catch (const FormulaException&) {
+                    statuses[i] = { CellStatus::FormulaSyntaxError, 0 };
+                }
             }
-            first = false;
-            Position pos = { row, col };
-            auto it = cells_.find(pos);
-            if (it != cells_.end()) {
-                auto value = cells_.at(pos).GetValue();
-                std::visit([&output](auto&& arg) {output << arg; }, value);
+        }, /* min_items_per_thread = */ 1024);
+
+        // Таблица не потокобезопасна, поэтому готовые ячейки переносим в неё в одном потоке
+        SPREADSHEET_TRACE_SPAN("Sheet::ImportTexts/apply");
+        const bool recording = IsRecording();
+        std::vector<CellDelta::Entry> old_cells;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (cells[i]) {
+                const Position physical = ToPhysical(fields[i].pos);
+                if (recording) {
+                    const Cell* old = FindCell(physical);
+                    old_cells.emplace_back(fields[i].pos, old != nullptr ? std::optional<Cell>(*old) : std::nullopt);
+                }
+                InsertCell(physical, std::move(*cells[i]));
+                AddCellChange(fields[i].pos);
+                if (journal_) {
+                    LogMutation(Journal::Op::SetCell, fields[i].pos, fields[i].text);
+                }
+                ++result.imported;
+            } else {
+                result.errors.emplace_back(fields[i].pos, statuses[i]);
             }
         }
-        output << "\n";
+        if (recording && !old_cells.empty()) {
+            UndoStep step;
+            step.cells = CellDelta(std::move(old_cells));
+            history_.Record(std::move(step));
+        }
     }
+    NotifyChanges();
+    return result;
 }
-void Sheet::PrintTexts(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for (int row = 0; row < size.rows; ++row) {
-        bool first = true;
-        for (int col = 0; col < size.cols; ++col) {
-            if (!first) {
-                output << "\t";
+
+ImportResult Sheet::ImportTextsFromFile(const std::string& filename) {
+    MappedFile file(filename);
+    return ImportTexts(file.GetData());
+}
+
+void Sheet::SetFormulaParsing(FormulaParsing parsing) {
+    const auto lock = LockExclusive();
+    parsing_ = parsing;
+}
+
+void Sheet::SetFormulaProfiling(bool enabled) {
+    const auto lock = LockExclusive();
+    profiling_ = enabled;
+}
+
+std::vector<FormulaProfileEntry> Sheet::GetSlowestFormulas(size_t count) const {
+    SPREADSHEET_TRACE_SPAN("Sheet::GetSlowestFormulas");
+    const auto lock = LockExclusive();
+    // Ячейки снимка, ещё не перенесённые в хранилище, созданы без профилирования
+    std::vector<std::pair<Position, FormulaCellProfile>> profiles;
+    cells_.ForEach([&profiles](Position pos, const Cell& cell) {
+        if (auto profile = cell.GetProfile()) {
+            profiles.emplace_back(pos, *profile);
+        }
+    });
+    count = std::min(count, profiles.size());
+    std::partial_sort(profiles.begin(), profiles.begin() + count, profiles.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second.GetTotalNs() > rhs.second.GetTotalNs();
+    });
+
+    std::vector<FormulaProfileEntry> result;
+    result.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const auto& [pos, profile] = profiles[i];
+        const Cell& cell = *cells_.Find(pos);
+        std::string expression;
+        try {
+            expression = cell.GetText();
+        } catch (const FormulaException&) {
+            // Отложенная формула с ошибкой разбора: оставляем пустой текст
+        }
+        result.push_back({ ToLogical(pos), std::move(expression), profile });
+    }
+    return result;
+}
+
+SheetSnapshot Sheet::Snapshot() const {
+    SPREADSHEET_TRACE_SPAN("Sheet::Snapshot");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::Snapshot");
+    const auto lock = LockExclusive();
+    // Снимок не может создавать ячейки из файла, поэтому переносим их заранее
+    MaterializeAll();
+    return SheetSnapshot(cells_, rows_, cols_);
+}
+
+void Sheet::Prepare() const {
+    SPREADSHEET_TRACE_SPAN("Sheet::Prepare");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::Prepare");
+    const auto lock = LockExclusive();
+    MaterializeAll();
+
+    std::vector<const Cell*> cells;
+    cells_.ForEach([&cells](Position, const Cell& cell) {
+        cells.push_back(&cell);
+    });
+    // Формулы независимы друг от друга, поэтому их можно разбирать параллельно
+    ParallelFor(cells.size(), [&cells](size_t begin, size_t end) {
+        SPREADSHEET_TRACE_SPAN("Sheet::Prepare/parse");
+        for (size_t i = begin; i < end; ++i) {
+            cells[i]->Prepare();
+        }
+    }, /* min_items_per_thread = */ 1024);
+}
+
+void Sheet::SaveSnapshot(const std::string& filename) const {
+    SPREADSHEET_TRACE_SPAN("Sheet::SaveSnapshot");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::SaveSnapshot");
+    const auto lock = LockExclusive();
+    SaveSnapshotLocked(filename);
+}
+
+void Sheet::SaveSnapshotLocked(const std::string& filename) const {
+    MaterializeAll();
+
+    std::vector<std::pair<Position, const Cell*>> cells;
+    cells_.ForEach([&](Position pos, const Cell& cell) {
+        cells.emplace_back(ToLogical(pos), &cell);
+    });
+    std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    SnapshotWriter writer;
+    for (const auto& [pos, cell] : cells) {
+        if (!cell->IsEmpty()) {
+            writer.AddCell(pos, cell->GetText(), cell->GetValue());
+        }
+    }
+
+    std::ofstream output(filename, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    writer.Write(output);
+    if (!output.flush()) {
+        throw std::runtime_error("Cannot write file: " + filename);
+    }
+}
+
+void Sheet::LoadSnapshot(const std::string& filename) {
+    SPREADSHEET_TRACE_SPAN("Sheet::LoadSnapshot");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::LoadSnapshot");
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        LoadSnapshotLocked(filename);
+    }
+    NotifyChanges();
+}
+
+void Sheet::LoadSnapshotLocked(const std::string& filename) {
+    auto base = std::make_shared<const SnapshotFile>(filename);
+    cells_.Clear();
+    for (auto& entries : row_entries_) {
+        entries = 0;
+    }
+    for (auto& entries : col_entries_) {
+        entries = 0;
+    }
+    rows_ = std::make_shared<IndexMap>(Position::MAX_ROWS);
+    cols_ = std::make_shared<IndexMap>(Position::MAX_COLS);
+    base_ = std::move(base);
+    base_shadowed_rows_.assign(Position::MAX_ROWS, 0);
+    base_shadowed_cols_.assign(Position::MAX_COLS, 0);
+    history_.Clear();
+    AddChange({ { 0, 0 }, { Position::MAX_ROWS, Position::MAX_COLS } });
+    if (concurrent_) {
+        // Параллельные записи не должны создавать ячейки из файла
+        MaterializeAll();
+    }
+}
+
+void Sheet::OpenJournal(const std::string& filename, JournalOptions options) {
+    SPREADSHEET_TRACE_SPAN("Sheet::OpenJournal");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::OpenJournal");
+    {
+        const auto lock = LockExclusive();
+        CheckNoBatch();
+        journal_.reset();
+        if (!options.snapshot_path.empty() && std::filesystem::exists(options.snapshot_path)) {
+            LoadSnapshotLocked(options.snapshot_path);
+        }
+        replaying_ = true;
+        try {
+            ReplayJournal(filename);
+        } catch (...) {
+            replaying_ = false;
+            throw;
+        }
+        replaying_ = false;
+        history_.Clear();
+        journal_ = std::make_unique<Journal>(filename, std::move(options));
+    }
+    NotifyChanges();
+}
+
+void Sheet::ReplayJournal(const std::string& filename) {
+    for (auto& record : Journal::ReadRecords(filename)) {
+        if (record.op == Journal::Op::SetCell) {
+            ApplySet(record.pos, std::move(record.text));
+        } else if (record.op == Journal::Op::ClearCell) {
+            ApplyClear(record.pos);
+        } else if (record.op == Journal::Op::SortRange) {
+            Range range{ record.pos, {} };
+            std::vector<SortKey> keys;
+            if (DecodeSort(record.text, range.size, keys)) {
+                ApplySort(range, keys);
+            }
+        } else if (record.op == Journal::Op::PermuteRows) {
+            int cols = 0;
+            std::vector<int> order;
+            if (DecodePermutation(record.text, cols, order)) {
+                ApplyPermute(record.pos, cols, order);
+            }
+        } else if (record.op == Journal::Op::MoveRows || record.op == Journal::Op::MoveCols) {
+            ApplyMove(record.op, record.pos.row, record.pos.col, record.before);
+        } else {
+            ApplyStructural(record.op, record.pos.row, record.pos.col);
+        }
+    }
+}
+
+void Sheet::CompactJournal() {
+    SPREADSHEET_ALLOC_SCOPE("Sheet::CompactJournal");
+    const auto lock = LockExclusive();
+    CompactJournalLocked();
+}
+
+void Sheet::CompactJournalLocked() {
+    SPREADSHEET_TRACE_SPAN("Sheet::CompactJournal");
+    if (!journal_ || journal_->GetOptions().snapshot_path.empty()) {
+        return;
+    }
+    // Снимок подменяется атомарно: после сбоя остаётся либо старый снимок с
+    // полным журналом, либо новый снимок, поверх которого журнал повторяется
+    // безвредно. Журнал усекается только после того, как переименование
+    // сброшено на диск вместе с каталогом
+    const std::string& path = journal_->GetOptions().snapshot_path;
+    const std::string temp_path = path + ".tmp";
+    SaveSnapshotLocked(temp_path);
+    SyncFileToDisk(temp_path);
+    std::filesystem::rename(temp_path, path);
+    SyncParentDirectory(path);
+    journal_->Truncate();
+}
+
+void Sheet::SyncJournal() {
+    const auto lock = LockShared();
+    if (journal_) {
+        journal_->Sync();
+    }
+}
+
+void Sheet::ApplySet(Position pos, std::string text) {
+    const Position physical = ToPhysical(pos);
+    const bool recording = IsRecording();
+    std::optional<Cell> old;
+    if (recording) {
+        if (const Cell* cell = FindCell(physical)) {
+            old = *cell;
+        }
+    }
+    Cell& cell = GetOrCreateCell(physical);
+    if (journal_) {
+        cell.Set(text, parsing_, profiling_);
+        LogMutation(Journal::Op::SetCell, pos, text);
+    } else {
+        cell.Set(std::move(text), parsing_, profiling_);
+    }
+    if (recording) {
+        RecordCellEdit(pos, std::move(old));
+    }
+    AddCellChange(pos);
+}
+
+void Sheet::ApplyClear(Position pos) {
+    if (Cell* cell = FindCellForWrite(ToPhysical(pos))) {
+        if (IsRecording()) {
+            RecordCellEdit(pos, *cell);
+        }
+        cell->Clear();
+    }
+    if (journal_) {
+        LogMutation(Journal::Op::ClearCell, pos);
+    }
+    AddCellChange(pos);
+}
+
+void Sheet::ApplyStructural(Journal::Op op, int first, int count) {
+    if (count == 0) {
+        return;
+    }
+    // Номера хранятся в отображениях только для существующих позиций ячеек
+    MaterializeAll();
+    UndoStep step;
+    const bool recording = IsRecording();
+    if (recording) {
+        step.op = op;
+        step.first = first;
+        step.count = count;
+        if (op == Journal::Op::DeleteRows || op == Journal::Op::DeleteCols) {
+            step.cells = CellDelta(CollectLines(op == Journal::Op::DeleteRows, first, count));
+        }
+    }
+    switch (op) {
+    case Journal::Op::InsertRows:
+        InsertLines(true, first, count);
+        break;
+    case Journal::Op::InsertCols:
+        InsertLines(false, first, count);
+        break;
+    case Journal::Op::DeleteRows:
+        DeleteLines(true, first, count);
+        break;
+    case Journal::Op::DeleteCols:
+        DeleteLines(false, first, count);
+        break;
+    default:
+        return;
+    }
+    if (recording) {
+        history_.Record(std::move(step));
+    }
+    // Сдвигаются все строки (столбцы) начиная с first
+    if (op == Journal::Op::InsertRows || op == Journal::Op::DeleteRows) {
+        AddChange({ { first, 0 }, { Position::MAX_ROWS - first, Position::MAX_COLS } });
+    } else {
+        AddChange({ { 0, first }, { Position::MAX_ROWS, Position::MAX_COLS - first } });
+    }
+    if (journal_) {
+        LogMutation(op, { first, count });
+    }
+}
+
+void Sheet::ApplyMove(Journal::Op op, int first, int count, int before) {
+    MaterializeAll();
+    GetMapForWrite(op == Journal::Op::MoveRows).Move(first, count, before);
+    if (IsRecording()) {
+        UndoStep step;
+        step.op = op;
+        step.first = first;
+        step.count = count;
+        step.before = before;
+        history_.Record(std::move(step));
+    }
+    const int low = std::min(first, before);
+    const int high = std::max(first + count, before);
+    if (op == Journal::Op::MoveRows) {
+        AddChange({ { low, 0 }, { high - low, Position::MAX_COLS } });
+    } else {
+        AddChange({ { 0, low }, { Position::MAX_ROWS, high - low } });
+    }
+    if (journal_) {
+        journal_->AppendMove(op, first, count, before);
+        CompactJournalIfNeeded();
+    }
+}
+
+void Sheet::ApplySort(Range range, const std::vector<SortKey>& keys) {
+    if (range.size.rows < 2 || range.size.cols == 0 || keys.empty()) {
+        return;
+    }
+    // После этого FindCell только читает таблицу и может вызываться из нескольких потоков
+    MaterializeAll();
+
+    const Position& top_left = range.top_left;
+    const size_t rows = static_cast<size_t>(range.size.rows);
+    // Ключевые столбцы извлекаются в непрерывные массивы: при сравнении не
+    // нужны ни поиск в хеш-таблице, ни вычисление формул
+    std::vector<std::vector<SortValue>> columns(keys.size(), std::vector<SortValue>(rows));
+    ParallelFor(rows, [&](size_t begin, size_t end) {
+        for (size_t k = 0; k < keys.size(); ++k) {
+            for (size_t i = begin; i < end; ++i) {
+                const Position pos{ top_left.row + static_cast<int>(i), keys[k].col };
+                columns[k][i] = MakeSortValue(FindCell(ToPhysical(pos)));
+            }
+        }
+    }, /* min_items_per_thread = */ 1024);
+
+    std::vector<int> order(rows);
+    std::iota(order.begin(), order.end(), 0);
+    ParallelStableSort(order, [&](int lhs, int rhs) {
+        for (size_t k = 0; k < keys.size(); ++k) {
+            if (const int cmp = CompareSortValues(columns[k][lhs], columns[k][rhs], keys[k].ascending)) {
+                return cmp < 0;
+            }
+        }
+        return false;
+    });
+
+    PermuteRows(top_left, range.size.cols, order);
+    if (journal_) {
+        LogMutation(Journal::Op::SortRange, top_left, EncodeSort(range.size, keys));
+    }
+    if (IsRecording()) {
+        UndoStep step;
+        step.op = Journal::Op::SortRange;
+        step.top_left = top_left;
+        step.cols = range.size.cols;
+        step.order = std::move(order);
+        history_.Record(std::move(step));
+    }
+}
+
+void Sheet::ApplyPermute(Position top_left, int cols, const std::vector<int>& order) {
+    MaterializeAll();
+    PermuteRows(top_left, cols, order);
+    if (journal_) {
+        LogMutation(Journal::Op::PermuteRows, top_left, EncodePermutation(cols, order));
+    }
+}
+
+void Sheet::PermuteRows(Position top_left, int cols, const std::vector<int>& order) {
+    const size_t rows = order.size();
+    AddChange({ top_left, { static_cast<int>(rows), cols } });
+    // Если строки области не содержат ячеек вне неё, достаточно переставить номера строк
+    const int first_col = top_left.col;
+    const int last_col = top_left.col + cols;
+    bool whole_rows = true;
+    for (int physical = 0; physical < Position::MAX_COLS && whole_rows; ++physical) {
+        const int logical = cols_->ToLogical(physical);
+        whole_rows = col_entries_[physical] == 0 || (logical >= first_col && logical < last_col);
+    }
+    if (whole_rows) {
+        GetMapForWrite(true).Permute(top_left.row, order);
+    } else {
+        for (int col = first_col; col < last_col; ++col) {
+            std::vector<std::optional<Cell>> column(rows);
+            for (size_t i = 0; i < rows; ++i) {
+                const Position physical = ToPhysical({ top_left.row + static_cast<int>(i), col });
+                column[i] = cells_.Extract(physical);
+                if (column[i]) {
+                    --row_entries_[physical.row];
+                    --col_entries_[physical.col];
+                }
+            }
+            for (size_t i = 0; i < rows; ++i) {
+                if (auto& cell = column[order[i]]) {
+                    InsertCell(ToPhysical({ top_left.row + static_cast<int>(i), col }), std::move(*cell));
+                }
+            }
+        }
+    }
+}
+
+void Sheet::InsertLines(bool rows, int before, int count) {
+    IndexMap& map = GetMapForWrite(rows);
+    const int size = map.GetSize();
+    if (count > size) {
+        throw TableTooBigException("Table is too big");
+    }
+    // Номера, вытесняемые за конец таблицы, станут номерами вставленных строк
+    std::vector<int> displaced;
+    for (int logical = std::max(before, size - count); logical < size; ++logical) {
+        displaced.push_back(map.ToPhysical(logical));
+    }
+    EraseLines(rows, displaced, /* require_empty = */ true);
+    map.Insert(before, count);
+}
+
+void Sheet::DeleteLines(bool rows, int first, int count) {
+    IndexMap& map = GetMapForWrite(rows);
+    EraseLines(rows, map.Erase(first, count), /* require_empty = */ false);
+}
+
+void Sheet::EraseLines(bool rows, const std::vector<int>& lines, bool require_empty) {
+    auto& entries = rows ? row_entries_ : col_entries_;
+    std::vector<bool> marked(entries.size());
+    bool any = false;
+    for (int line : lines) {
+        if (entries[line] > 0) {
+            marked[line] = true;
+            any = true;
+        }
+    }
+    // Обычно строки пусты, и хранилище не просматривается вовсе
+    if (!any) {
+        return;
+    }
+
+    auto is_marked = [&](Position pos) {
+        return marked[rows ? pos.row : pos.col];
+    };
+    if (require_empty) {
+        bool occupied = false;
+        cells_.ForEach([&](Position pos, const Cell& cell) {
+            occupied = occupied || (is_marked(pos) && !cell.IsEmpty());
+        });
+        if (occupied) {
+            throw TableTooBigException("Table is too big");
+        }
+    }
+    for (Position pos : cells_.EraseIf([&](Position pos, const Cell&) { return is_marked(pos); })) {
+        --row_entries_[pos.row];
+        --col_entries_[pos.col];
+    }
+}
+
+Position Sheet::ToPhysical(Position pos) const {
+    return { rows_->ToPhysical(pos.row), cols_->ToPhysical(pos.col) };
+}
+
+Position Sheet::ToLogical(Position pos) const {
+    return { rows_->ToLogical(pos.row), cols_->ToLogical(pos.col) };
+}
+
+IndexMap& Sheet::GetMapForWrite(bool rows) {
+    std::shared_ptr<IndexMap>& map = rows ? rows_ : cols_;
+    if (map.use_count() > 1) {
+        map = std::make_shared<IndexMap>(*map);
+    }
+    return *map;
+}
+
+Cell& Sheet::GetOrCreateCell(Position physical) {
+    if (Cell* cell = FindCellForWrite(physical)) {
+        return *cell;
+    }
+    return InsertCell(physical, Cell());
+}
+
+Cell& Sheet::InsertCell(Position physical, Cell cell) const {
+    auto [result, inserted] = cells_.InsertOrAssign(physical, std::move(cell));
+    if (inserted) {
+        ++row_entries_[physical.row];
+        ++col_entries_[physical.col];
+        // Ячейка перекрывает запись снимка, и та больше не входит в размер таблицы
+        if (base_ && base_->Find(physical) != nullptr) {
+            ++base_shadowed_rows_[physical.row];
+            ++base_shadowed_cols_[physical.col];
+        }
+    }
+    return *result;
+}
+
+void Sheet::LogMutation(Journal::Op op, Position pos, std::string_view text) {
+    journal_->Append(op, pos, text);
+    CompactJournalIfNeeded();
+}
+
+bool Sheet::IsCompactionDue() const {
+    const size_t compact_after = journal_->GetOptions().compact_after_records;
+    return compact_after > 0 && journal_->GetRecordCount() >= compact_after;
+}
+
+void Sheet::CompactJournalIfNeeded() {
+    // Под общей блокировкой сжимать нельзя, это сделает CompactJournalAfterWrite()
+    if (!concurrent_ && IsCompactionDue()) {
+        CompactJournalLocked();
+    }
+}
+
+void Sheet::CompactJournalAfterWrite() {
+    if (!concurrent_ || !journal_ || !IsCompactionDue()) {
+        return;
+    }
+    const auto lock = LockExclusive();
+    if (IsCompactionDue()) {
+        CompactJournalLocked();
+    }
+}
+
+void Sheet::BeginBatch() {
+    const auto lock = LockExclusive();
+    if (batch_) {
+        throw BatchException("Batch is already open");
+    }
+    batch_.emplace();
+}
+
+void Sheet::Commit() {
+    SPREADSHEET_TRACE_SPAN("Sheet::Commit");
+    SPREADSHEET_ALLOC_SCOPE("Sheet::Commit");
+    {
+        const auto lock = LockExclusive();
+        if (!batch_) {
+            throw BatchException("No open batch");
+        }
+        std::vector<BatchEdit> edits = std::move(*batch_);
+        batch_.reset();
+
+        // Сортируем изменения по плиткам, чтобы каждая плитка отделялась от снимков
+        // и просматривалась один раз; из изменений одной ячейки остаётся последнее
+        MaterializeAll();
+        std::vector<std::pair<Position, size_t>> order;
+        order.reserve(edits.size());
+        for (size_t i = 0; i < edits.size(); ++i) {
+            order.emplace_back(ToPhysical(edits[i].pos), i);
+        }
+        std::sort(order.begin(), order.end(), [](const auto& lhs, const auto& rhs) {
+            const int lhs_tile = CellGrid::GetTileIndex(lhs.first);
+            const int rhs_tile = CellGrid::GetTileIndex(rhs.first);
+            if (lhs_tile != rhs_tile) {
+                return lhs_tile < rhs_tile;
+            }
+            return lhs.first == rhs.first ? lhs.second < rhs.second : lhs.first < rhs.first;
+        });
+        size_t last = 0;
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (i + 1 == order.size() || !(order[i + 1].first == order[i].first)) {
+                order[last++] = order[i];
+            }
+        }
+        order.resize(last);
+
+        // Формулы разбираем параллельно до изменения таблицы, чтобы ошибка в любой
+        // из них оставила таблицу нетронутой
+        std::vector<std::optional<Cell>> cells(order.size());
+        std::atomic<bool> failed = false;
+        ParallelFor(order.size(), [&](size_t begin, size_t end) {
+            SPREADSHEET_TRACE_SPAN("Sheet::Commit/parse");
+            for (size_t i = begin; i < end && !failed; ++i) {
+                BatchEdit& edit = edits[order[i].second];
+                if (!edit.text) {
+                    continue;
+                }
+                try {
+                    // Текст ещё нужен журналу
+                    cells[i].emplace(journal_ ? *edit.text : std::move(*edit.text), parsing_, profiling_);
+                } catch (const FormulaException&) {
+                    failed = true;
+                }
+            }
+        }, /* min_items_per_thread = */ 1024);
+        if (failed) {
+            throw FormulaException("Formula syntax error in batch");
+        }
+
+        std::vector<Journal::Record> records;
+        if (journal_) {
+            records.reserve(order.size());
+        }
+        const bool recording = IsRecording();
+        std::vector<CellDelta::Entry> old_cells;
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Position physical = order[i].first;
+            BatchEdit& edit = edits[order[i].second];
+            if (recording) {
+                const Cell* old = cells_.Find(physical);
+                old_cells.emplace_back(edit.pos, old != nullptr ? std::optional<Cell>(*old) : std::nullopt);
+            }
+            if (cells[i]) {
+                InsertCell(physical, std::move(*cells[i]));
+            } else if (Cell* cell = FindCellForWrite(physical)) {
+                cell->Clear();
+            }
+            AddCellChange(edit.pos);
+            if (journal_) {
+                const Journal::Op op = edit.text ? Journal::Op::SetCell : Journal::Op::ClearCell;
+                records.push_back({ op, edit.pos, edit.text ? std::move(*edit.text) : std::string() });
+            }
+        }
+        if (recording && !old_cells.empty()) {
+            UndoStep step;
+            step.cells = CellDelta(std::move(old_cells));
+            history_.Record(std::move(step));
+        }
+        if (journal_) {
+            journal_->AppendBatch(records);
+            if (IsCompactionDue()) {
+                CompactJournalLocked();
+            }
+        }
+    }
+    NotifyChanges();
+}
+
+void Sheet::Rollback() {
+    const auto lock = LockExclusive();
+    if (!batch_) {
+        throw BatchException("No open batch");
+    }
+    batch_.reset();
+}
+
+bool Sheet::IsInBatch() const {
+    const auto lock = LockShared();
+    return batch_.has_value();
+}
+
+bool Sheet::AddToBatch(Position pos, std::optional<std::string> text) {
+    if (!batch_) {
+        return false;
+    }
+    const std::lock_guard lock(batch_mutex_);
+    batch_->push_back({ pos, std::move(text) });
+    return true;
+}
+
+void Sheet::CheckNoBatch() const {
+    if (batch_) {
+        throw BatchException("Operation is not allowed inside a batch");
+    }
+}
+
+void Sheet::EnableUndo(UndoOptions options) {
+    const auto lock = LockExclusive();
+    history_.Enable(options);
+}
+
+void Sheet::DisableUndo() {
+    const auto lock = LockExclusive();
+    history_.Disable();
+}
+
+bool Sheet::Undo() {
+    SPREADSHEET_ALLOC_SCOPE("Sheet::Undo");
+    const bool applied = ApplyHistoryStep(/* undo = */ true);
+    NotifyChanges();
+    return applied;
+}
+
+bool Sheet::Redo() {
+    SPREADSHEET_ALLOC_SCOPE("Sheet::Redo");
+    const bool applied = ApplyHistoryStep(/* undo = */ false);
+    NotifyChanges();
+    return applied;
+}
+
+bool Sheet::ApplyHistoryStep(bool undo) {
+    SPREADSHEET_TRACE_SPAN("Sheet::ApplyHistoryStep");
+    const auto lock = LockExclusive();
+    CheckNoBatch();
+    std::optional<UndoStep> step = undo ? history_.TakeUndo() : history_.TakeRedo();
+    if (!step) {
+        return false;
+    }
+    ApplyStep(*step, undo);
+    if (undo) {
+        history_.PutRedo(std::move(*step));
+    } else {
+        history_.PutUndo(std::move(*step));
+    }
+    return true;
+}
+
+SheetMemoryStats Sheet::GetMemoryStats() const {
+    SPREADSHEET_TRACE_SPAN("Sheet::GetMemoryStats");
+    const auto lock = LockExclusive();
+    SheetMemoryStats stats;
+    stats.grid = cells_.GetMemoryStats();
+    stats.line_bytes = rows_->GetMemoryUsage() + cols_->GetMemoryUsage()
+        + (row_entries_.size() + col_entries_.size()) * sizeof(std::atomic<uint32_t>);
+    stats.undo_bytes = history_.GetMemoryUsage();
+    if (base_) {
+        stats.mapped_snapshot_bytes = base_->GetFileSize();
+    }
+    return stats;
+}
+
+bool Sheet::CanUndo() const {
+    return history_.CanUndo();
+}
+
+bool Sheet::CanRedo() const {
+    return history_.CanRedo();
+}
+
+bool Sheet::IsRecording() const {
+    return history_.IsEnabled() && !replaying_;
+}
+
+void Sheet::RecordCellEdit(Position pos, std::optional<Cell> old) {
+    UndoStep step;
+    step.cells = CellDelta({ { pos, std::move(old) } });
+    step.coalesce_pos = pos;
+    history_.Record(std::move(step));
+}
+
+std::vector<CellDelta::Entry> Sheet::CollectLines(bool rows, int first, int count) const {
+    std::vector<CellDelta::Entry> cells;
+    cells_.ForEach([&](Position physical, const Cell& cell) {
+        const Position pos = ToLogical(physical);
+        const int line = rows ? pos.row : pos.col;
+        if (line >= first && line - first < count) {
+            cells.emplace_back(pos, cell);
+        }
+    });
+    return cells;
+}
+
+void Sheet::ApplyStep(UndoStep& step, bool undo) {
+    MaterializeAll();
+    replaying_ = true;
+    try {
+        switch (step.op) {
+        case Journal::Op::InsertRows:
+        case Journal::Op::InsertCols: {
+            const auto inverse = step.op == Journal::Op::InsertRows ? Journal::Op::DeleteRows : Journal::Op::DeleteCols;
+            ApplyStructural(undo ? inverse : step.op, step.first, step.count);
+            break;
+        }
+        case Journal::Op::DeleteRows:
+        case Journal::Op::DeleteCols: {
+            // Удалённые строки пусты, поэтому ячейки возвращаются обменом с пустыми позициями
+            const auto inverse = step.op == Journal::Op::DeleteRows ? Journal::Op::InsertRows : Journal::Op::InsertCols;
+            if (undo) {
+                ApplyStructural(inverse, step.first, step.count);
+                SwapCells(step.cells);
+            } else {
+                SwapCells(step.cells);
+                ApplyStructural(step.op, step.first, step.count);
+            }
+            break;
+        }
+        case Journal::Op::MoveRows:
+        case Journal::Op::MoveCols: {
+            const int size = step.op == Journal::Op::MoveRows ? Position::MAX_ROWS : Position::MAX_COLS;
+            const int count = std::min(step.count, size - step.first);
+            if (!undo) {
+                ApplyMove(step.op, step.first, step.count, step.before);
+            } else if (step.before < step.first) {
+                ApplyMove(step.op, step.before, count, step.first + count);
+            } else {
+                ApplyMove(step.op, step.before - count, count, step.first);
+            }
+            break;
+        }
+        case Journal::Op::SortRange:
+            ApplyPermute(step.top_left, step.cols, undo ? InvertPermutation(step.order) : step.order);
+            break;
+        default:
+            SwapCells(step.cells);
+            if (journal_ && IsCompactionDue()) {
+                CompactJournalLocked();
+            }
+            break;
+        }
+    } catch (...) {
+        replaying_ = false;
+        throw;
+    }
+    replaying_ = false;
+}
+
+void Sheet::SwapCells(CellDelta& delta) {
+    std::vector<Journal::Record> records;
+    delta.ForEach([&](Position pos, std::optional<Cell>& stored) {
+        const Position physical = ToPhysical(pos);
+        AddCellChange(pos);
+        if (journal_) {
+            if (stored && !stored->IsEmpty()) {
+                records.push_back({ Journal::Op::SetCell, pos, stored->GetText() });
+            } else {
+                records.push_back({ Journal::Op::ClearCell, pos, {} });
+            }
+        }
+        // Ячейка, оставшаяся на месте, меняется без перестройки хранилища, и
+        // указатели на неё из GetCell() остаются действительными
+        if (Cell* current = cells_.FindForWrite(physical); current != nullptr && stored) {
+            std::swap(*current, *stored);
+            return;
+        }
+        std::optional<Cell> current = cells_.Extract(physical);
+        if (current) {
+            --row_entries_[physical.row];
+            --col_entries_[physical.col];
+        }
+        if (stored) {
+            InsertCell(physical, std::move(*stored));
+        }
+        stored = std::move(current);
+    });
+    if (journal_) {
+        journal_->AppendBatch(records);
+    }
+}
+
+SubscriptionId Sheet::Subscribe(Range region, ChangeListener listener) {
+    if (!region.top_left.IsValid() || region.size.rows < 0 || region.size.cols < 0) {
+        throw InvalidPositionException("Invalid subscription region");
+    }
+    const auto lock = LockExclusive();
+    const SubscriptionId id = next_subscription_id_++;
+    subscriptions_.emplace(id, Subscription{ region, std::make_shared<const ChangeListener>(std::move(listener)) });
+    return id;
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    const auto lock = LockExclusive();
+    subscriptions_.erase(id);
+}
+
+void Sheet::AddChange(Range range) {
+    // Без подписчиков изменения не копятся; подписчики меняются только монопольно
+    if (subscriptions_.empty() || range.size.rows <= 0 || range.size.cols <= 0) {
+        return;
+    }
+    const std::lock_guard lock(changes_mutex_);
+    changes_.push_back(range);
+    has_changes_ = true;
+}
+
+void Sheet::AddCellChange(Position pos) {
+    AddChange({ pos, { 1, 1 } });
+}
+
+void Sheet::NotifyChanges() {
+    SPREADSHEET_TRACE_SPAN("Sheet::NotifyChanges");
+    if (!has_changes_) {
+        return;
+    }
+    // Изменения, сделанные подписчиком, доставляет внешний вызов: он уже
+    // держит delivery_mutex_ и повторит цикл
+    thread_local std::vector<const Sheet*> delivering;
+    if (std::find(delivering.begin(), delivering.end(), this) != delivering.end()) {
+        return;
+    }
+    const std::lock_guard delivery_lock(delivery_mutex_);
+    delivering.push_back(this);
+    struct DeliveringGuard {
+        ~DeliveringGuard() {
+            delivering.pop_back();
+        }
+    } guard;
+
+    while (true) {
+        std::vector<Range> changes;
+        std::optional<SheetSnapshot> snapshot;
+        std::vector<Subscription> subscriptions;
+        {
+            // Изменения и снимок берутся вместе, поэтому снимок содержит ровно
+            // доставляемые изменения
+            const auto lock = LockExclusive();
+            {
+                const std::lock_guard changes_lock(changes_mutex_);
+                changes.swap(changes_);
+                has_changes_ = false;
+            }
+            if (changes.empty() || subscriptions_.empty()) {
+                return;
             }
-            first = false;
-            Position pos = { row, col };
-            auto it = cells_.find(pos);
-            if (it != cells_.end()) {
-                output << cells_.at(pos).GetText();
+            MaterializeAll();
+            snapshot.emplace(SheetSnapshot(cells_, rows_, cols_));
+            for (const auto& [id, subscription] : subscriptions_) {
+                subscriptions.push_back(subscription);
             }
         }
-        output << "\n";
+
+        changes = CoalesceRanges(std::move(changes));
+        for (const Subscription& subscription : subscriptions) {
+            ChangeSet change_set;
+            for (const Range& range : changes) {
+                const Range visible = Intersect(range, subscription.region);
+                if (visible.size.rows > 0) {
+                    change_set.ranges.push_back(visible);
+                }
+            }
+            if (!change_set.ranges.empty()) {
+                (*subscription.listener)(change_set, *snapshot);
+            }
+        }
+    }
+}
+
+void Sheet::SetConcurrentMode(bool enabled) {
+    MaterializeAll();
+    concurrent_ = enabled;
+}
+
+Sheet::CellLock Sheet::LockCell(Position pos, bool write) const {
+    CellLock lock;
+    if (!concurrent_) {
+        return lock;
+    }
+    lock.structure = std::shared_lock(structure_mutex_);
+    Position physical = ToPhysical(pos);
+    // Отделять плитку от снимков и создавать её нужно монопольно, зато потом
+    // записи в неё меняют только её содержимое
+    while (write && !cells_.IsWritable(physical)) {
+        lock.structure.unlock();
+        {
+            const std::unique_lock exclusive(structure_mutex_);
+            cells_.PrepareForWrite(ToPhysical(pos));
+        }
+        lock.structure.lock();
+        physical = ToPhysical(pos);
+    }
+    auto& stripe = stripes_[GetStripeIndex(physical)].mutex;
+    if (write) {
+        lock.stripe = std::unique_lock(stripe);
+    } else {
+        lock.shared_stripe = std::shared_lock(stripe);
+    }
+    return lock;
+}
+
+Sheet::ReadAllLock Sheet::LockAllForRead() const {
+    ReadAllLock lock;
+    if (!concurrent_) {
+        return lock;
+    }
+    lock.structure = std::shared_lock(structure_mutex_);
+    // Записи держат одну полосу, поэтому захват полос по порядку не взаимоблокируется
+    for (size_t i = 0; i < LOCK_STRIPES; ++i) {
+        lock.stripes[i] = std::shared_lock(stripes_[i].mutex);
+    }
+    return lock;
+}
+
+std::shared_lock<Sheet::StructureMutex> Sheet::LockShared() const {
+    if (!concurrent_) {
+        return {};
+    }
+    return std::shared_lock(structure_mutex_);
+}
+
+std::unique_lock<Sheet::StructureMutex> Sheet::LockExclusive() const {
+    if (!concurrent_) {
+        return {};
+    }
+    return std::unique_lock(structure_mutex_);
+}
+
+size_t Sheet::GetStripeIndex(Position physical) {
+    // Номер плитки по модулю LOCK_STRIPES зависел бы только от столбца плитки
+    // (TILE_COLS кратно LOCK_STRIPES), и все полосы строк одного блока
+    // столбцов делили бы блокировку. Номер полосы подмешивается к столбцу
+    const auto tile_row = static_cast<size_t>(physical.row / CellGrid::TILE_SIZE);
+    const auto tile_col = static_cast<size_t>(physical.col / CellGrid::TILE_SIZE);
+    return (tile_col ^ tile_row) % LOCK_STRIPES;
+}
+
+void Sheet::StructureMutex::lock() {
+    for (PaddedMutex& slot : slots_) {
+        slot.mutex.lock();
+    }
+}
+
+void Sheet::StructureMutex::unlock() {
+    for (PaddedMutex& slot : slots_) {
+        slot.mutex.unlock();
+    }
+}
+
+void Sheet::StructureMutex::lock_shared() {
+    slots_[GetThreadSlot() % SLOTS].mutex.lock_shared();
+}
+
+void Sheet::StructureMutex::unlock_shared() {
+    slots_[GetThreadSlot() % SLOTS].mutex.unlock_shared();
+}
+
+const Cell* Sheet::FindCell(Position pos) const {
+    if (const Cell* cell = cells_.Find(pos)) {
+        return cell;
+    }
+    // Ячейки снимка создаются при первом обращении к ним
+    if (base_) {
+        if (const auto* record = base_->Find(pos)) {
+            return &InsertCell(pos, base_->MakeCell(*record));
+        }
+    }
+    return nullptr;
+}
+
+Cell* Sheet::FindCellForWrite(Position pos) {
+    if (FindCell(pos) == nullptr) {
+        return nullptr;
+    }
+    return cells_.FindForWrite(pos);
+}
+
+void Sheet::MaterializeAll() const {
+    if (!base_) {
+        return;
+    }
+    // Снимок освобождается заранее: переносимым ячейкам не нужен учёт перекрытий
+    const std::shared_ptr<const SnapshotFile> base = std::move(base_);
+    base_shadowed_rows_ = {};
+    base_shadowed_cols_ = {};
+    // Ячейки, уже заданные или очищенные после загрузки, перекрывают снимок
+    for (size_t i = 0; i < base->GetCellCount(); ++i) {
+        const auto& record = base->GetRecord(i);
+        const Position pos{ record.row, record.col };
+        if (cells_.Find(pos) == nullptr) {
+            InsertCell(pos, base->MakeCell(record));
+        }
+    }
+}
+
+Size Sheet::GetPrintableSizeWithBase() const {
+    // Пока снимок есть, логические номера совпадают с физическими. Перекрытые
+    // записи учтены в размере по ячейкам cells_ (если ячейка не пуста)
+    Size size = ComputePrintableSize(cells_, *rows_, *cols_);
+    for (int row = Position::MAX_ROWS - 1; row >= size.rows; --row) {
+        if (base_->GetRowCellCount(row) > base_shadowed_rows_[row]) {
+            size.rows = row + 1;
+            break;
+        }
+    }
+    for (int col = Position::MAX_COLS - 1; col >= size.cols; --col) {
+        if (base_->GetColCellCount(col) > base_shadowed_cols_[col]) {
+            size.cols = col + 1;
+            break;
+        }
+    }
+    return size;
+}
+
+SetCellResult Sheet::CheckCellText(std::string_view text) {
+    if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+        if (auto offset = CheckFormulaSyntax(text.substr(1))) {
+            return { CellStatus::FormulaSyntaxError, *offset + 1 };
+        }
     }
+    return {};
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -0,0 +1,168 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+using namespace snapshot_format;
+
+namespace {
+
+    // Размер секции, дополненный до границы в 8 байт
+    uint64_t Align(uint64_t size) {
+        return (size + 7) & ~uint64_t{ 7 };
+    }
+
+    void WritePadding(std::ostream& output, uint64_t size) {
+        static const char zeros[8] = {};
+        output.write(zeros, static_cast<std::streamsize>(Align(size) - size));
+    }
+
+    bool IsFormulaText(std::string_view text) {
+        return text.size() > 1 && text[0] == FORMULA_SIGN;
+    }
+
+}  // namespace
+
+void SnapshotWriter::AddCell(Position pos, std::string_view text, const CellInterface::Value& value) {
+    CellRecord record{};
+    record.row = pos.row;
+    record.col = pos.col;
+    record.text_id = Intern(text);
+    record.kind = IsFormulaText(text) ? CK_FORMULA : CK_TEXT;
+    record.value_kind = VK_NONE;
+    if (record.kind == CK_FORMULA) {
+        if (std::holds_alternative<double>(value)) {
+            record.value_kind = VK_NUMBER;
+            record.number = std::get<double>(value);
+        } else {
+            record.value_kind = VK_ERROR;
+            record.error_id = Intern(std::get<FormulaError>(value).what());
+        }
+    }
+    cells_.push_back(record);
+}
+
+uint32_t SnapshotWriter::Intern(std::string_view str) {
+    auto [it, inserted] = string_ids_.emplace(std::string(str), static_cast<uint32_t>(strings_.size()));
+    if (inserted) {
+        strings_.push_back(it->first);
+    }
+    return it->second;
+}
+
+void SnapshotWriter::Write(std::ostream& output) const {
+    std::vector<uint64_t> offsets;
+    offsets.reserve(strings_.size() + 1);
+    uint64_t string_bytes = 0;
+    for (const auto& str : strings_) {
+        offsets.push_back(string_bytes);
+        string_bytes += str.size();
+    }
+    offsets.push_back(string_bytes);
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.cell_count = cells_.size();
+    header.string_count = strings_.size();
+    header.cells_offset = sizeof(Header);
+    header.string_offsets_offset = header.cells_offset + cells_.size() * sizeof(CellRecord);
+    header.string_data_offset = header.string_offsets_offset + offsets.size() * sizeof(uint64_t);
+
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(cells_.data()),
+                 static_cast<std::streamsize>(cells_.size() * sizeof(CellRecord)));
+    output.write(reinterpret_cast<const char*>(offsets.data()),
+                 static_cast<std::streamsize>(offsets.size() * sizeof(uint64_t)));
+    for (const auto& str : strings_) {
+        output.write(str.data(), static_cast<std::streamsize>(str.size()));
+    }
+    WritePadding(output, string_bytes);
+}
+
+SnapshotFile::SnapshotFile(const std::string& filename)
+    : file_(filename) {
+    const std::string_view data = file_.GetData();
+    if (data.size() < sizeof(Header)) {
+        throw SnapshotException("Snapshot is truncated: " + filename);
+    }
+
+    Header header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw SnapshotException("Not a sheet snapshot: " + filename);
+    }
+    if (header.version != VERSION || header.byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotException("Unsupported snapshot version or byte order: " + filename);
+    }
+
+    // Проверяем, что все секции лежат внутри файла и не перекрываются
+    const uint64_t size = data.size();
+    const bool layout_ok = header.cells_offset == sizeof(Header)
+        && header.cell_count <= (size - header.cells_offset) / sizeof(CellRecord)
+        && header.string_offsets_offset == header.cells_offset + header.cell_count * sizeof(CellRecord)
+        && header.string_count < (size - header.string_offsets_offset) / sizeof(uint64_t)
+        && header.string_data_offset == header.string_offsets_offset + (header.string_count + 1) * sizeof(uint64_t)
+        && header.string_data_offset <= size;
+    if (!layout_ok) {
+        throw SnapshotException("Snapshot layout is corrupted: " + filename);
+    }
+
+    cells_ = reinterpret_cast<const CellRecord*>(data.data() + header.cells_offset);
+    cell_count_ = static_cast<size_t>(header.cell_count);
+    string_offsets_ = reinterpret_cast<const uint64_t*>(data.data() + header.string_offsets_offset);
+    string_count_ = static_cast<size_t>(header.string_count);
+    string_data_ = data.substr(static_cast<size_t>(header.string_data_offset));
+    if (string_offsets_[string_count_] > string_data_.size()) {
+        throw SnapshotException("Snapshot string table is corrupted: " + filename);
+    }
+
+    // Позиции записей индексируют хранилище таблицы, а поиск записи двоичный,
+    // поэтому позиции проверяются и считаются по строкам и столбцам сразу
+    row_cells_.assign(Position::MAX_ROWS, 0);
+    col_cells_.assign(Position::MAX_COLS, 0);
+    for (size_t i = 0; i < cell_count_; ++i) {
+        const Position pos{ cells_[i].row, cells_[i].col };
+        if (!pos.IsValid()) {
+            throw SnapshotException("Snapshot cell position is invalid: " + filename);
+        }
+        if (i > 0 && !(Position{ cells_[i - 1].row, cells_[i - 1].col } < pos)) {
+            throw SnapshotException("Snapshot cells are not sorted: " + filename);
+        }
+        ++row_cells_[pos.row];
+        ++col_cells_[pos.col];
+    }
+}
+
+const CellRecord* SnapshotFile::Find(Position pos) const {
+    const CellRecord* end = cells_ + cell_count_;
+    const CellRecord* it = std::lower_bound(cells_, end, pos, [](const CellRecord& record, Position pos) {
+        return Position{ record.row, record.col } < pos;
+    });
+    if (it == end || it->row != pos.row || it->col != pos.col) {
+        return nullptr;
+    }
+    return it;
+}
+
+Cell SnapshotFile::MakeCell(const CellRecord& record) const {
+    std::string text(GetString(record.text_id));
+    if (record.kind != CK_FORMULA) {
+        return Cell(std::move(text));
+    }
+    if (record.value_kind == VK_NUMBER) {
+        return Cell(std::move(text), record.number);
+    }
+    return Cell(std::move(text), FormulaError(std::string(GetString(record.error_id))));
+}
+
+std::string_view SnapshotFile::GetString(uint32_t id) const {
+    if (id >= string_count_ || string_offsets_[id] > string_offsets_[id + 1]
+        || string_offsets_[id + 1] > string_data_.size()) {
+        throw SnapshotException("Snapshot string table is corrupted");
+    }
+    return string_data_.substr(static_cast<size_t>(string_offsets_[id]),
+                               static_cast<size_t>(string_offsets_[id + 1] - string_offsets_[id]));
+}
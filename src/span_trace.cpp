@@ -0,0 +1,234 @@
+#include "span_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+    // Интервал в буфере. Поля атомарные, чтобы запись трассы не была гонкой
+    // данных с потоком, который в этот момент завершает интервал
+    struct Slot {
+        std::atomic<const char*> name{ nullptr };
+        std::atomic<uint64_t> start{ 0 };
+        std::atomic<uint64_t> finish{ 0 };
+    };
+
+    // Кольцевой буфер одного потока; пишет в него только владелец. Слоты
+    // выделяются частями по CHUNK_SPANS при первой записи в часть
+    struct ThreadBuffer {
+        static constexpr size_t CHUNK_SPANS = 4096;
+
+        ThreadBuffer(uint64_t trace, size_t thread_index, size_t capacity)
+            : trace(trace)
+            , thread_index(thread_index)
+            , capacity(capacity)
+            , chunks((capacity + CHUNK_SPANS - 1) / CHUNK_SPANS) {
+        }
+
+        ~ThreadBuffer() {
+            for (auto& chunk : chunks) {
+                delete[] chunk.load(std::memory_order_relaxed);
+            }
+        }
+
+        ThreadBuffer(const ThreadBuffer&) = delete;
+        ThreadBuffer& operator=(const ThreadBuffer&) = delete;
+
+        // Слот интервала с номером index для записи; выделяет часть при необходимости
+        Slot& GetSlotForWrite(uint64_t index) {
+            const size_t position = static_cast<size_t>(index % capacity);
+            std::atomic<Slot*>& chunk = chunks[position / CHUNK_SPANS];
+            Slot* slots = chunk.load(std::memory_order_relaxed);
+            if (slots == nullptr) {
+                slots = new Slot[std::min(CHUNK_SPANS, capacity - position / CHUNK_SPANS * CHUNK_SPANS)];
+                chunk.store(slots, std::memory_order_release);
+            }
+            return slots[position % CHUNK_SPANS];
+        }
+
+        // Слот записанного интервала с номером index (index < written)
+        const Slot& GetSlot(uint64_t index) const {
+            const size_t position = static_cast<size_t>(index % capacity);
+            return chunks[position / CHUNK_SPANS].load(std::memory_order_acquire)[position % CHUNK_SPANS];
+        }
+
+        const uint64_t trace;
+        const size_t thread_index;
+        const size_t capacity;
+        std::vector<std::atomic<Slot*>> chunks;
+        std::atomic<uint64_t> written{ 0 };
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        uint64_t last_trace = 0;
+        SpanTraceOptions options;
+        std::chrono::steady_clock::time_point start;
+        // Буферы текущей трассы, в том числе завершившихся потоков
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        // Буферы текущей трассы, освободившиеся при завершении своих потоков
+        std::vector<std::shared_ptr<ThreadBuffer>> free_buffers;
+    };
+
+    Registry& GetRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    // Буфер потока для текущей трассы; при завершении потока возвращается в
+    // реестр, чтобы его занял следующий новый поток, а не выделялся новый
+    struct ThreadBufferHolder {
+        ~ThreadBufferHolder() {
+            if (!buffer) {
+                return;
+            }
+            Registry& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            if (registry.last_trace == buffer->trace) {
+                registry.free_buffers.push_back(std::move(buffer));
+            }
+        }
+
+        std::shared_ptr<ThreadBuffer> buffer;
+    };
+
+    thread_local ThreadBufferHolder thread_buffer;
+
+    ThreadBuffer* GetThreadBuffer(uint64_t trace) {
+        if (thread_buffer.buffer && thread_buffer.buffer->trace == trace) {
+            return thread_buffer.buffer.get();
+        }
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        if (registry.last_trace != trace) {
+            // Трасса сменилась, пока интервал выполнялся
+            return nullptr;
+        }
+        if (!registry.free_buffers.empty()) {
+            thread_buffer.buffer = std::move(registry.free_buffers.back());
+            registry.free_buffers.pop_back();
+            return thread_buffer.buffer.get();
+        }
+        thread_buffer.buffer = std::make_shared<ThreadBuffer>(trace, registry.buffers.size() + 1,
+                                                              registry.options.spans_per_thread);
+        registry.buffers.push_back(thread_buffer.buffer);
+        return thread_buffer.buffer.get();
+    }
+
+    uint64_t GetWrittenSpans(const ThreadBuffer& buffer) {
+        return buffer.written.load(std::memory_order_acquire);
+    }
+
+}  // namespace
+
+namespace span_trace_detail {
+
+    std::atomic<uint64_t> active_trace{ 0 };
+
+    uint64_t Now() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void Record(uint64_t trace, const char* name, uint64_t start, uint64_t finish) {
+        ThreadBuffer* buffer = GetThreadBuffer(trace);
+        if (buffer == nullptr) {
+            return;
+        }
+        const uint64_t index = buffer->written.load(std::memory_order_relaxed);
+        Slot& slot = buffer->GetSlotForWrite(index);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.start.store(start, std::memory_order_relaxed);
+        slot.finish.store(finish, std::memory_order_relaxed);
+        buffer->written.store(index + 1, std::memory_order_release);
+    }
+
+}  // namespace span_trace_detail
+
+void StartSpanTrace(SpanTraceOptions options) {
+    if (options.spans_per_thread == 0) {
+        throw std::invalid_argument("Span buffer must not be empty");
+    }
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.options = options;
+    registry.start = std::chrono::steady_clock::now();
+    registry.buffers.clear();
+    registry.free_buffers.clear();
+    span_trace_detail::active_trace.store(++registry.last_trace, std::memory_order_relaxed);
+}
+
+void StopSpanTrace() {
+    span_trace_detail::active_trace.store(0, std::memory_order_relaxed);
+}
+
+bool IsSpanTraceActive() {
+    return span_trace_detail::active_trace.load(std::memory_order_relaxed) != 0;
+}
+
+void WriteSpanTrace(std::ostream& output) {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    const auto origin = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        registry.start.time_since_epoch()).count());
+
+    // Время в формате Chrome trace - микросекунды, дробная часть сохраняет наносекунды
+    auto write_us = [&output](uint64_t ns) {
+        output << ns / 1000 << '.' << static_cast<char>('0' + ns / 100 % 10) << static_cast<char>('0' + ns / 10 % 10)
+               << static_cast<char>('0' + ns % 10);
+    };
+
+    output << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    bool first = true;
+    for (const auto& buffer : registry.buffers) {
+        output << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+               << buffer->thread_index << ", \"args\": {\"name\": \"thread " << buffer->thread_index << "\"}}";
+        first = false;
+
+        const uint64_t written = GetWrittenSpans(*buffer);
+        const uint64_t begin = written > buffer->capacity ? written - buffer->capacity : 0;
+        for (uint64_t i = begin; i < written; ++i) {
+            const Slot& slot = buffer->GetSlot(i);
+            const uint64_t start = slot.start.load(std::memory_order_relaxed);
+            const uint64_t finish = slot.finish.load(std::memory_order_relaxed);
+            if (start < origin || finish < start) {
+                continue;
+            }
+            output << ",\n{\"name\": \"" << slot.name.load(std::memory_order_relaxed)
+                   << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread_index << ", \"ts\": ";
+            write_us(start - origin);
+            output << ", \"dur\": ";
+            write_us(finish - start);
+            output << '}';
+        }
+    }
+    output << "\n]}\n";
+}
+
+void WriteSpanTraceFile(const std::string& filename) {
+    std::ofstream output(filename);
+    if (!output) {
+        throw std::runtime_error("Cannot open trace file " + filename);
+    }
+    WriteSpanTrace(output);
+    if (!output.flush()) {
+        throw std::runtime_error("Cannot write trace file " + filename);
+    }
+}
+
+size_t GetDroppedSpanCount() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    size_t dropped = 0;
+    for (const auto& buffer : registry.buffers) {
+        const uint64_t written = GetWrittenSpans(*buffer);
+        dropped += static_cast<size_t>(written > buffer->capacity ? written - buffer->capacity : 0);
+    }
+    return dropped;
+}
@@ -0,0 +1,355 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <istream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <utility>
+
+namespace {
+
+    // Заголовок файла трассы
+    constexpr char MAGIC[8] = { 'S', 'P', 'T', 'R', 'A', 'C', 'E', '1' };
+
+    using Op = TraceEvent::Op;
+
+    void PutVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    bool GetVarint(std::string_view data, size_t& offset, uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+            const auto byte = static_cast<unsigned char>(data[offset++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool HasPosition(Op op) {
+        return op <= Op::DeleteCols;
+    }
+
+    bool HasText(Op op) {
+        return op == Op::SetCell || op == Op::TrySetCell;
+    }
+
+    // Разбирает запись, начиная с offset; false, если запись недописана
+    bool ParseEvent(std::string_view data, size_t& offset, std::chrono::nanoseconds& time, TraceEvent& event) {
+        const auto op = static_cast<Op>(data[offset++]);
+        if (op < Op::SetCell || op > Op::PrintTexts) {
+            throw std::runtime_error("Invalid trace record");
+        }
+        event.op = op;
+        uint64_t delta = 0;
+        uint64_t row = 0;
+        uint64_t col = 0;
+        uint64_t length = 0;
+        if (!GetVarint(data, offset, delta)
+            || (HasPosition(op) && (!GetVarint(data, offset, row) || !GetVarint(data, offset, col)))
+            || (HasText(op) && (!GetVarint(data, offset, length) || length > data.size() - offset))) {
+            return false;
+        }
+        time += std::chrono::nanoseconds(delta);
+        event.time = time;
+        // Позиции записываются как есть, в том числе некорректные
+        event.pos = { static_cast<int>(static_cast<uint32_t>(row)), static_cast<int>(static_cast<uint32_t>(col)) };
+        event.text.assign(data.substr(offset, static_cast<size_t>(length)));
+        offset += static_cast<size_t>(length);
+        return true;
+    }
+
+    // Поток, отбрасывающий вывод
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override {
+            return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+
+    void Execute(SheetInterface& sheet, const TraceEvent& event, std::ostream& null_output) {
+        switch (event.op) {
+        case Op::SetCell:
+            sheet.SetCell(event.pos, event.text);
+            break;
+        case Op::TrySetCell:
+            sheet.TrySetCell(event.pos, event.text);
+            break;
+        case Op::GetCell:
+            if (const CellInterface* cell = sheet.GetCell(event.pos)) {
+                // Значение запрашивается, как при отображении ячейки
+                cell->GetValue();
+            }
+            break;
+        case Op::ClearCell:
+            sheet.ClearCell(event.pos);
+            break;
+        case Op::InsertRows:
+            sheet.InsertRows(event.pos.row, event.pos.col);
+            break;
+        case Op::InsertCols:
+            sheet.InsertCols(event.pos.row, event.pos.col);
+            break;
+        case Op::DeleteRows:
+            sheet.DeleteRows(event.pos.row, event.pos.col);
+            break;
+        case Op::DeleteCols:
+            sheet.DeleteCols(event.pos.row, event.pos.col);
+            break;
+        case Op::GetPrintableSize:
+            sheet.GetPrintableSize();
+            break;
+        case Op::PrintValues:
+            sheet.PrintValues(null_output);
+            break;
+        case Op::PrintTexts:
+            sheet.PrintTexts(null_output);
+            break;
+        }
+    }
+
+    double ToMicroseconds(std::chrono::nanoseconds time) {
+        return std::chrono::duration<double, std::micro>(time).count();
+    }
+
+}  // namespace
+
+const char* GetTraceOpName(TraceEvent::Op op) {
+    switch (op) {
+    case Op::SetCell: return "SetCell";
+    case Op::TrySetCell: return "TrySetCell";
+    case Op::GetCell: return "GetCell";
+    case Op::ClearCell: return "ClearCell";
+    case Op::InsertRows: return "InsertRows";
+    case Op::InsertCols: return "InsertCols";
+    case Op::DeleteRows: return "DeleteRows";
+    case Op::DeleteCols: return "DeleteCols";
+    case Op::GetPrintableSize: return "GetPrintableSize";
+    case Op::PrintValues: return "PrintValues";
+    case Op::PrintTexts: return "PrintTexts";
+    }
+    return "Unknown";
+}
+
+RecordingSheet::RecordingSheet(std::unique_ptr<SheetInterface> sheet, std::ostream& output)
+    : sheet_(std::move(sheet))
+    , start_(std::chrono::steady_clock::now())
+    , output_(output) {
+    output_.write(MAGIC, sizeof(MAGIC));
+}
+
+RecordingSheet::~RecordingSheet() {
+    Flush();
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    Record(Op::SetCell, pos, text);
+    sheet_->SetCell(pos, std::move(text));
+}
+
+SetCellResult RecordingSheet::TrySetCell(Position pos, std::string text) {
+    Record(Op::TrySetCell, pos, text);
+    return sheet_->TrySetCell(pos, std::move(text));
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    Record(Op::GetCell, pos);
+    return std::as_const(*sheet_).GetCell(pos);
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    Record(Op::GetCell, pos);
+    return sheet_->GetCell(pos);
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    Record(Op::ClearCell, pos);
+    sheet_->ClearCell(pos);
+}
+
+void RecordingSheet::InsertRows(int before, int count) {
+    Record(Op::InsertRows, { before, count });
+    sheet_->InsertRows(before, count);
+}
+
+void RecordingSheet::InsertCols(int before, int count) {
+    Record(Op::InsertCols, { before, count });
+    sheet_->InsertCols(before, count);
+}
+
+void RecordingSheet::DeleteRows(int first, int count) {
+    Record(Op::DeleteRows, { first, count });
+    sheet_->DeleteRows(first, count);
+}
+
+void RecordingSheet::DeleteCols(int first, int count) {
+    Record(Op::DeleteCols, { first, count });
+    sheet_->DeleteCols(first, count);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    Record(Op::GetPrintableSize);
+    return sheet_->GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    Record(Op::PrintValues);
+    sheet_->PrintValues(output);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    Record(Op::PrintTexts);
+    sheet_->PrintTexts(output);
+}
+
+void RecordingSheet::Flush() {
+    std::lock_guard lock(mutex_);
+    output_.flush();
+}
+
+void RecordingSheet::Record(TraceEvent::Op op, Position pos, std::string_view text) const {
+    std::string record;
+    record.push_back(static_cast<char>(op));
+
+    std::lock_guard lock(mutex_);
+    // Время берётся под блокировкой, чтобы приросты не были отрицательными
+    const auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+    PutVarint(record, static_cast<uint64_t>((time - last_time_).count()));
+    last_time_ = time;
+    if (HasPosition(op)) {
+        PutVarint(record, static_cast<uint32_t>(pos.row));
+        PutVarint(record, static_cast<uint32_t>(pos.col));
+    }
+    if (HasText(op)) {
+        PutVarint(record, text.size());
+        record.append(text);
+    }
+    output_.write(record.data(), static_cast<std::streamsize>(record.size()));
+}
+
+std::vector<TraceEvent> ReadTrace(std::istream& input) {
+    const std::string data{ std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>() };
+    if (data.size() < sizeof(MAGIC) || data.compare(0, sizeof(MAGIC), MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("Invalid trace header");
+    }
+
+    std::vector<TraceEvent> events;
+    std::chrono::nanoseconds time{ 0 };
+    size_t offset = sizeof(MAGIC);
+    while (offset < data.size()) {
+        TraceEvent event;
+        if (!ParseEvent(data, offset, time, event)) {
+            break;
+        }
+        events.push_back(std::move(event));
+    }
+    return events;
+}
+
+void LatencyHistogram::Add(std::chrono::nanoseconds latency) {
+    const auto value = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+    ++buckets_[GetBucket(value)];
+    ++count_;
+    total_ += latency;
+    max_ = std::max(max_, latency);
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetPercentile(double percent) const {
+    if (count_ == 0) {
+        return std::chrono::nanoseconds(0);
+    }
+    // Ранг по методу ближайшего ранга
+    const auto rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(percent / 100.0 * static_cast<double>(count_))), 1);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= rank) {
+            const auto bound = static_cast<int64_t>(GetBucketUpperBound(bucket));
+            return std::min(std::chrono::nanoseconds(bound), max_);
+        }
+    }
+    return max_;
+}
+
+size_t LatencyHistogram::GetBucket(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+    int msb = 3;
+    while (msb < 63 && (value >> (msb + 1)) != 0) {
+        ++msb;
+    }
+    // Три бита после старшего выбирают часть степени двойки
+    const size_t sub = static_cast<size_t>((value >> (msb - 3)) & (SUB_BUCKETS - 1));
+    return static_cast<size_t>(msb - 2) * SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    const size_t msb = bucket / SUB_BUCKETS + 2;
+    const uint64_t sub = bucket % SUB_BUCKETS;
+    const uint64_t width = uint64_t{ 1 } << (msb - 3);
+    return (SUB_BUCKETS + sub) * width + (width - 1);
+}
+
+void ReplayReport::Print(std::ostream& output) const {
+    output << std::left << std::setw(18) << "operation" << std::right << std::setw(10) << "calls"
+           << std::setw(12) << "mean us" << std::setw(12) << "p50 us" << std::setw(12) << "p90 us"
+           << std::setw(12) << "p99 us" << std::setw(12) << "max us" << '\n';
+    output << std::fixed << std::setprecision(2);
+    for (size_t op = 0; op < latencies.size(); ++op) {
+        const LatencyHistogram& histogram = latencies[op];
+        if (histogram.GetCount() == 0) {
+            continue;
+        }
+        output << std::left << std::setw(18) << GetTraceOpName(static_cast<Op>(op)) << std::right
+               << std::setw(10) << histogram.GetCount()
+               << std::setw(12) << ToMicroseconds(histogram.GetTotal()) / static_cast<double>(histogram.GetCount())
+               << std::setw(12) << ToMicroseconds(histogram.GetPercentile(50))
+               << std::setw(12) << ToMicroseconds(histogram.GetPercentile(90))
+               << std::setw(12) << ToMicroseconds(histogram.GetPercentile(99))
+               << std::setw(12) << ToMicroseconds(histogram.GetMax()) << '\n';
+    }
+    output << "failed calls: " << failed << ", elapsed: " << ToMicroseconds(elapsed) / 1000.0 << " ms\n";
+}
+
+ReplayReport ReplayTrace(SheetInterface& sheet, const std::vector<TraceEvent>& events, ReplayOptions options) {
+    using Clock = std::chrono::steady_clock;
+
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+    ReplayReport report;
+    const auto start = Clock::now();
+    for (const TraceEvent& event : events) {
+        if (options.paced) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double, std::nano>(static_cast<double>(event.time.count()) / options.speed)));
+        }
+        const auto call_start = Clock::now();
+        try {
+            Execute(sheet, event, null_output);
+        } catch (const std::exception&) {
+            ++report.failed;
+        }
+        report.latencies[static_cast<size_t>(event.op)].Add(Clock::now() - call_start);
+    }
+    report.elapsed = Clock::now() - start;
+    return report;
+}
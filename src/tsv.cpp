@@ -0,0 +1,105 @@
+#include "tsv.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPREADSHEET_TSV_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace {
+
+    // Собирает поля по мере того, как сканер находит разделители
+    class FieldCollector {
+    public:
+        FieldCollector(std::string_view data, std::vector<TsvField>& fields)
+            : data_(data)
+            , fields_(fields) {
+        }
+
+        // Обрабатывает разделитель, стоящий в позиции offset
+        void OnSeparator(size_t offset) {
+            std::string_view text = data_.substr(field_start_, offset - field_start_);
+            if (data_[offset] == '\n') {
+                if (!text.empty() && text.back() == '\r') {
+                    text.remove_suffix(1);
+                }
+                Emit(text);
+                ++row_;
+                col_ = 0;
+            } else {
+                Emit(text);
+                ++col_;
+            }
+            field_start_ = offset + 1;
+        }
+
+        // Обрабатывает последнее поле файла без завершающего перевода строки
+        void Finish() {
+            if (field_start_ < data_.size()) {
+                std::string_view text = data_.substr(field_start_);
+                if (text.back() == '\r') {
+                    text.remove_suffix(1);
+                }
+                Emit(text);
+            }
+        }
+
+    private:
+        void Emit(std::string_view text) {
+            if (!text.empty()) {
+                fields_.push_back({ { row_, col_ }, text });
+            }
+        }
+
+    private:
+        std::string_view data_;
+        std::vector<TsvField>& fields_;
+        size_t field_start_ = 0;
+        int row_ = 0;
+        int col_ = 0;
+    };
+
+#ifdef SPREADSHEET_TSV_SSE2
+    int CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+#endif
+
+}  // namespace
+
+std::vector<TsvField> SplitTsv(std::string_view data) {
+    std::vector<TsvField> fields;
+    FieldCollector collector(data, fields);
+
+    size_t offset = 0;
+#ifdef SPREADSHEET_TSV_SSE2
+    // Сравниваем по 16 байт за раз и обходим найденные разделители по битовой маске
+    const __m128i tabs = _mm_set1_epi8('\t');
+    const __m128i newlines = _mm_set1_epi8('\n');
+    for (; offset + 16 <= data.size(); offset += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data.data() + offset));
+        const __m128i separators = _mm_or_si128(_mm_cmpeq_epi8(chunk, tabs), _mm_cmpeq_epi8(chunk, newlines));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(separators));
+        while (mask != 0) {
+            collector.OnSeparator(offset + CountTrailingZeros(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; offset < data.size(); ++offset) {
+        if (data[offset] == '\t' || data[offset] == '\n') {
+            collector.OnSeparator(offset);
+        }
+    }
+    collector.Finish();
+
+    return fields;
+}
@@ -0,0 +1,142 @@
+#include "undo_history.h"
+
+#include <algorithm>
+
+CellDelta::CellDelta(std::vector<Entry> cells) {
+    std::stable_sort(cells.begin(), cells.end(), [](const Entry& lhs, const Entry& rhs) {
+        return lhs.first < rhs.first;
+    });
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const Position pos = cells[i].first;
+        if (i > 0 && cells[i - 1].first == pos) {
+            continue;
+        }
+        if (runs_.empty() || runs_.back().start.row != pos.row
+            || runs_.back().start.col + static_cast<int>(runs_.back().cells.size()) != pos.col) {
+            runs_.push_back({ pos, {} });
+        }
+        runs_.back().cells.push_back(std::move(cells[i].second));
+    }
+}
+
+size_t CellDelta::GetCellCount() const {
+    size_t count = 0;
+    for (const Run& run : runs_) {
+        count += run.cells.size();
+    }
+    return count;
+}
+
+size_t CellDelta::GetMemoryUsage() const {
+    size_t memory = runs_.capacity() * sizeof(Run);
+    for (const Run& run : runs_) {
+        memory += run.cells.capacity() * sizeof(std::optional<Cell>);
+        for (const auto& cell : run.cells) {
+            if (cell) {
+                memory += cell->GetTextSize();
+            }
+        }
+    }
+    return memory;
+}
+
+void UndoHistory::Enable(UndoOptions options) {
+    std::lock_guard lock(mutex_);
+    options_ = options;
+    Evict();
+}
+
+void UndoHistory::Disable() {
+    Clear();
+    options_.reset();
+}
+
+void UndoHistory::Record(UndoStep step) {
+    std::lock_guard lock(mutex_);
+    step.time = std::chrono::steady_clock::now();
+    for (const UndoStep& redo : redo_) {
+        memory_ -= redo.memory;
+    }
+    redo_.clear();
+    if (step.coalesce_pos && !undo_.empty()) {
+        UndoStep& last = undo_.back();
+        if (last.coalesce_pos && *last.coalesce_pos == *step.coalesce_pos
+            && step.time - last.time < options_->coalesce_interval) {
+            // Промежуточное содержимое ячейки не нужно: отмена вернёт исходное
+            last.time = step.time;
+            return;
+        }
+    }
+    Put(undo_, std::move(step));
+}
+
+std::optional<UndoStep> UndoHistory::TakeUndo() {
+    std::lock_guard lock(mutex_);
+    return Take(undo_);
+}
+
+std::optional<UndoStep> UndoHistory::TakeRedo() {
+    std::lock_guard lock(mutex_);
+    return Take(redo_);
+}
+
+void UndoHistory::PutUndo(UndoStep step) {
+    std::lock_guard lock(mutex_);
+    // Повторённый шаг не объединяется со следующими правками
+    step.coalesce_pos.reset();
+    Put(undo_, std::move(step));
+}
+
+void UndoHistory::PutRedo(UndoStep step) {
+    std::lock_guard lock(mutex_);
+    Put(redo_, std::move(step));
+}
+
+bool UndoHistory::CanUndo() const {
+    std::lock_guard lock(mutex_);
+    return !undo_.empty();
+}
+
+bool UndoHistory::CanRedo() const {
+    std::lock_guard lock(mutex_);
+    return !redo_.empty();
+}
+
+size_t UndoHistory::GetMemoryUsage() const {
+    std::lock_guard lock(mutex_);
+    return memory_;
+}
+
+void UndoHistory::Clear() {
+    std::lock_guard lock(mutex_);
+    undo_.clear();
+    redo_.clear();
+    memory_ = 0;
+}
+
+void UndoHistory::Put(std::deque<UndoStep>& steps, UndoStep step) {
+    // Содержимое ячеек шага меняется при каждой отмене и повторе
+    step.memory = sizeof(UndoStep) + step.order.capacity() * sizeof(int) + step.cells.GetMemoryUsage();
+    memory_ += step.memory;
+    steps.push_back(std::move(step));
+    Evict();
+}
+
+std::optional<UndoStep> UndoHistory::Take(std::deque<UndoStep>& steps) {
+    if (steps.empty()) {
+        return std::nullopt;
+    }
+    UndoStep step = std::move(steps.back());
+    steps.pop_back();
+    memory_ -= step.memory;
+    return step;
+}
+
+void UndoHistory::Evict() {
+    while (options_ && memory_ > options_->memory_budget && undo_.size() + redo_.size() > 1) {
+        // Сначала забываются самые старые правки, затем самые дальние повторы
+        std::deque<UndoStep>& steps = undo_.empty() ? redo_ : undo_;
+        memory_ -= steps.front().memory;
+        steps.pop_front();
+    }
+}
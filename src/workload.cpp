@@ -0,0 +1,218 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <ostream>
+
+namespace {
+
+    // Генератор SplitMix64. Распределения стандартной библиотеки зависят от
+    // реализации, поэтому числа из него получаются вручную
+    class WorkloadRandom {
+    public:
+        explicit WorkloadRandom(uint64_t state)
+            : state_(state) {
+        }
+
+        uint64_t Next() {
+            uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        // Равномерное число из [0, 1)
+        double NextUnit() {
+            return static_cast<double>(Next() >> 11) * 0x1.0p-53;
+        }
+
+        // Равномерное число из [0, bound)
+        uint64_t NextBelow(uint64_t bound) {
+            return bound == 0 ? 0 : Next() % bound;
+        }
+
+    private:
+        uint64_t state_;
+    };
+
+    WorkloadRandom RandomFor(uint64_t seed, uint64_t stream, uint64_t index) {
+        WorkloadRandom mixer(seed ^ (stream * 0xD6E8FEB86659FD93ull));
+        return WorkloadRandom(mixer.Next() ^ index);
+    }
+
+    // Независимые потоки чисел: для присутствия ячейки, её содержимого и столбцов
+    enum Stream : uint64_t {
+        PRESENCE = 1,
+        CONTENT = 2,
+        COLUMN = 3,
+    };
+
+    uint64_t CellIndex(Position pos) {
+        return static_cast<uint64_t>(pos.row) * Position::MAX_COLS + static_cast<uint64_t>(pos.col);
+    }
+
+    bool IsPresent(const WorkloadOptions& options, Position pos) {
+        return options.density >= 1.0 || RandomFor(options.seed, PRESENCE, CellIndex(pos)).NextUnit() < options.density;
+    }
+
+    bool IsTextColumn(const WorkloadOptions& options, int col) {
+        return options.text_column_ratio > 0.0
+            && RandomFor(options.seed, COLUMN, static_cast<uint64_t>(col)).NextUnit() < options.text_column_ratio;
+    }
+
+    // Число с одним знаком после точки или целое, всегда ненулевое
+    void AppendNumber(WorkloadRandom& random, std::string& text) {
+        text += std::to_string(1 + random.NextBelow(999));
+        if (random.NextBelow(2) == 0) {
+            text += '.';
+            text += static_cast<char>('1' + random.NextBelow(9));
+        }
+    }
+
+    // Выражение глубины depth: на каждом уровне к подвыражению в скобках
+    // применяется операция с числом. Делитель всегда число, поэтому деление
+    // на ноль не возникает
+    void AppendExpression(WorkloadRandom& random, int depth, std::string& text) {
+        if (depth <= 0) {
+            AppendNumber(random, text);
+            return;
+        }
+        static constexpr char OPERATIONS[] = { '+', '-', '*', '/' };
+        const char operation = OPERATIONS[random.NextBelow(4)];
+        if (operation != '/' && random.NextBelow(2) == 0) {
+            AppendNumber(random, text);
+            text += operation;
+            text += '(';
+            AppendExpression(random, depth - 1, text);
+            text += ')';
+        } else {
+            text += '(';
+            AppendExpression(random, depth - 1, text);
+            text += ')';
+            text += operation;
+            AppendNumber(random, text);
+        }
+    }
+
+    // Слова из строчных латинских букв, поэтому текст не начинается со знака
+    // формулы или экранирования. Длина - от половины до полутора length
+    void AppendWords(WorkloadRandom& random, size_t length, std::string& text) {
+        const size_t target = std::max<size_t>(length / 2 + random.NextBelow(length + 1), 1);
+        while (text.size() < target) {
+            if (!text.empty()) {
+                text += ' ';
+            }
+            const size_t word = 2 + random.NextBelow(8);
+            for (size_t i = 0; i < word; ++i) {
+                text += static_cast<char>('a' + random.NextBelow(26));
+            }
+        }
+        text.resize(target);
+        if (text.back() == ' ') {
+            text.back() = '.';
+        }
+    }
+
+    void CheckSize(Size size) {
+        if (size.rows < 0 || size.cols < 0 || size.rows > Position::MAX_ROWS || size.cols > Position::MAX_COLS) {
+            throw InvalidPositionException("Invalid workload size");
+        }
+    }
+
+    // Вызывает func(pos, text) для заполненных ячеек в порядке строк
+    template <typename Func>
+    size_t ForEachWorkloadCell(const WorkloadOptions& options, Func func) {
+        CheckSize(options.size);
+        size_t count = 0;
+        for (int row = 0; row < options.size.rows; ++row) {
+            for (int col = 0; col < options.size.cols; ++col) {
+                std::string text = GenerateCellText(options, { row, col });
+                if (!text.empty()) {
+                    func(Position{ row, col }, std::move(text));
+                    ++count;
+                }
+            }
+        }
+        return count;
+    }
+
+}  // namespace
+
+WorkloadOptions DenseNumericWorkload(Size size, uint64_t seed) {
+    WorkloadOptions options;
+    options.seed = seed;
+    options.size = size;
+    return options;
+}
+
+WorkloadOptions SparseScatterWorkload(Size size, double density, uint64_t seed) {
+    WorkloadOptions options;
+    options.seed = seed;
+    options.size = size;
+    options.density = density;
+    options.text_column_ratio = 0.2;
+    return options;
+}
+
+WorkloadOptions TextColumnsWorkload(Size size, size_t text_length, uint64_t seed) {
+    WorkloadOptions options;
+    options.seed = seed;
+    options.size = size;
+    options.text_column_ratio = 0.5;
+    options.text_length = text_length;
+    return options;
+}
+
+WorkloadOptions DeepFormulaWorkload(Size size, int depth, uint64_t seed) {
+    WorkloadOptions options;
+    options.seed = seed;
+    options.size = size;
+    options.formula_ratio = 1.0;
+    options.formula_depth = depth;
+    return options;
+}
+
+std::string GenerateCellText(const WorkloadOptions& options, Position pos) {
+    std::string text;
+    if (!IsPresent(options, pos)) {
+        return text;
+    }
+    WorkloadRandom random = RandomFor(options.seed, CONTENT, CellIndex(pos));
+    if (IsTextColumn(options, pos.col)) {
+        AppendWords(random, options.text_length, text);
+    } else if (random.NextUnit() < options.formula_ratio) {
+        text += FORMULA_SIGN;
+        AppendExpression(random, options.formula_depth, text);
+    } else {
+        AppendNumber(random, text);
+    }
+    return text;
+}
+
+size_t FillSheet(SheetInterface& sheet, const WorkloadOptions& options) {
+    return ForEachWorkloadCell(options, [&sheet](Position pos, std::string text) {
+        sheet.SetCell(pos, std::move(text));
+    });
+}
+
+size_t WriteWorkloadTsv(std::ostream& output, const WorkloadOptions& options) {
+    // Первый проход находит границы заполненной области, как GetPrintableSize()
+    Size printable;
+    ForEachWorkloadCell(options, [&printable](Position pos, const std::string&) {
+        printable.rows = std::max(printable.rows, pos.row + 1);
+        printable.cols = std::max(printable.cols, pos.col + 1);
+    });
+
+    size_t count = 0;
+    for (int row = 0; row < printable.rows; ++row) {
+        for (int col = 0; col < printable.cols; ++col) {
+            if (col > 0) {
+                output << '\t';
+            }
+            const std::string text = GenerateCellText(options, { row, col });
+            output << text;
+            count += text.empty() ? 0 : 1;
+        }
+        output << '\n';
+    }
+    return count;
+}
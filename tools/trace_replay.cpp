@@ -0,0 +1,57 @@
+#include "common.h"
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Воспроизводит трассу вызовов, записанную RecordingSheet, над новой таблицей
+// CreateSheet() и печатает задержки по операциям:
+//   spreadsheet_replay TRACE [--paced] [--speed=X]
+
+int main(int argc, char** argv) {
+    std::string trace_path;
+    ReplayOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--paced") {
+            options.paced = true;
+        } else if (arg.substr(0, 8) == "--speed=") {
+            try {
+                options.speed = std::stod(std::string(arg.substr(8)));
+            } catch (const std::exception&) {
+                options.speed = 0;
+            }
+            if (!(options.speed > 0)) {
+                std::cerr << "Invalid speed: " << arg << '\n';
+                return 2;
+            }
+        } else if (trace_path.empty() && arg.substr(0, 2) != "--") {
+            trace_path = arg;
+        } else {
+            trace_path.clear();
+            break;
+        }
+    }
+    if (trace_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " TRACE [--paced] [--speed=X]\n";
+        return 2;
+    }
+
+    std::ifstream input(trace_path, std::ios::binary);
+    if (!input) {
+        std::cerr << "Cannot open " << trace_path << '\n';
+        return 1;
+    }
+    try {
+        const auto events = ReadTrace(input);
+        auto sheet = CreateSheet();
+        ReplayTrace(*sheet, events, options).Print(std::cout);
+    } catch (const std::runtime_error& e) {
+        std::cerr << trace_path << ": " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}